@@ -43,6 +43,8 @@ extern void irq_remapping_disable(void);
 extern int irq_remapping_reenable(int);
 extern int irq_remap_enable_fault_handling(void);
 extern void panic_if_irq_remap(const char *msg);
+extern void irq_remapping_batch_begin(void);
+extern void irq_remapping_batch_end(void);
 
 /* Get parent irqdomain for interrupt remapping irqdomain */
 static inline struct irq_domain *arch_get_ir_parent_domain(void)
@@ -59,6 +61,8 @@ static inline int irq_remapping_enable(void) { return -ENODEV; }
 static inline void irq_remapping_disable(void) { }
 static inline int irq_remapping_reenable(int eim) { return -ENODEV; }
 static inline int irq_remap_enable_fault_handling(void) { return -ENODEV; }
+static inline void irq_remapping_batch_begin(void) { }
+static inline void irq_remapping_batch_end(void) { }
 
 static inline void panic_if_irq_remap(const char *msg)
 {
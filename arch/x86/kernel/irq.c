@@ -16,6 +16,7 @@
 #include <asm/irq_stack.h>
 #include <asm/apic.h>
 #include <asm/io_apic.h>
+#include <asm/irq_remapping.h>
 #include <asm/irq.h>
 #include <asm/mce.h>
 #include <asm/hw_irq.h>
@@ -344,7 +345,13 @@ void fixup_irqs(void)
 	struct irq_data *data;
 	struct irq_chip *chip;
 
+	/*
+	 * Interrupts still reaching this CPU until the remapping entries are
+	 * flushed are caught by the IRR check below.
+	 */
+	irq_remapping_batch_begin();
 	irq_migrate_all_off_this_cpu();
+	irq_remapping_batch_end();
 
 	/*
 	 * We can remove mdelay() and then send spurious interrupts to
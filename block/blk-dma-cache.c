@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * DMA mapping cache for long lived, pre-registered I/O buffers
+ *
+ * Buffers such as io_uring fixed buffers stay pinned for a long time and are
+ * used for many I/Os. Instead of mapping their pages for every request, map
+ * the whole buffer once per device into a single IOVA range and hand out
+ * offsets into it until the buffer is unregistered.
+ *
+ * Buffers can be gigabytes, too large to map from the atomic submission path.
+ * The first I/O to a device only queues a work item that maps the buffer in
+ * process context. I/Os are mapped the normal way until the mapping is ready.
+ *
+ * The mapping of a device is a devres of the driver bound to it, so it goes
+ * away when the driver is unbound, and is created again for the next driver
+ * on its first I/O.
+ */
+#include <linux/bio.h>
+#include <linux/blk-mq.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/maple_tree.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/wait_bit.h>
+#include <linux/workqueue.h>
+
+struct blk_dma_map {
+	struct list_head entry;
+	struct blk_dma_cache *cache;
+	/* Not referenced, the map is released when the driver is unbound */
+	struct device *dev;
+	struct sg_table sgt;
+	/* DMA_MAPPING_ERROR if the buffer cannot be cached for the device */
+	dma_addr_t addr;
+};
+
+struct blk_dma_cache {
+	const struct bio_vec *bvec;
+	unsigned int nr_bvecs;
+	spinlock_t lock;
+	struct list_head maps;
+	/* Maps not released yet, including those being released by an unbind */
+	atomic_t nr_maps;
+	/* Device whose map is being created by map_work, holds a reference */
+	struct device *map_dev;
+	struct work_struct map_work;
+};
+
+/* bvec array address range -> struct blk_dma_cache */
+static DEFINE_MTREE(blk_dma_caches);
+
+static void blk_dma_cache_map_work(struct work_struct *work);
+
+/**
+ * blk_dma_cache_create - set up DMA mapping caching for a registered buffer
+ * @bvec: bvecs describing the buffer, must stay valid until destroyed
+ * @nr_bvecs: number of entries in @bvec
+ *
+ * Bios whose bvec array points into @bvec are recognized by
+ * blk_rq_dma_map_cached() from then on. Only buffers that are virtually
+ * contiguous, i.e. every bvec but the first starts on and every bvec but
+ * the last ends on a page boundary, can be cached.
+ *
+ * Returns the cache or %NULL, in which case the buffer is mapped per I/O.
+ */
+struct blk_dma_cache *blk_dma_cache_create(const struct bio_vec *bvec,
+		unsigned int nr_bvecs)
+{
+	struct blk_dma_cache *cache;
+	unsigned int i;
+
+	if (!nr_bvecs)
+		return NULL;
+
+	for (i = 0; i < nr_bvecs; i++) {
+		if (i && bvec[i].bv_offset)
+			return NULL;
+		if (i != nr_bvecs - 1 &&
+		    bvec[i].bv_offset + bvec[i].bv_len != PAGE_SIZE)
+			return NULL;
+	}
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return NULL;
+
+	cache->bvec = bvec;
+	cache->nr_bvecs = nr_bvecs;
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->maps);
+	atomic_set(&cache->nr_maps, 0);
+	INIT_WORK(&cache->map_work, blk_dma_cache_map_work);
+
+	if (mtree_store_range(&blk_dma_caches, (unsigned long)bvec,
+			      (unsigned long)(bvec + nr_bvecs) - 1, cache,
+			      GFP_KERNEL)) {
+		kfree(cache);
+		return NULL;
+	}
+	return cache;
+}
+EXPORT_SYMBOL_GPL(blk_dma_cache_create);
+
+/* devres release, called on driver unbind or from blk_dma_cache_destroy() */
+static void blk_dma_map_release(struct device *dev, void *res)
+{
+	struct blk_dma_map *map = res;
+	struct blk_dma_cache *cache = map->cache;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_del_init(&map->entry);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (map->addr != DMA_MAPPING_ERROR) {
+		dma_unmap_sgtable(dev, &map->sgt, DMA_BIDIRECTIONAL, 0);
+		sg_free_table(&map->sgt);
+	}
+	if (atomic_dec_and_test(&cache->nr_maps))
+		wake_up_var(&cache->nr_maps);
+}
+
+static int blk_dma_map_match(struct device *dev, void *res, void *data)
+{
+	return res == data;
+}
+
+/**
+ * blk_dma_cache_destroy - tear down all cached mappings of a buffer
+ * @cache: cache returned by blk_dma_cache_create()
+ *
+ * The caller must make sure no I/O using the buffer is still in flight.
+ * Returns once the buffer is unmapped from every device.
+ */
+void blk_dma_cache_destroy(struct blk_dma_cache *cache)
+{
+	struct blk_dma_map *map;
+	struct device *dev;
+
+	mtree_erase(&blk_dma_caches, (unsigned long)cache->bvec);
+	if (cancel_work_sync(&cache->map_work))
+		put_device(cache->map_dev);
+
+	spin_lock_irq(&cache->lock);
+	while ((map = list_first_entry_or_null(&cache->maps,
+					       struct blk_dma_map, entry))) {
+		list_del_init(&map->entry);
+		dev = get_device(map->dev);
+		spin_unlock_irq(&cache->lock);
+		/* Fails if an unbind already took it, which then releases it */
+		devres_release(dev, blk_dma_map_release, blk_dma_map_match,
+			       map);
+		put_device(dev);
+		spin_lock_irq(&cache->lock);
+	}
+	spin_unlock_irq(&cache->lock);
+
+	wait_var_event(&cache->nr_maps, !atomic_read(&cache->nr_maps));
+	kfree(cache);
+}
+EXPORT_SYMBOL_GPL(blk_dma_cache_destroy);
+
+/*
+ * Returns 0 with map->addr set to DMA_MAPPING_ERROR if the buffer can never be
+ * cached for the device, or an error if mapping it failed this time.
+ */
+static int blk_dma_cache_map(struct blk_dma_cache *cache,
+		struct blk_dma_map *map, struct device *dev)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+	int ret;
+
+	map->addr = DMA_MAPPING_ERROR;
+
+	/* Without an IOMMU there is no mapping cost worth caching */
+	if (!dma_get_merge_boundary(dev))
+		return 0;
+
+	ret = sg_alloc_table(&map->sgt, cache->nr_bvecs, GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	for_each_sgtable_sg(&map->sgt, sg, i)
+		sg_set_page(sg, cache->bvec[i].bv_page, cache->bvec[i].bv_len,
+			    cache->bvec[i].bv_offset);
+
+	ret = dma_map_sgtable(dev, &map->sgt, DMA_BIDIRECTIONAL,
+			      DMA_ATTR_NO_WARN);
+	if (ret)
+		goto out_free_table;
+
+	/*
+	 * Offsets into the buffer only translate to DMA addresses if the IOMMU
+	 * placed it in one range, and a cached mapping cannot be synced per I/O.
+	 */
+	if (map->sgt.nents != 1 ||
+	    dma_need_sync(dev, sg_dma_address(map->sgt.sgl)))
+		goto out_unmap;
+
+	map->addr = sg_dma_address(map->sgt.sgl);
+	return 0;
+
+out_unmap:
+	dma_unmap_sgtable(dev, &map->sgt, DMA_BIDIRECTIONAL, 0);
+out_free_table:
+	sg_free_table(&map->sgt);
+	return ret;
+}
+
+static struct blk_dma_map *blk_dma_cache_find(struct blk_dma_cache *cache,
+		struct device *dev)
+{
+	struct blk_dma_map *map;
+
+	list_for_each_entry(map, &cache->maps, entry)
+		if (map->dev == dev)
+			return map;
+	return NULL;
+}
+
+static void blk_dma_cache_map_work(struct work_struct *work)
+{
+	struct blk_dma_cache *cache =
+		container_of(work, struct blk_dma_cache, map_work);
+	struct device *dev = cache->map_dev;
+	struct blk_dma_map *map;
+
+	/* Tie the map to the driver bound now, not to one already gone */
+	device_lock(dev);
+	if (!dev->driver)
+		goto out_unlock;
+
+	map = devres_alloc(blk_dma_map_release, sizeof(*map), GFP_KERNEL);
+	if (!map)
+		goto out_unlock;
+	INIT_LIST_HEAD(&map->entry);
+	map->cache = cache;
+	map->dev = dev;
+	/* Try again on a later I/O, only a structural failure is cached */
+	if (blk_dma_cache_map(cache, map, dev)) {
+		devres_free(map);
+		goto out_unlock;
+	}
+
+	spin_lock_irq(&cache->lock);
+	list_add(&map->entry, &cache->maps);
+	atomic_inc(&cache->nr_maps);
+	devres_add(dev, map);
+	spin_unlock_irq(&cache->lock);
+
+out_unlock:
+	device_unlock(dev);
+	spin_lock_irq(&cache->lock);
+	cache->map_dev = NULL;
+	spin_unlock_irq(&cache->lock);
+	put_device(dev);
+}
+
+/*
+ * Returns the map of @dev, or %NULL after making sure it is being created.
+ * Only one map is created at a time, other devices ask again on a later I/O.
+ */
+static struct blk_dma_map *blk_dma_cache_get(struct blk_dma_cache *cache,
+		struct device *dev)
+{
+	struct blk_dma_map *map;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	map = blk_dma_cache_find(cache, dev);
+	if (!map && !cache->map_dev) {
+		cache->map_dev = get_device(dev);
+		queue_work(system_unbound_wq, &cache->map_work);
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return map;
+}
+
+/**
+ * blk_rq_dma_map_cached - look up a cached DMA address for a request
+ * @rq: request to map
+ * @dev: device doing the DMA
+ * @dma_addr: returns the DMA address of the request's payload
+ *
+ * If @rq transfers a contiguous range of a buffer registered with
+ * blk_dma_cache_create(), return the DMA address of that range in the
+ * buffer's mapping for @dev. The first request to @dev only starts creating
+ * the mapping in the background. The payload is then contiguous in DMA space
+ * for blk_rq_payload_bytes() and must not be unmapped by the driver.
+ *
+ * Returns %true if @dma_addr is valid, %false if the request has to be
+ * mapped the normal way.
+ */
+bool blk_rq_dma_map_cached(struct request *rq, struct device *dev,
+		dma_addr_t *dma_addr)
+{
+	struct bio *bio = rq->bio;
+	struct blk_dma_cache *cache;
+	struct blk_dma_map *map;
+	unsigned int idx;
+	size_t offset;
+
+	if (!bio || bio != rq->biotail || (rq->rq_flags & RQF_SPECIAL_PAYLOAD))
+		return false;
+
+	cache = mtree_load(&blk_dma_caches, (unsigned long)bio->bi_io_vec);
+	if (!cache)
+		return false;
+
+	map = blk_dma_cache_get(cache, dev);
+	if (!map || map->addr == DMA_MAPPING_ERROR)
+		return false;
+
+	idx = bio->bi_io_vec - cache->bvec + bio->bi_iter.bi_idx;
+	offset = idx ? cache->bvec[0].bv_len + (size_t)(idx - 1) * PAGE_SIZE : 0;
+	*dma_addr = map->addr + offset + bio->bi_iter.bi_bvec_done;
+	return true;
+}
+EXPORT_SYMBOL_GPL(blk_rq_dma_map_cached);
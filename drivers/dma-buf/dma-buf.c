@@ -1602,6 +1602,33 @@ void dma_buf_vunmap_unlocked(struct dma_buf *dmabuf, struct iosys_map *map)
 }
 EXPORT_SYMBOL_NS_GPL(dma_buf_vunmap_unlocked, DMA_BUF);
 
+/**
+ * dma_buf_get_mmio_range - Get the MMIO range backing a buffer
+ * @dmabuf:	[in]	buffer to query
+ * @phys:	[out]	physical start address of the range
+ * @size:	[out]	size of the range in bytes
+ *
+ * This is for importers that map the buffer into an IOMMU themselves, for
+ * instance to give a device peer-to-peer access to another device's BAR.
+ * The range stays valid for as long as the caller holds a reference on
+ * @dmabuf.
+ *
+ * Returns 0 on success, -EOPNOTSUPP if the buffer is not backed by a single
+ * MMIO range, or another negative errno code from the exporter.
+ */
+int dma_buf_get_mmio_range(struct dma_buf *dmabuf, phys_addr_t *phys,
+			   size_t *size)
+{
+	if (WARN_ON(!dmabuf))
+		return -EINVAL;
+
+	if (!dmabuf->ops->get_mmio_range)
+		return -EOPNOTSUPP;
+
+	return dmabuf->ops->get_mmio_range(dmabuf, phys, size);
+}
+EXPORT_SYMBOL_NS_GPL(dma_buf_get_mmio_range, DMA_BUF);
+
 #ifdef CONFIG_DEBUG_FS
 static int dma_buf_debug_show(struct seq_file *s, void *unused)
 {
@@ -10,6 +10,7 @@
 #include <linux/iommu.h>
 
 #include "amd_iommu_types.h"
+#include "../iommu-pages.h"
 
 irqreturn_t amd_iommu_int_thread(int irq, void *data);
 irqreturn_t amd_iommu_int_thread_evtlog(int irq, void *data);
@@ -124,12 +125,15 @@ static inline int get_pci_sbdf_id(struct pci_dev *pdev)
 	return PCI_SEG_DEVID_TO_SBDF(seg, devid);
 }
 
-static inline void *alloc_pgtable_page(int nid, gfp_t gfp)
+static inline void *alloc_pgtable_page(struct protection_domain *dom,
+				       gfp_t gfp)
 {
-	struct page *page;
+	return iommu_alloc_pages_node(&dom->domain, dom->nid, gfp, 0);
+}
 
-	page = alloc_pages_node(nid, gfp | __GFP_ZERO, 0);
-	return page ? page_address(page) : NULL;
+static inline void free_pgtable_page(struct protection_domain *dom, void *pt)
+{
+	iommu_free_pages(&dom->domain, pt, 0);
 }
 
 bool translation_pre_enabled(struct amd_iommu *iommu);
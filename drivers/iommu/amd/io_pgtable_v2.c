@@ -99,12 +99,7 @@ static inline int page_size_to_level(u64 pg_size)
 	return PAGE_MODE_1_LEVEL;
 }
 
-static inline void free_pgtable_page(u64 *pt)
-{
-	free_page((unsigned long)pt);
-}
-
-static void free_pgtable(u64 *pt, int level)
+static void free_pgtable(struct protection_domain *pdom, u64 *pt, int level)
 {
 	u64 *p;
 	int i;
@@ -123,17 +118,18 @@ static void free_pgtable(u64 *pt, int level)
 		 */
 		p = get_pgtable_pte(pt[i]);
 		if (level > 2)
-			free_pgtable(p, level - 1);
+			free_pgtable(pdom, p, level - 1);
 		else
-			free_pgtable_page(p);
+			free_pgtable_page(pdom, p);
 	}
 
-	free_pgtable_page(pt);
+	free_pgtable_page(pdom, pt);
 }
 
 /* Allocate page table */
-static u64 *v2_alloc_pte(int nid, u64 *pgd, unsigned long iova,
-			 unsigned long pg_size, gfp_t gfp, bool *updated)
+static u64 *v2_alloc_pte(struct protection_domain *pdom, u64 *pgd,
+			 unsigned long iova, unsigned long pg_size, gfp_t gfp,
+			 bool *updated)
 {
 	u64 *pte, *page;
 	int level, end_level;
@@ -156,14 +152,14 @@ static u64 *v2_alloc_pte(int nid, u64 *pgd, unsigned long iova,
 		}
 
 		if (!IOMMU_PTE_PRESENT(__pte)) {
-			page = alloc_pgtable_page(nid, gfp);
+			page = alloc_pgtable_page(pdom, gfp);
 			if (!page)
 				return NULL;
 
 			__npte = set_pgtable_attr(page);
 			/* pte could have been changed somewhere. */
 			if (cmpxchg64(pte, __pte, __npte) != __pte)
-				free_pgtable_page(page);
+				free_pgtable_page(pdom, page);
 			else if (IOMMU_PTE_PRESENT(__pte))
 				*updated = true;
 
@@ -183,9 +179,9 @@ static u64 *v2_alloc_pte(int nid, u64 *pgd, unsigned long iova,
 		__pte = get_pgtable_pte(*pte);
 		cmpxchg64(pte, *pte, 0ULL);
 		if (pg_size == IOMMU_PAGE_SIZE_1G)
-			free_pgtable(__pte, end_level - 1);
+			free_pgtable(pdom, __pte, end_level - 1);
 		else if (pg_size == IOMMU_PAGE_SIZE_2M)
-			free_pgtable_page(__pte);
+			free_pgtable_page(pdom, __pte);
 	}
 
 	return pte;
@@ -256,7 +252,7 @@ static int iommu_v2_map_pages(struct io_pgtable_ops *ops, unsigned long iova,
 
 	while (mapped_size < size) {
 		map_size = get_alloc_page_size(pgsize);
-		pte = v2_alloc_pte(pdom->nid, pdom->iop.pgd,
+		pte = v2_alloc_pte(pdom, pdom->iop.pgd,
 				   iova, map_size, gfp, &updated);
 		if (!pte) {
 			ret = -EINVAL;
@@ -370,7 +366,7 @@ static void v2_free_pgtable(struct io_pgtable *iop)
 	amd_iommu_domain_update(pdom);
 
 	/* Free page table */
-	free_pgtable(pgtable->pgd, get_pgtable_level());
+	free_pgtable(pdom, pgtable->pgd, get_pgtable_level());
 }
 
 static struct io_pgtable *v2_alloc_pgtable(struct io_pgtable_cfg *cfg, void *cookie)
@@ -380,7 +376,7 @@ static struct io_pgtable *v2_alloc_pgtable(struct io_pgtable_cfg *cfg, void *coo
 	int ret;
 	int ias = IOMMU_IN_ADDR_BIT_SIZE;
 
-	pgtable->pgd = alloc_pgtable_page(pdom->nid, GFP_ATOMIC);
+	pgtable->pgd = alloc_pgtable_page(pdom, GFP_ATOMIC);
 	if (!pgtable->pgd)
 		return NULL;
 
@@ -403,7 +399,7 @@ static struct io_pgtable *v2_alloc_pgtable(struct io_pgtable_cfg *cfg, void *coo
 	return &pgtable->iop;
 
 err_free_pgd:
-	free_pgtable_page(pgtable->pgd);
+	free_pgtable_page(pdom, pgtable->pgd);
 
 	return NULL;
 }
@@ -1168,11 +1168,14 @@ static int iommu_queue_command_sync(struct amd_iommu *iommu,
 				    bool sync)
 {
 	unsigned long flags;
+	u64 start;
 	int ret;
 
+	start = iommu_latency_start(&iommu->iommu, IOMMU_LATENCY_CMD_QUEUE);
 	raw_spin_lock_irqsave(&iommu->lock, flags);
 	ret = __iommu_queue_command_sync(iommu, cmd, sync);
 	raw_spin_unlock_irqrestore(&iommu->lock, flags);
+	iommu_latency_end(&iommu->iommu, IOMMU_LATENCY_CMD_QUEUE, start);
 
 	return ret;
 }
@@ -1190,8 +1193,8 @@ static int iommu_completion_wait(struct amd_iommu *iommu)
 {
 	struct iommu_cmd cmd;
 	unsigned long flags;
+	u64 data, start;
 	int ret;
-	u64 data;
 
 	if (!iommu->need_sync)
 		return 0;
@@ -1199,6 +1202,7 @@ static int iommu_completion_wait(struct amd_iommu *iommu)
 	data = atomic64_add_return(1, &iommu->cmd_sem_val);
 	build_completion_wait(&cmd, iommu, data);
 
+	start = iommu_latency_start(&iommu->iommu, IOMMU_LATENCY_CMD_SYNC);
 	raw_spin_lock_irqsave(&iommu->lock, flags);
 
 	ret = __iommu_queue_command_sync(iommu, &cmd, false);
@@ -1206,6 +1210,7 @@ static int iommu_completion_wait(struct amd_iommu *iommu)
 		goto out_unlock;
 
 	ret = wait_on_sem(iommu, data);
+	iommu_latency_end(&iommu->iommu, IOMMU_LATENCY_CMD_SYNC, start);
 
 out_unlock:
 	raw_spin_unlock_irqrestore(&iommu->lock, flags);
@@ -1941,6 +1946,15 @@ static void amd_iommu_probe_finalize(struct device *dev)
 	iommu_setup_dma_ops(dev, 0, U64_MAX);
 }
 
+static void amd_iommu_sync_batched_attach(struct device *dev)
+{
+	struct amd_iommu *iommu = rlookup_amd_iommu(dev);
+
+	/* Covers the DTE flushes queued by all the batched attaches */
+	if (iommu)
+		iommu_completion_wait(iommu);
+}
+
 static void amd_iommu_release_device(struct device *dev)
 {
 	struct amd_iommu *iommu;
@@ -2055,7 +2069,7 @@ static int protection_domain_init_v1(struct protection_domain *domain, int mode)
 	INIT_LIST_HEAD(&domain->dev_list);
 
 	if (mode != PAGE_MODE_NONE) {
-		pt_root = (void *)get_zeroed_page(GFP_KERNEL);
+		pt_root = alloc_pgtable_page(domain, GFP_KERNEL);
 		if (!pt_root) {
 			domain_id_free(domain->id);
 			return -ENOMEM;
@@ -2114,6 +2128,8 @@ static struct protection_domain *protection_domain_alloc(unsigned int type)
 	if (!domain)
 		return NULL;
 
+	domain->nid = NUMA_NO_NODE;
+
 	switch (pgtable) {
 	case AMD_IOMMU_V1:
 		ret = protection_domain_init_v1(domain, mode);
@@ -2132,8 +2148,6 @@ static struct protection_domain *protection_domain_alloc(unsigned int type)
 	if (type == IOMMU_DOMAIN_IDENTITY)
 		return domain;
 
-	domain->nid = NUMA_NO_NODE;
-
 	pgtbl_ops = alloc_io_pgtable_ops(pgtable, &domain->iop.pgtbl_cfg, domain);
 	if (!pgtbl_ops) {
 		domain_id_free(domain->id);
@@ -2228,7 +2242,9 @@ static int amd_iommu_attach_device(struct iommu_domain *dom,
 	}
 #endif
 
-	iommu_completion_wait(iommu);
+	/* The DTE flush is waited for by amd_iommu_sync_batched_attach() */
+	if (!dev->iommu->attach_batched)
+		iommu_completion_wait(iommu);
 
 	return ret;
 }
@@ -2431,6 +2447,35 @@ static void amd_iommu_iotlb_sync(struct iommu_domain *domain,
 	spin_unlock_irqrestore(&dom->lock, flags);
 }
 
+static void amd_iommu_iotlb_sync_nowait(struct iommu_domain *domain,
+					struct iommu_iotlb_gather *gather)
+{
+	struct protection_domain *dom = to_pdomain(domain);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dom->lock, flags);
+	domain_flush_pages(dom, gather->start, gather->end - gather->start + 1, 1);
+	spin_unlock_irqrestore(&dom->lock, flags);
+}
+
+static void amd_iommu_iotlb_sync_wait(struct iommu_domain **domains,
+				      unsigned int nr)
+{
+	unsigned int j;
+	int i;
+
+	/* One completion wait per IOMMU any of the domains has devices behind */
+	for (i = 0; i < amd_iommu_get_num_iommus(); ++i) {
+		for (j = 0; j < nr; j++)
+			if (to_pdomain(domains[j])->dev_iommu[i])
+				break;
+		if (j == nr)
+			continue;
+
+		iommu_completion_wait(amd_iommus[i]);
+	}
+}
+
 static int amd_iommu_def_domain_type(struct device *dev)
 {
 	struct iommu_dev_data *dev_data;
@@ -2467,6 +2512,7 @@ const struct iommu_ops amd_iommu_ops = {
 	.probe_device = amd_iommu_probe_device,
 	.release_device = amd_iommu_release_device,
 	.probe_finalize = amd_iommu_probe_finalize,
+	.sync_batched_attach = amd_iommu_sync_batched_attach,
 	.device_group = amd_iommu_device_group,
 	.get_resv_regions = amd_iommu_get_resv_regions,
 	.is_attach_deferred = amd_iommu_is_attach_deferred,
@@ -2480,6 +2526,8 @@ const struct iommu_ops amd_iommu_ops = {
 		.iova_to_phys	= amd_iommu_iova_to_phys,
 		.flush_iotlb_all = amd_iommu_flush_iotlb_all,
 		.iotlb_sync	= amd_iommu_iotlb_sync,
+		.iotlb_sync_nowait = amd_iommu_iotlb_sync_nowait,
+		.iotlb_sync_wait = amd_iommu_iotlb_sync_wait,
 		.free		= amd_iommu_domain_free,
 		.enforce_cache_coherency = amd_iommu_enforce_cache_coherency,
 	}
@@ -2851,6 +2899,14 @@ static void iommu_flush_irt_and_complete(struct amd_iommu *iommu, u16 devid)
 	if (iommu->irtcachedis_enabled)
 		return;
 
+	iommu_perf_count(NULL, IOMMU_PERF_IRTE_FLUSH, 1, 0);
+
+	/* amd_iommu_irq_batch_flush() waits for the invalidation */
+	if (irq_remapping_batched()) {
+		iommu_flush_irt(iommu, devid);
+		return;
+	}
+
 	build_inv_irt(&cmd, devid);
 	data = atomic64_add_return(1, &iommu->cmd_sem_val);
 	build_completion_wait(&cmd2, iommu, data);
@@ -3065,8 +3121,9 @@ static int alloc_irq_index(struct amd_iommu *iommu, u16 devid, int count,
 	return index;
 }
 
-static int modify_irte_ga(struct amd_iommu *iommu, u16 devid, int index,
-			  struct irte_ga *irte)
+/* Update an IRTE in GA format, the caller takes care of the IRT flush */
+static int __modify_irte_ga(struct amd_iommu *iommu, u16 devid, int index,
+			    struct irte_ga *irte)
 {
 	struct irq_remap_table *table;
 	struct irte_ga *entry;
@@ -3093,6 +3150,19 @@ static int modify_irte_ga(struct amd_iommu *iommu, u16 devid, int index,
 
 	raw_spin_unlock_irqrestore(&table->lock, flags);
 
+	iommu_perf_count(NULL, IOMMU_PERF_IRTE_WRITE, 1, 0);
+	return 0;
+}
+
+static int modify_irte_ga(struct amd_iommu *iommu, u16 devid, int index,
+			  struct irte_ga *irte)
+{
+	int ret;
+
+	ret = __modify_irte_ga(iommu, devid, index, irte);
+	if (ret)
+		return ret;
+
 	iommu_flush_irt_and_complete(iommu, devid);
 
 	return 0;
@@ -3112,6 +3182,7 @@ static int modify_irte(struct amd_iommu *iommu,
 	table->table[index] = irte->val;
 	raw_spin_unlock_irqrestore(&table->lock, flags);
 
+	iommu_perf_count(NULL, IOMMU_PERF_IRTE_WRITE, 1, 0);
 	iommu_flush_irt_and_complete(iommu, devid);
 
 	return 0;
@@ -3282,12 +3353,25 @@ static int get_devid(struct irq_alloc_info *info)
 	}
 }
 
+/*
+ * The interrupt table invalidations of a batch are queued as they happen, one
+ * completion wait per IOMMU is enough to know all of them are done.
+ */
+static void amd_iommu_irq_batch_flush(void)
+{
+	struct amd_iommu *iommu;
+
+	for_each_iommu(iommu)
+		iommu_completion_wait(iommu);
+}
+
 struct irq_remap_ops amd_iommu_irq_ops = {
 	.prepare		= amd_iommu_prepare,
 	.enable			= amd_iommu_enable,
 	.disable		= amd_iommu_disable,
 	.reenable		= amd_iommu_reenable,
 	.enable_faulting	= amd_iommu_enable_faulting,
+	.batch_flush		= amd_iommu_irq_batch_flush,
 };
 
 static void fill_msi_msg(struct msi_msg *msg, u32 index)
@@ -3776,8 +3860,13 @@ int amd_iommu_update_ga(int cpu, bool is_run, void *data)
 	}
 	entry->lo.fields_vapic.is_run = is_run;
 
-	return modify_irte_ga(ir_data->iommu, ir_data->irq_2_irte.devid,
-			      ir_data->irq_2_irte.index, entry);
+	/*
+	 * This runs on every vCPU load and put. The IOMMU does not cache the
+	 * IsRun and Destination fields of a guest mode IRTE, so rewriting
+	 * them needs no IRT invalidation and no wait for its completion.
+	 */
+	return __modify_irte_ga(ir_data->iommu, ir_data->irq_2_irte.devid,
+				ir_data->irq_2_irte.index, entry);
 }
 EXPORT_SYMBOL(amd_iommu_update_ga);
 #endif
@@ -204,6 +204,16 @@ static void arm_smmu_mm_arch_invalidate_secondary_tlbs(struct mmu_notifier *mn,
 	if (size == ULONG_MAX)
 		size = 0;
 
+	/*
+	 * Without range invalidation every page is a TLBI command that the
+	 * command queue processes in turn, and the ATC is invalidated by
+	 * power of two spans anyway. Past a threshold one command for the
+	 * whole ASID and one for the whole ATC are cheaper.
+	 */
+	if (!(smmu_domain->smmu->features & ARM_SMMU_FEAT_RANGE_INV) &&
+	    size >= CMDQ_MAX_TLBI_OPS * PAGE_SIZE)
+		size = 0;
+
 	if (!(smmu_domain->smmu->features & ARM_SMMU_FEAT_BTM)) {
 		if (!size)
 			arm_smmu_tlb_inv_asid(smmu_domain->smmu,
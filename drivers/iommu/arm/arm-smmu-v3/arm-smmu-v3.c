@@ -238,6 +238,10 @@ static void queue_read(u64 *dst, __le64 *src, size_t n_dwords)
 		*dst++ = le64_to_cpu(*src++);
 }
 
+/*
+ * Remove an entry without releasing its slot to the SMMU, the caller updates
+ * the CONS register with queue_sync_cons_out() once per batch of entries.
+ */
 static int queue_remove_raw(struct arm_smmu_queue *q, u64 *ent)
 {
 	if (queue_empty(&q->llq))
@@ -245,10 +249,28 @@ static int queue_remove_raw(struct arm_smmu_queue *q, u64 *ent)
 
 	queue_read(ent, Q_ENT(q, q->llq.cons), q->ent_dwords);
 	queue_inc_cons(&q->llq);
-	queue_sync_cons_out(q);
 	return 0;
 }
 
+/*
+ * Called with an empty queue after a burst of entries. Returns true if the
+ * SMMU produced more entries within ARM_SMMU_Q_BUSY_POLL_US.
+ */
+static bool queue_busy_poll(struct arm_smmu_queue *q)
+{
+	ktime_t timeout = ktime_add_us(ktime_get(), ARM_SMMU_Q_BUSY_POLL_US);
+
+	do {
+		u32 prod = readl_relaxed(q->prod_reg);
+
+		if ((prod & ~Q_OVERFLOW_FLAG) != (q->llq.cons & ~Q_OVERFLOW_FLAG))
+			return true;
+		cpu_relax();
+	} while (ktime_before(ktime_get(), timeout));
+
+	return false;
+}
+
 /* High-level queue accessors */
 static int arm_smmu_cmdq_build_cmd(u64 *cmd, struct arm_smmu_cmdq_ent *ent)
 {
@@ -766,8 +788,10 @@ static int arm_smmu_cmdq_issue_cmdlist(struct arm_smmu_device *smmu,
 	bool owner;
 	struct arm_smmu_cmdq *cmdq = arm_smmu_get_cmdq(smmu);
 	struct arm_smmu_ll_queue llq, head;
+	u64 start;
 	int ret = 0;
 
+	start = iommu_latency_start(&smmu->iommu, IOMMU_LATENCY_CMD_QUEUE);
 	llq.max_n_shift = cmdq->q.llq.max_n_shift;
 
 	/* 1. Allocate some space in the queue */
@@ -850,11 +874,15 @@ static int arm_smmu_cmdq_issue_cmdlist(struct arm_smmu_device *smmu,
 		 */
 		atomic_set_release(&cmdq->owner_prod, prod);
 	}
+	iommu_latency_end(&smmu->iommu, IOMMU_LATENCY_CMD_QUEUE, start);
 
 	/* 5. If we are inserting a CMD_SYNC, we must wait for it to complete */
 	if (sync) {
+		start = iommu_latency_start(&smmu->iommu,
+					    IOMMU_LATENCY_CMD_SYNC);
 		llq.prod = queue_inc_prod_n(&llq, n);
 		ret = arm_smmu_cmdq_poll_until_sync(smmu, &llq);
+		iommu_latency_end(&smmu->iommu, IOMMU_LATENCY_CMD_SYNC, start);
 		if (ret) {
 			dev_err_ratelimited(smmu->dev,
 					    "CMD_SYNC timeout at 0x%08x [hwprod 0x%08x, hwcons 0x%08x]\n",
@@ -1598,22 +1626,27 @@ static irqreturn_t arm_smmu_evtq_thread(int irq, void *dev)
 	static DEFINE_RATELIMIT_STATE(rs, DEFAULT_RATELIMIT_INTERVAL,
 				      DEFAULT_RATELIMIT_BURST);
 	u64 evt[EVTQ_ENT_DWORDS];
+	unsigned int handled = 0;
 
 	do {
 		while (!queue_remove_raw(q, evt)) {
 			u8 id = FIELD_GET(EVTQ_0_ID, evt[0]);
 
 			ret = arm_smmu_handle_evt(smmu, evt);
-			if (!ret || !__ratelimit(&rs))
-				continue;
-
-			dev_info(smmu->dev, "event 0x%02x received:\n", id);
-			for (i = 0; i < ARRAY_SIZE(evt); ++i)
-				dev_info(smmu->dev, "\t0x%016llx\n",
-					 (unsigned long long)evt[i]);
+			if (ret && __ratelimit(&rs)) {
+				dev_info(smmu->dev, "event 0x%02x received:\n",
+					 id);
+				for (i = 0; i < ARRAY_SIZE(evt); ++i)
+					dev_info(smmu->dev, "\t0x%016llx\n",
+						 (unsigned long long)evt[i]);
+			}
 
-			cond_resched();
+			if (++handled % ARM_SMMU_Q_POLL_BUDGET == 0) {
+				queue_sync_cons_out(q);
+				cond_resched();
+			}
 		}
+		queue_sync_cons_out(q);
 
 		/*
 		 * Not much we can do on overflow, so scream and pretend we're
@@ -1621,7 +1654,8 @@ static irqreturn_t arm_smmu_evtq_thread(int irq, void *dev)
 		 */
 		if (queue_sync_prod_in(q) == -EOVERFLOW)
 			dev_err(smmu->dev, "EVTQ overflow detected -- events lost\n");
-	} while (!queue_empty(llq));
+	} while (!queue_empty(llq) ||
+		 (handled >= ARM_SMMU_Q_POLL_BUDGET && queue_busy_poll(q)));
 
 	/* Sync our overflow flag, as we believe we're up to speed */
 	queue_sync_cons_ovf(q);
@@ -1672,14 +1706,23 @@ static irqreturn_t arm_smmu_priq_thread(int irq, void *dev)
 	struct arm_smmu_queue *q = &smmu->priq.q;
 	struct arm_smmu_ll_queue *llq = &q->llq;
 	u64 evt[PRIQ_ENT_DWORDS];
+	unsigned int handled = 0;
 
 	do {
-		while (!queue_remove_raw(q, evt))
+		while (!queue_remove_raw(q, evt)) {
 			arm_smmu_handle_ppr(smmu, evt);
 
+			if (++handled % ARM_SMMU_Q_POLL_BUDGET == 0) {
+				queue_sync_cons_out(q);
+				cond_resched();
+			}
+		}
+		queue_sync_cons_out(q);
+
 		if (queue_sync_prod_in(q) == -EOVERFLOW)
 			dev_err(smmu->dev, "PRIQ overflow detected -- requests lost\n");
-	} while (!queue_empty(llq));
+	} while (!queue_empty(llq) ||
+		 (handled >= ARM_SMMU_Q_POLL_BUDGET && queue_busy_poll(q)));
 
 	/* Sync our overflow flag, as we believe we're up to speed */
 	queue_sync_cons_ovf(q);
@@ -1910,7 +1953,8 @@ static void arm_smmu_tlb_inv_context(void *cookie)
 static void __arm_smmu_tlb_inv_range(struct arm_smmu_cmdq_ent *cmd,
 				     unsigned long iova, size_t size,
 				     size_t granule,
-				     struct arm_smmu_domain *smmu_domain)
+				     struct arm_smmu_domain *smmu_domain,
+				     bool sync)
 {
 	struct arm_smmu_device *smmu = smmu_domain->smmu;
 	unsigned long end = iova + size, num_pages = 0, tg = 0;
@@ -1970,12 +2014,13 @@ static void __arm_smmu_tlb_inv_range(struct arm_smmu_cmdq_ent *cmd,
 		arm_smmu_cmdq_batch_add(smmu, &cmds, cmd);
 		iova += inv_range;
 	}
-	arm_smmu_cmdq_batch_submit(smmu, &cmds);
+	arm_smmu_cmdq_issue_cmdlist(smmu, cmds.cmds, cmds.num, sync);
 }
 
-static void arm_smmu_tlb_inv_range_domain(unsigned long iova, size_t size,
-					  size_t granule, bool leaf,
-					  struct arm_smmu_domain *smmu_domain)
+static void __arm_smmu_tlb_inv_range_domain(unsigned long iova, size_t size,
+					    size_t granule, bool leaf,
+					    struct arm_smmu_domain *smmu_domain,
+					    bool sync)
 {
 	struct arm_smmu_cmdq_ent cmd = {
 		.tlbi = {
@@ -1991,7 +2036,15 @@ static void arm_smmu_tlb_inv_range_domain(unsigned long iova, size_t size,
 		cmd.opcode	= CMDQ_OP_TLBI_S2_IPA;
 		cmd.tlbi.vmid	= smmu_domain->s2_cfg.vmid;
 	}
-	__arm_smmu_tlb_inv_range(&cmd, iova, size, granule, smmu_domain);
+	__arm_smmu_tlb_inv_range(&cmd, iova, size, granule, smmu_domain, sync);
+}
+
+static void arm_smmu_tlb_inv_range_domain(unsigned long iova, size_t size,
+					  size_t granule, bool leaf,
+					  struct arm_smmu_domain *smmu_domain)
+{
+	__arm_smmu_tlb_inv_range_domain(iova, size, granule, leaf, smmu_domain,
+					true);
 
 	/*
 	 * Unfortunately, this can't be leaf-only since we may have
@@ -2013,7 +2066,7 @@ void arm_smmu_tlb_inv_range_asid(unsigned long iova, size_t size, int asid,
 		},
 	};
 
-	__arm_smmu_tlb_inv_range(&cmd, iova, size, granule, smmu_domain);
+	__arm_smmu_tlb_inv_range(&cmd, iova, size, granule, smmu_domain, true);
 }
 
 static void arm_smmu_tlb_inv_page_nosync(struct iommu_iotlb_gather *gather,
@@ -2334,7 +2387,10 @@ static int arm_smmu_domain_finalise(struct iommu_domain *domain,
 		.coherent_walk	= smmu->features & ARM_SMMU_FEAT_COHERENCY,
 		.tlb		= &arm_smmu_flush_ops,
 		.iommu_dev	= smmu->dev,
+		.domain		= domain,
 	};
+	if (smmu->features & ARM_SMMU_FEAT_BBML2)
+		pgtbl_cfg.quirks |= IO_PGTABLE_QUIRK_ARM_BBML2;
 
 	pgtbl_ops = alloc_io_pgtable_ops(fmt, &pgtbl_cfg, smmu_domain);
 	if (!pgtbl_ops)
@@ -2601,6 +2657,19 @@ static int arm_smmu_map_pages(struct iommu_domain *domain, unsigned long iova,
 	return ops->map_pages(ops, iova, paddr, pgsize, pgcount, prot, gfp, mapped);
 }
 
+static int arm_smmu_map_ranges(struct iommu_domain *domain,
+			       const struct iommu_map_range *ranges,
+			       unsigned int nr, int prot, gfp_t gfp,
+			       size_t *mapped)
+{
+	struct io_pgtable_ops *ops = to_smmu_domain(domain)->pgtbl_ops;
+
+	if (!ops)
+		return -ENODEV;
+
+	return ops->map_ranges(ops, ranges, nr, prot, gfp, mapped);
+}
+
 static size_t arm_smmu_unmap_pages(struct iommu_domain *domain, unsigned long iova,
 				   size_t pgsize, size_t pgcount,
 				   struct iommu_iotlb_gather *gather)
@@ -2614,6 +2683,19 @@ static size_t arm_smmu_unmap_pages(struct iommu_domain *domain, unsigned long io
 	return ops->unmap_pages(ops, iova, pgsize, pgcount, gather);
 }
 
+/* Only page tables of SMMUs with BBML2 can be collapsed while live */
+static size_t arm_smmu_collapse_pages(struct iommu_domain *domain,
+				      unsigned long iova, size_t size,
+				      struct iommu_iotlb_gather *gather)
+{
+	struct io_pgtable_ops *ops = to_smmu_domain(domain)->pgtbl_ops;
+
+	if (!ops || !ops->collapse_pages)
+		return 0;
+
+	return ops->collapse_pages(ops, iova, size);
+}
+
 static void arm_smmu_flush_iotlb_all(struct iommu_domain *domain)
 {
 	struct arm_smmu_domain *smmu_domain = to_smmu_domain(domain);
@@ -2635,6 +2717,46 @@ static void arm_smmu_iotlb_sync(struct iommu_domain *domain,
 				      gather->pgsize, true, smmu_domain);
 }
 
+static void arm_smmu_iotlb_sync_nowait(struct iommu_domain *domain,
+				       struct iommu_iotlb_gather *gather)
+{
+	struct arm_smmu_domain *smmu_domain = to_smmu_domain(domain);
+
+	if (!gather->pgsize)
+		return;
+
+	/*
+	 * The ATC can only be invalidated once the TLBI has completed, so
+	 * domains of an SMMU with ATS keep the synchronous flush.
+	 */
+	if (smmu_domain->smmu->features & ARM_SMMU_FEAT_ATS) {
+		arm_smmu_iotlb_sync(domain, gather);
+		return;
+	}
+
+	__arm_smmu_tlb_inv_range_domain(gather->start,
+					gather->end - gather->start + 1,
+					gather->pgsize, true, smmu_domain,
+					false);
+}
+
+static void arm_smmu_iotlb_sync_wait(struct iommu_domain **domains,
+				     unsigned int nr)
+{
+	unsigned int i, j;
+
+	/* A CMD_SYNC completes everything issued before it on that SMMU */
+	for (i = 0; i < nr; i++) {
+		struct arm_smmu_device *smmu = to_smmu_domain(domains[i])->smmu;
+
+		for (j = 0; j < i; j++)
+			if (to_smmu_domain(domains[j])->smmu == smmu)
+				break;
+		if (j == i)
+			arm_smmu_cmdq_issue_cmdlist(smmu, NULL, 0, true);
+	}
+}
+
 static phys_addr_t
 arm_smmu_iova_to_phys(struct iommu_domain *domain, dma_addr_t iova)
 {
@@ -3307,9 +3429,13 @@ static struct iommu_ops arm_smmu_ops = {
 	.default_domain_ops = &(const struct iommu_domain_ops) {
 		.attach_dev		= arm_smmu_attach_dev,
 		.map_pages		= arm_smmu_map_pages,
+		.map_ranges		= arm_smmu_map_ranges,
 		.unmap_pages		= arm_smmu_unmap_pages,
+		.collapse_pages		= arm_smmu_collapse_pages,
 		.flush_iotlb_all	= arm_smmu_flush_iotlb_all,
 		.iotlb_sync		= arm_smmu_iotlb_sync,
+		.iotlb_sync_nowait	= arm_smmu_iotlb_sync_nowait,
+		.iotlb_sync_wait	= arm_smmu_iotlb_sync_wait,
 		.iova_to_phys		= arm_smmu_iova_to_phys,
 		.free			= arm_smmu_domain_free,
 	}
@@ -4043,6 +4169,8 @@ static int arm_smmu_device_hw_probe(struct arm_smmu_device *smmu)
 	reg = readl_relaxed(smmu->base + ARM_SMMU_IDR3);
 	if (FIELD_GET(IDR3_RIL, reg))
 		smmu->features |= ARM_SMMU_FEAT_RANGE_INV;
+	if (FIELD_GET(IDR3_BBML, reg) == IDR3_BBML2)
+		smmu->features |= ARM_SMMU_FEAT_BBML2;
 
 	/* IDR5 */
 	reg = readl_relaxed(smmu->base + ARM_SMMU_IDR5);
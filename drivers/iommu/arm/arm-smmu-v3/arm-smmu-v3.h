@@ -52,6 +52,8 @@
 
 #define ARM_SMMU_IDR3			0xc
 #define IDR3_RIL			(1 << 10)
+#define IDR3_BBML			GENMASK(12, 11)
+#define IDR3_BBML2			2
 
 #define ARM_SMMU_IDR5			0x14
 #define IDR5_STALL_MAX			GENMASK(31, 16)
@@ -329,6 +331,9 @@
  */
 #define CMDQ_BATCH_ENTRIES		BITS_PER_LONG
 
+/* Past this many pages, invalidate the whole ASID, as MAX_TLBI_OPS does */
+#define CMDQ_MAX_TLBI_OPS		(1 << (PAGE_SHIFT - 3))
+
 #define CMDQ_0_OP			GENMASK_ULL(7, 0)
 #define CMDQ_0_SSV			(1UL << 11)
 
@@ -427,6 +432,15 @@
 #define ARM_SMMU_POLL_TIMEOUT_US	1000000 /* 1s! */
 #define ARM_SMMU_POLL_SPIN_COUNT	10
 
+/*
+ * The event and PRI queue threads release the slots of the entries they
+ * consumed and may yield once per ARM_SMMU_Q_POLL_BUDGET entries. After a
+ * burst, they poll the empty queue for ARM_SMMU_Q_BUSY_POLL_US before
+ * re-enabling the interrupt.
+ */
+#define ARM_SMMU_Q_POLL_BUDGET		64
+#define ARM_SMMU_Q_BUSY_POLL_US		20
+
 #define MSI_IOVA_BASE			0x8000000
 #define MSI_IOVA_LENGTH			0x100000
 
@@ -653,6 +667,7 @@ struct arm_smmu_device {
 #define ARM_SMMU_FEAT_SVA		(1 << 17)
 #define ARM_SMMU_FEAT_E2H		(1 << 18)
 #define ARM_SMMU_FEAT_NESTING		(1 << 19)
+#define ARM_SMMU_FEAT_BBML2		(1 << 20)
 	u32				features;
 
 #define ARM_SMMU_OPT_SKIP_PREFETCH	(1 << 0)
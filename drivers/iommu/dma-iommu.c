@@ -65,8 +65,10 @@ struct iommu_dma_cookie {
 	};
 	struct list_head		msi_page_list;
 
-	/* Domain for flush queue callback; NULL if flush queue not in use */
+	/* Domain for flush queue callback; NULL if flush queue not allocated */
 	struct iommu_domain		*fq_domain;
+	/* Unmaps are deferred to the flush queue, false in strict mode */
+	bool				fq_enabled;
 	struct mutex			mutex;
 };
 
@@ -152,12 +154,10 @@ static void fq_flush_iotlb(struct iommu_dma_cookie *cookie)
 	atomic64_inc(&cookie->fq_flush_finish_cnt);
 }
 
-static void fq_flush_timeout(struct timer_list *t)
+static void fq_flush_all(struct iommu_dma_cookie *cookie)
 {
-	struct iommu_dma_cookie *cookie = from_timer(cookie, t, fq_timer);
 	int cpu;
 
-	atomic_set(&cookie->fq_timer_on, 0);
 	fq_flush_iotlb(cookie);
 
 	for_each_possible_cpu(cpu) {
@@ -171,6 +171,14 @@ static void fq_flush_timeout(struct timer_list *t)
 	}
 }
 
+static void fq_flush_timeout(struct timer_list *t)
+{
+	struct iommu_dma_cookie *cookie = from_timer(cookie, t, fq_timer);
+
+	atomic_set(&cookie->fq_timer_on, 0);
+	fq_flush_all(cookie);
+}
+
 static void queue_iova(struct iommu_dma_cookie *cookie,
 		unsigned long pfn, unsigned long pages,
 		struct list_head *freelist)
@@ -245,8 +253,11 @@ int iommu_dma_init_fq(struct iommu_domain *domain)
 	struct iova_fq __percpu *queue;
 	int i, cpu;
 
-	if (cookie->fq_domain)
+	/* Left allocated by iommu_dma_disable_fq() */
+	if (cookie->fq_domain) {
+		WRITE_ONCE(cookie->fq_enabled, true);
 		return 0;
+	}
 
 	atomic64_set(&cookie->fq_flush_start_cnt,  0);
 	atomic64_set(&cookie->fq_flush_finish_cnt, 0);
@@ -279,9 +290,29 @@ int iommu_dma_init_fq(struct iommu_domain *domain)
 	 */
 	smp_wmb();
 	WRITE_ONCE(cookie->fq_domain, domain);
+	WRITE_ONCE(cookie->fq_enabled, true);
 	return 0;
 }
 
+/*
+ * Go back to strict invalidation without tearing down the domain, serialised
+ * like iommu_dma_init_fq(). Everything queued so far is invalidated and freed
+ * before returning. The queue itself stays allocated, an unmap racing with the
+ * switch may still add its IOVA, which the timer then flushes as usual.
+ */
+void iommu_dma_disable_fq(struct iommu_domain *domain)
+{
+	struct iommu_dma_cookie *cookie = domain->iova_cookie;
+
+	if (!cookie->fq_enabled)
+		return;
+
+	WRITE_ONCE(cookie->fq_enabled, false);
+	/* Pairs with queue_iova(), entries added before are seen here */
+	smp_mb();
+	fq_flush_all(cookie);
+}
+
 static inline size_t cookie_msi_granule(struct iommu_dma_cookie *cookie)
 {
 	if (cookie->type == IOMMU_DMA_IOVA_COOKIE)
@@ -731,7 +762,7 @@ static void __iommu_dma_unmap(struct device *dev, dma_addr_t dma_addr,
 	dma_addr -= iova_off;
 	size = iova_align(iovad, size + iova_off);
 	iommu_iotlb_gather_init(&iotlb_gather);
-	iotlb_gather.queued = READ_ONCE(cookie->fq_domain);
+	iotlb_gather.queued = READ_ONCE(cookie->fq_enabled);
 
 	unmapped = iommu_unmap_fast(domain, dma_addr, size, &iotlb_gather);
 	WARN_ON(unmapped != size);
@@ -13,6 +13,7 @@ int iommu_get_dma_cookie(struct iommu_domain *domain);
 void iommu_put_dma_cookie(struct iommu_domain *domain);
 
 int iommu_dma_init_fq(struct iommu_domain *domain);
+void iommu_dma_disable_fq(struct iommu_domain *domain);
 
 void iommu_dma_get_resv_regions(struct device *dev, struct list_head *list);
 
@@ -29,6 +30,10 @@ static inline int iommu_dma_init_fq(struct iommu_domain *domain)
 	return -EINVAL;
 }
 
+static inline void iommu_dma_disable_fq(struct iommu_domain *domain)
+{
+}
+
 static inline int iommu_get_dma_cookie(struct iommu_domain *domain)
 {
 	return -ENODEV;
@@ -16,7 +16,6 @@
 
 #include "iommu.h"
 #include "pasid.h"
-#include "perf.h"
 
 struct tbl_walk {
 	u16 bus;
@@ -567,7 +566,8 @@ static void latency_show_one(struct seq_file *m, struct intel_iommu *iommu,
 	seq_printf(m, "IOMMU: %s Register Base Address: %llx\n",
 		   iommu->name, drhd->reg_base_addr);
 
-	ret = dmar_latency_snapshot(iommu, debug_buf, DEBUG_BUFFER_SIZE);
+	ret = iommu_latency_snapshot(&iommu->iommu, debug_buf,
+				     DEBUG_BUFFER_SIZE);
 	if (ret < 0)
 		seq_puts(m, "Failed to get latency snapshot");
 	else
@@ -599,7 +599,7 @@ static ssize_t dmar_perf_latency_write(struct file *filp,
 {
 	struct dmar_drhd_unit *drhd;
 	struct intel_iommu *iommu;
-	int counting;
+	int counting, i, ret = 0;
 	char buf[64];
 
 	if (cnt > 63)
@@ -613,44 +613,25 @@ static ssize_t dmar_perf_latency_write(struct file *filp,
 	if (kstrtoint(buf, 0, &counting))
 		return -EINVAL;
 
-	switch (counting) {
-	case 0:
-		rcu_read_lock();
-		for_each_active_iommu(iommu, drhd) {
-			dmar_latency_disable(iommu, DMAR_LATENCY_INV_IOTLB);
-			dmar_latency_disable(iommu, DMAR_LATENCY_INV_DEVTLB);
-			dmar_latency_disable(iommu, DMAR_LATENCY_INV_IEC);
-			dmar_latency_disable(iommu, DMAR_LATENCY_PRQ);
-		}
-		rcu_read_unlock();
-		break;
-	case 1:
-		rcu_read_lock();
-		for_each_active_iommu(iommu, drhd)
-			dmar_latency_enable(iommu, DMAR_LATENCY_INV_IOTLB);
-		rcu_read_unlock();
-		break;
-	case 2:
-		rcu_read_lock();
-		for_each_active_iommu(iommu, drhd)
-			dmar_latency_enable(iommu, DMAR_LATENCY_INV_DEVTLB);
-		rcu_read_unlock();
-		break;
-	case 3:
-		rcu_read_lock();
-		for_each_active_iommu(iommu, drhd)
-			dmar_latency_enable(iommu, DMAR_LATENCY_INV_IEC);
-		rcu_read_unlock();
-		break;
-	case 4:
-		rcu_read_lock();
-		for_each_active_iommu(iommu, drhd)
-			dmar_latency_enable(iommu, DMAR_LATENCY_PRQ);
-		rcu_read_unlock();
-		break;
-	default:
+	/* 0 stops everything, 1-4 start inv_iotlb, inv_devtlb, inv_iec, prq */
+	if (counting < 0 || counting > IOMMU_LATENCY_PRQ + 1)
 		return -EINVAL;
+
+	/* Enabling allocates and may sleep */
+	down_read(&dmar_global_lock);
+	for_each_active_iommu(iommu, drhd) {
+		if (counting) {
+			ret = iommu_latency_enable(&iommu->iommu, counting - 1);
+			if (ret)
+				break;
+		} else {
+			for (i = 0; i < IOMMU_LATENCY_NUM; i++)
+				iommu_latency_disable(&iommu->iommu, i);
+		}
 	}
+	up_read(&dmar_global_lock);
+	if (ret)
+		return ret;
 
 	*ppos += cnt;
 	return cnt;
@@ -32,7 +32,6 @@
 
 #include "iommu.h"
 #include "../irq_remapping.h"
-#include "perf.h"
 #include "trace.h"
 #include "perfmon.h"
 
@@ -1363,15 +1362,15 @@ int qi_submit_sync(struct intel_iommu *iommu, struct qi_desc *desc,
 	type = desc->qw0 & GENMASK_ULL(3, 0);
 
 	if ((type == QI_IOTLB_TYPE || type == QI_EIOTLB_TYPE) &&
-	    dmar_latency_enabled(iommu, DMAR_LATENCY_INV_IOTLB))
+	    iommu_latency_enabled(&iommu->iommu, IOMMU_LATENCY_INV_IOTLB))
 		iotlb_start_ktime = ktime_to_ns(ktime_get());
 
 	if ((type == QI_DIOTLB_TYPE || type == QI_DEIOTLB_TYPE) &&
-	    dmar_latency_enabled(iommu, DMAR_LATENCY_INV_DEVTLB))
+	    iommu_latency_enabled(&iommu->iommu, IOMMU_LATENCY_INV_DEVTLB))
 		devtlb_start_ktime = ktime_to_ns(ktime_get());
 
 	if (type == QI_IEC_TYPE &&
-	    dmar_latency_enabled(iommu, DMAR_LATENCY_INV_IEC))
+	    iommu_latency_enabled(&iommu->iommu, IOMMU_LATENCY_INV_IEC))
 		iec_start_ktime = ktime_to_ns(ktime_get());
 
 restart:
@@ -1449,15 +1448,15 @@ int qi_submit_sync(struct intel_iommu *iommu, struct qi_desc *desc,
 		goto restart;
 
 	if (iotlb_start_ktime)
-		dmar_latency_update(iommu, DMAR_LATENCY_INV_IOTLB,
+		iommu_latency_update(&iommu->iommu, IOMMU_LATENCY_INV_IOTLB,
 				ktime_to_ns(ktime_get()) - iotlb_start_ktime);
 
 	if (devtlb_start_ktime)
-		dmar_latency_update(iommu, DMAR_LATENCY_INV_DEVTLB,
+		iommu_latency_update(&iommu->iommu, IOMMU_LATENCY_INV_DEVTLB,
 				ktime_to_ns(ktime_get()) - devtlb_start_ktime);
 
 	if (iec_start_ktime)
-		dmar_latency_update(iommu, DMAR_LATENCY_INV_IEC,
+		iommu_latency_update(&iommu->iommu, IOMMU_LATENCY_INV_IEC,
 				ktime_to_ns(ktime_get()) - iec_start_ktime);
 
 	return rc;
@@ -1540,27 +1539,18 @@ void qi_flush_dev_iotlb(struct intel_iommu *iommu, u16 sid, u16 pfsid,
 }
 
 /* PASID-based IOTLB invalidation */
-void qi_flush_piotlb(struct intel_iommu *iommu, u16 did, u32 pasid, u64 addr,
-		     unsigned long npages, bool ih)
+void qi_desc_piotlb(u16 did, u32 pasid, u64 addr, unsigned long npages,
+		    bool ih, struct qi_desc *desc)
 {
-	struct qi_desc desc = {.qw2 = 0, .qw3 = 0};
-
-	/*
-	 * npages == -1 means a PASID-selective invalidation, otherwise,
-	 * a positive value for Page-selective-within-PASID invalidation.
-	 * 0 is not a valid input.
-	 */
-	if (WARN_ON(!npages)) {
-		pr_err("Invalid input npages = %ld\n", npages);
-		return;
-	}
+	desc->qw2 = 0;
+	desc->qw3 = 0;
 
 	if (npages == -1) {
-		desc.qw0 = QI_EIOTLB_PASID(pasid) |
+		desc->qw0 = QI_EIOTLB_PASID(pasid) |
 				QI_EIOTLB_DID(did) |
 				QI_EIOTLB_GRAN(QI_GRAN_NONG_PASID) |
 				QI_EIOTLB_TYPE;
-		desc.qw1 = 0;
+		desc->qw1 = 0;
 	} else {
 		int mask = ilog2(__roundup_pow_of_two(npages));
 		unsigned long align = (1ULL << (VTD_PAGE_SHIFT + mask));
@@ -1568,28 +1558,46 @@ void qi_flush_piotlb(struct intel_iommu *iommu, u16 did, u32 pasid, u64 addr,
 		if (WARN_ON_ONCE(!IS_ALIGNED(addr, align)))
 			addr = ALIGN_DOWN(addr, align);
 
-		desc.qw0 = QI_EIOTLB_PASID(pasid) |
+		desc->qw0 = QI_EIOTLB_PASID(pasid) |
 				QI_EIOTLB_DID(did) |
 				QI_EIOTLB_GRAN(QI_GRAN_PSI_PASID) |
 				QI_EIOTLB_TYPE;
-		desc.qw1 = QI_EIOTLB_ADDR(addr) |
+		desc->qw1 = QI_EIOTLB_ADDR(addr) |
 				QI_EIOTLB_IH(ih) |
 				QI_EIOTLB_AM(mask);
 	}
+}
 
+void qi_flush_piotlb(struct intel_iommu *iommu, u16 did, u32 pasid, u64 addr,
+		     unsigned long npages, bool ih)
+{
+	struct qi_desc desc;
+
+	/*
+	 * npages == -1 means a PASID-selective invalidation, otherwise,
+	 * a positive value for Page-selective-within-PASID invalidation.
+	 * 0 is not a valid input.
+	 */
+	if (WARN_ON(!npages)) {
+		pr_err("Invalid input npages = %ld\n", npages);
+		return;
+	}
+
+	qi_desc_piotlb(did, pasid, addr, npages, ih, &desc);
 	qi_submit_sync(iommu, &desc, 1, 0);
 }
 
 /* PASID-based device IOTLB Invalidate */
-void qi_flush_dev_iotlb_pasid(struct intel_iommu *iommu, u16 sid, u16 pfsid,
-			      u32 pasid,  u16 qdep, u64 addr, unsigned int size_order)
+void qi_desc_dev_iotlb_pasid(u16 sid, u16 pfsid, u32 pasid, u16 qdep, u64 addr,
+			     unsigned int size_order, struct qi_desc *desc)
 {
 	unsigned long mask = 1UL << (VTD_PAGE_SHIFT + size_order - 1);
-	struct qi_desc desc = {.qw1 = 0, .qw2 = 0, .qw3 = 0};
 
-	desc.qw0 = QI_DEV_EIOTLB_PASID(pasid) | QI_DEV_EIOTLB_SID(sid) |
+	desc->qw0 = QI_DEV_EIOTLB_PASID(pasid) | QI_DEV_EIOTLB_SID(sid) |
 		QI_DEV_EIOTLB_QDEP(qdep) | QI_DEIOTLB_TYPE |
 		QI_DEV_IOTLB_PFSID(pfsid);
+	desc->qw2 = 0;
+	desc->qw3 = 0;
 
 	/*
 	 * If S bit is 0, we only flush a single page. If S bit is set,
@@ -1605,7 +1613,7 @@ void qi_flush_dev_iotlb_pasid(struct intel_iommu *iommu, u16 sid, u16 pfsid,
 				    addr, size_order);
 
 	/* Take page address */
-	desc.qw1 = QI_DEV_EIOTLB_ADDR(addr);
+	desc->qw1 = QI_DEV_EIOTLB_ADDR(addr);
 
 	if (size_order) {
 		/*
@@ -1613,14 +1621,22 @@ void qi_flush_dev_iotlb_pasid(struct intel_iommu *iommu, u16 sid, u16 pfsid,
 		 * significant bit, we must set them to 1s to avoid having
 		 * smaller size than desired.
 		 */
-		desc.qw1 |= GENMASK_ULL(size_order + VTD_PAGE_SHIFT - 1,
+		desc->qw1 |= GENMASK_ULL(size_order + VTD_PAGE_SHIFT - 1,
 					VTD_PAGE_SHIFT);
 		/* Clear size_order bit to indicate size */
-		desc.qw1 &= ~mask;
+		desc->qw1 &= ~mask;
 		/* Set the S bit to indicate flushing more than 1 page */
-		desc.qw1 |= QI_DEV_EIOTLB_SIZE;
+		desc->qw1 |= QI_DEV_EIOTLB_SIZE;
 	}
+}
+
+void qi_flush_dev_iotlb_pasid(struct intel_iommu *iommu, u16 sid, u16 pfsid,
+			      u32 pasid,  u16 qdep, u64 addr, unsigned int size_order)
+{
+	struct qi_desc desc;
 
+	qi_desc_dev_iotlb_pasid(sid, pfsid, pasid, qdep, addr, size_order,
+				&desc);
 	qi_submit_sync(iommu, &desc, 1, 0);
 }
 
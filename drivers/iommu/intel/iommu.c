@@ -28,6 +28,7 @@
 #include "../dma-iommu.h"
 #include "../irq_remapping.h"
 #include "../iommu-sva.h"
+#include "../iommu-pages.h"
 #include "pasid.h"
 #include "cap_audit.h"
 #include "perfmon.h"
@@ -46,9 +47,6 @@
 
 #define DEFAULT_DOMAIN_ADDRESS_WIDTH 57
 
-#define MAX_AGAW_WIDTH 64
-#define MAX_AGAW_PFN_WIDTH	(MAX_AGAW_WIDTH - VTD_PAGE_SHIFT)
-
 #define __DOMAIN_MAX_PFN(gaw)  ((((uint64_t)1) << ((gaw) - VTD_PAGE_SHIFT)) - 1)
 #define __DOMAIN_MAX_ADDR(gaw) ((((uint64_t)1) << (gaw)) - 1)
 
@@ -368,18 +366,23 @@ __setup("intel_iommu=", intel_iommu_setup);
 
 void *alloc_pgtable_page(int node, gfp_t gfp)
 {
-	struct page *page;
-	void *vaddr = NULL;
-
-	page = alloc_pages_node(node, gfp | __GFP_ZERO, 0);
-	if (page)
-		vaddr = page_address(page);
-	return vaddr;
+	return iommu_alloc_pages_node(NULL, node, gfp, 0);
 }
 
 void free_pgtable_page(void *vaddr)
 {
-	free_page((unsigned long)vaddr);
+	iommu_free_pages(NULL, vaddr, 0);
+}
+
+/* Page table pages of a domain, accounted to it */
+static void *domain_alloc_pgtable_page(struct dmar_domain *domain, gfp_t gfp)
+{
+	return iommu_alloc_pages_node(&domain->domain, domain->nid, gfp, 0);
+}
+
+static void domain_free_pgtable_page(struct dmar_domain *domain, void *vaddr)
+{
+	iommu_free_pages(&domain->domain, vaddr, 0);
 }
 
 static inline int domain_type_is_si(struct dmar_domain *domain)
@@ -938,7 +941,7 @@ static struct dma_pte *pfn_to_dma_pte(struct dmar_domain *domain,
 		if (!dma_pte_present(pte)) {
 			uint64_t pteval;
 
-			tmp_page = alloc_pgtable_page(domain->nid, gfp);
+			tmp_page = domain_alloc_pgtable_page(domain, gfp);
 
 			if (!tmp_page)
 				return NULL;
@@ -950,7 +953,7 @@ static struct dma_pte *pfn_to_dma_pte(struct dmar_domain *domain,
 
 			if (cmpxchg64(&pte->val, 0ULL, pteval))
 				/* Someone else set it while we were thinking; use theirs. */
-				free_pgtable_page(tmp_page);
+				domain_free_pgtable_page(domain, tmp_page);
 			else
 				domain_flush_cache(domain, pte, sizeof(*pte));
 		}
@@ -1063,7 +1066,7 @@ static void dma_pte_free_level(struct dmar_domain *domain, int level,
 		      last_pfn < level_pfn + level_size(level) - 1)) {
 			dma_clear_pte(pte);
 			domain_flush_cache(domain, pte, sizeof(*pte));
-			free_pgtable_page(level_pte);
+			domain_free_pgtable_page(domain, level_pte);
 		}
 next:
 		pfn += level_size(level);
@@ -1087,7 +1090,7 @@ static void dma_pte_free_pagetable(struct dmar_domain *domain,
 
 	/* free pgd */
 	if (start_pfn == 0 && last_pfn == DOMAIN_MAX_PFN(domain->gaw)) {
-		free_pgtable_page(domain->pgd);
+		domain_free_pgtable_page(domain, domain->pgd);
 		domain->pgd = NULL;
 	}
 }
@@ -1862,7 +1865,7 @@ static void domain_exit(struct dmar_domain *domain)
 		LIST_HEAD(freelist);
 
 		domain_unmap(domain, 0, DOMAIN_MAX_PFN(domain->gaw), &freelist);
-		put_pages_list(&freelist);
+		iommu_put_pages_list(&domain->domain, &freelist);
 	}
 
 	if (WARN_ON(!list_empty(&domain->devices)))
@@ -2041,9 +2044,14 @@ static int domain_context_mapping_one(struct dmar_domain *domain,
 	 * It's a non-present to present mapping. If hardware doesn't cache
 	 * non-present entry we only need to flush the write-buffer. If the
 	 * _does_ cache non-present entries, then it does so in the special
-	 * domain #0, which we have to flush:
+	 * domain #0, which we have to flush. When the device is attached as
+	 * part of a batch, one global flush is done for all of them in
+	 * intel_iommu_sync_batched_attach().
 	 */
-	if (cap_caching_mode(iommu->cap)) {
+	if (cap_caching_mode(iommu->cap) && info &&
+	    info->dev->iommu->attach_batched) {
+		iommu->ctx_flush_pending = true;
+	} else if (cap_caching_mode(iommu->cap)) {
 		iommu->flush.flush_context(iommu, 0,
 					   (((u16)bus) << 8) | devfn,
 					   DMA_CCMD_MASK_NOBIT,
@@ -3585,7 +3593,7 @@ static int intel_iommu_memory_notifier(struct notifier_block *nb,
 					start_vpfn, mhp->nr_pages,
 					list_empty(&freelist), 0);
 			rcu_read_unlock();
-			put_pages_list(&freelist);
+			iommu_put_pages_list(&si_domain->domain, &freelist);
 		}
 		break;
 	}
@@ -4016,7 +4024,7 @@ static int md_domain_init(struct dmar_domain *domain, int guest_width)
 	domain->max_addr = 0;
 
 	/* always allocate the top pgd */
-	domain->pgd = alloc_pgtable_page(domain->nid, GFP_ATOMIC);
+	domain->pgd = domain_alloc_pgtable_page(domain, GFP_ATOMIC);
 	if (!domain->pgd)
 		return -ENOMEM;
 	domain_flush_cache(domain, domain->pgd, PAGE_SIZE);
@@ -4165,7 +4173,7 @@ int prepare_domain_attach_device(struct iommu_domain *domain,
 		pte = dmar_domain->pgd;
 		if (dma_pte_present(pte)) {
 			dmar_domain->pgd = phys_to_virt(dma_pte_addr(pte));
-			free_pgtable_page(pte);
+			domain_free_pgtable_page(dmar_domain, pte);
 		}
 		dmar_domain->agaw--;
 	}
@@ -4293,6 +4301,108 @@ static size_t intel_iommu_unmap_pages(struct iommu_domain *domain,
 	return intel_iommu_unmap(domain, iova, size, gather);
 }
 
+/*
+ * Replace the table @pte points to at @level by a superpage if all of its
+ * entries are leaves mapping contiguous memory with the same attributes. The
+ * superpage translates exactly like the table did, so it is installed over
+ * the live entry and the table waits on @freelist for the IOTLB and paging
+ * structure caches to be flushed.
+ */
+static bool dma_pte_collapse_table(struct dmar_domain *domain, int level,
+				   struct dma_pte *pte,
+				   struct list_head *freelist)
+{
+	struct dma_pte *table = phys_to_virt(dma_pte_addr(pte));
+	u64 sz = (u64)lvl_to_nr_pages(level - 1) << VTD_PAGE_SHIFT;
+	u64 addr = dma_pte_addr(&table[0]);
+	u64 attr = table[0].val ^ addr;
+	int i;
+
+	if (domain->iommu_superpage < level - 1)
+		return false;
+
+	if (!IS_ALIGNED(addr >> VTD_PAGE_SHIFT, lvl_to_nr_pages(level)))
+		return false;
+
+	for (i = 0; i < BIT(LEVEL_STRIDE); i++) {
+		struct dma_pte *cur = &table[i];
+
+		if (!dma_pte_present(cur) ||
+		    (level > 2 && !dma_pte_superpage(cur)))
+			return false;
+
+		if (dma_pte_addr(cur) != addr + i * sz ||
+		    (cur->val ^ dma_pte_addr(cur)) != attr)
+			return false;
+	}
+
+	WRITE_ONCE(pte->val, table[0].val | DMA_PTE_LARGE_PAGE);
+	domain_flush_cache(domain, pte, sizeof(*pte));
+	list_add_tail(&virt_to_page(table)->lru, freelist);
+	return true;
+}
+
+static size_t dma_pte_collapse_level(struct dmar_domain *domain, int level,
+				     struct dma_pte *pte, unsigned long pfn,
+				     unsigned long start_pfn,
+				     unsigned long last_pfn,
+				     struct list_head *freelist)
+{
+	size_t collapsed = 0;
+
+	pfn = max(start_pfn, pfn);
+	pte = &pte[pfn_level_offset(pfn, level)];
+
+	do {
+		unsigned long level_pfn = pfn & level_mask(level);
+		size_t sub = 0;
+
+		if (!dma_pte_present(pte) || dma_pte_superpage(pte))
+			goto next;
+
+		/* Bottom up, so 2MiB superpages can form a 1GiB one again */
+		if (level > 2)
+			sub = dma_pte_collapse_level(domain, level - 1,
+						     phys_to_virt(dma_pte_addr(pte)),
+						     level_pfn, start_pfn,
+						     last_pfn, freelist);
+
+		if (level_pfn >= start_pfn &&
+		    level_pfn + level_size(level) - 1 <= last_pfn &&
+		    dma_pte_collapse_table(domain, level, pte, freelist))
+			collapsed += level_size(level) << VTD_PAGE_SHIFT;
+		else
+			collapsed += sub;
+next:
+		pfn = level_pfn + level_size(level);
+	} while (!first_pte_in_page(++pte) && pfn <= last_pfn);
+
+	return collapsed;
+}
+
+static size_t intel_iommu_collapse_pages(struct iommu_domain *domain,
+					 unsigned long iova, size_t size,
+					 struct iommu_iotlb_gather *gather)
+{
+	struct dmar_domain *dmar_domain = to_dmar_domain(domain);
+	unsigned long start_pfn = iova >> VTD_PAGE_SHIFT;
+	unsigned long last_pfn = (iova + size - 1) >> VTD_PAGE_SHIFT;
+	size_t collapsed;
+
+	if (!dmar_domain->iommu_superpage ||
+	    !domain_pfn_supported(dmar_domain, last_pfn))
+		return 0;
+
+	collapsed = dma_pte_collapse_level(dmar_domain,
+					   agaw_to_level(dmar_domain->agaw),
+					   dmar_domain->pgd, 0, start_pfn,
+					   last_pfn, &gather->freelist);
+	if (collapsed)
+		iommu_iotlb_gather_add_range(gather, iova, size);
+
+	return collapsed;
+}
+
 static void intel_iommu_tlb_sync(struct iommu_domain *domain,
 				 struct iommu_iotlb_gather *gather)
 {
@@ -4312,7 +4422,7 @@ static void intel_iommu_tlb_sync(struct iommu_domain *domain,
 				      start_pfn, nrpages,
 				      list_empty(&gather->freelist), 0);
 
-	put_pages_list(&gather->freelist);
+	iommu_put_pages_list(domain, &gather->freelist);
 }
 
 static phys_addr_t intel_iommu_iova_to_phys(struct iommu_domain *domain,
@@ -4498,6 +4608,22 @@ static void intel_iommu_probe_finalize(struct device *dev)
 	iommu_setup_dma_ops(dev, 0, U64_MAX);
 }
 
+static void intel_iommu_sync_batched_attach(struct device *dev)
+{
+	struct device_domain_info *info = dev_iommu_priv_get(dev);
+	struct intel_iommu *iommu = info->iommu;
+
+	spin_lock(&iommu->lock);
+	if (iommu->ctx_flush_pending) {
+		iommu->flush.flush_context(iommu, 0, 0, 0, DMA_CCMD_GLOBAL_INVL);
+		if (sm_supported(iommu))
+			qi_flush_pasid_cache(iommu, 0, QI_PC_GLOBAL, 0);
+		iommu->flush.flush_iotlb(iommu, 0, 0, 0, DMA_TLB_GLOBAL_FLUSH);
+		iommu->ctx_flush_pending = false;
+	}
+	spin_unlock(&iommu->lock);
+}
+
 static void intel_iommu_get_resv_regions(struct device *device,
 					 struct list_head *head)
 {
@@ -4864,6 +4990,7 @@ const struct iommu_ops intel_iommu_ops = {
 	.domain_alloc_user	= intel_iommu_domain_alloc_user,
 	.probe_device		= intel_iommu_probe_device,
 	.probe_finalize		= intel_iommu_probe_finalize,
+	.sync_batched_attach	= intel_iommu_sync_batched_attach,
 	.release_device		= intel_iommu_release_device,
 	.get_resv_regions	= intel_iommu_get_resv_regions,
 	.device_group		= intel_iommu_device_group,
@@ -4881,6 +5008,7 @@ const struct iommu_ops intel_iommu_ops = {
 		.set_dev_pasid		= intel_iommu_set_dev_pasid,
 		.map_pages		= intel_iommu_map_pages,
 		.unmap_pages		= intel_iommu_unmap_pages,
+		.collapse_pages		= intel_iommu_collapse_pages,
 		.iotlb_sync_map		= intel_iommu_iotlb_sync_map,
 		.flush_iotlb_all        = intel_flush_iotlb_all,
 		.iotlb_sync		= intel_iommu_tlb_sync,
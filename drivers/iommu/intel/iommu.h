@@ -34,6 +34,9 @@
 #define VTD_PAGE_MASK		(((u64)-1) << VTD_PAGE_SHIFT)
 #define VTD_PAGE_ALIGN(addr)	(((addr) + VTD_PAGE_SIZE - 1) & VTD_PAGE_MASK)
 
+#define MAX_AGAW_WIDTH 64
+#define MAX_AGAW_PFN_WIDTH	(MAX_AGAW_WIDTH - VTD_PAGE_SHIFT)
+
 #define VTD_STRIDE_SHIFT        (9)
 #define VTD_STRIDE_MASK         (((u64)-1) << VTD_STRIDE_SHIFT)
 
@@ -509,6 +512,10 @@ struct irq_domain;
 struct ir_table {
 	struct irte *base;
 	unsigned long *bitmap;
+	/* Entries left for intel_ir_batch_flush(), under irq_2_ir_lock */
+	bool batch_pending;
+	int batch_start;
+	int batch_last;
 };
 
 void intel_irq_remap_add_device(struct dmar_pci_notify_info *info);
@@ -693,6 +700,7 @@ struct intel_iommu {
 	unsigned long	*copied_tables; /* bitmap of copied tables */
 	spinlock_t	lock; /* protect context, domain ids */
 	struct root_entry *root_entry; /* virtual address */
+	bool		ctx_flush_pending; /* batched attach left caches stale */
 
 	struct iommu_flush flush;
 #endif
@@ -716,7 +724,6 @@ struct intel_iommu {
 	u32		flags;      /* Software defined flags */
 
 	struct dmar_drhd_unit *drhd;
-	void *perf_statistic;
 
 	struct iommu_pmu *pmu;
 };
@@ -846,6 +853,11 @@ void qi_flush_piotlb(struct intel_iommu *iommu, u16 did, u32 pasid, u64 addr,
 void qi_flush_dev_iotlb_pasid(struct intel_iommu *iommu, u16 sid, u16 pfsid,
 			      u32 pasid, u16 qdep, u64 addr,
 			      unsigned int size_order);
+/* Build the descriptors of the two above, to submit several at once */
+void qi_desc_piotlb(u16 did, u32 pasid, u64 addr, unsigned long npages,
+		    bool ih, struct qi_desc *desc);
+void qi_desc_dev_iotlb_pasid(u16 sid, u16 pfsid, u32 pasid, u16 qdep, u64 addr,
+			     unsigned int size_order, struct qi_desc *desc);
 void quirk_extra_dev_tlb_flush(struct device_domain_info *info,
 			       unsigned long address, unsigned long pages,
 			       u32 pasid, u16 qdep);
@@ -901,11 +913,19 @@ struct intel_svm_dev {
 	u16 sid, qdep;
 };
 
+/* Descriptors an mm notifier invalidation submits at once */
+#define INTEL_SVM_INV_BATCH	16
+
 struct intel_svm {
 	struct mmu_notifier notifier;
 	struct mm_struct *mm;
 	u32 pasid;
 	struct list_head devs;
+	/* Protects the invalidation batch below */
+	spinlock_t inv_lock;
+	struct intel_iommu *inv_iommu;
+	unsigned int inv_count;
+	struct qi_desc inv_descs[INTEL_SVM_INV_BATCH];
 };
 #else
 static inline void intel_svm_check(struct intel_iommu *iommu) {}
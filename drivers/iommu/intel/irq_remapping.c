@@ -153,9 +153,24 @@ static int qi_flush_iec(struct intel_iommu *iommu, int index, int mask)
 	desc.qw2 = 0;
 	desc.qw3 = 0;
 
+	iommu_perf_count(NULL, IOMMU_PERF_IRTE_FLUSH, 1, 0);
 	return qi_submit_sync(iommu, &desc, 1, 0);
 }
 
+static void ir_batch_add(struct ir_table *table, int index)
+{
+	lockdep_assert_held(&irq_2_ir_lock);
+
+	if (!table->batch_pending) {
+		table->batch_pending = true;
+		table->batch_start = index;
+		table->batch_last = index;
+		return;
+	}
+	table->batch_start = min(table->batch_start, index);
+	table->batch_last = max(table->batch_last, index);
+}
+
 static int modify_irte(struct irq_2_iommu *irq_iommu,
 		       struct irte *irte_modified)
 {
@@ -174,6 +189,16 @@ static int modify_irte(struct irq_2_iommu *irq_iommu,
 	index = irq_iommu->irte_index + irq_iommu->sub_handle;
 	irte = &iommu->ir_table->base[index];
 
+	/*
+	 * Rewriting the same entry needs no invalidation either. KVM does
+	 * that for posted interrupts whenever it re-applies an unchanged
+	 * routing, vCPU migration itself only changes the PI descriptor.
+	 */
+	if (irte->irte == irte_modified->irte) {
+		rc = 0;
+		goto out;
+	}
+
 	if ((irte->pst == 1) || (irte_modified->pst == 1)) {
 		/*
 		 * We use cmpxchg16 to atomically update the 128-bit IRTE,
@@ -188,9 +213,16 @@ static int modify_irte(struct irq_2_iommu *irq_iommu,
 		WRITE_ONCE(irte->high, irte_modified->high);
 	}
 	__iommu_flush_cache(iommu, irte, sizeof(*irte));
+	iommu_perf_count(NULL, IOMMU_PERF_IRTE_WRITE, 1, 0);
 
-	rc = qi_flush_iec(iommu, index, 0);
+	if (irq_remapping_batched()) {
+		ir_batch_add(iommu->ir_table, index);
+		rc = 0;
+	} else {
+		rc = qi_flush_iec(iommu, index, 0);
+	}
 
+out:
 	/* Update iommu mode according to the IRTE mode */
 	irq_iommu->mode = irte->pst ? IRQ_POSTING : IRQ_REMAPPING;
 	raw_spin_unlock_irqrestore(&irq_2_ir_lock, flags);
@@ -1118,12 +1150,45 @@ static void prepare_irte(struct irte *irte, int vector, unsigned int dest)
 	irte->redir_hint = 1;
 }
 
+/*
+ * Invalidate the entries modified during a batch with one selective IEC
+ * invalidation per IOMMU, covering the smallest naturally aligned block that
+ * contains all of them. A block larger than the hardware supports falls back
+ * to a global invalidation.
+ */
+static void intel_ir_batch_flush(void)
+{
+	struct dmar_drhd_unit *drhd;
+	struct intel_iommu *iommu;
+	struct ir_table *table;
+	unsigned long flags;
+	int mask;
+
+	raw_spin_lock_irqsave(&irq_2_ir_lock, flags);
+	for_each_iommu(iommu, drhd) {
+		table = iommu->ir_table;
+		if (!table || !table->batch_pending)
+			continue;
+
+		mask = fls(table->batch_start ^ table->batch_last);
+		if (mask > ecap_max_handle_mask(iommu->ecap))
+			qi_global_iec(iommu);
+		else
+			qi_flush_iec(iommu,
+				     table->batch_start & ~((1 << mask) - 1),
+				     mask);
+		table->batch_pending = false;
+	}
+	raw_spin_unlock_irqrestore(&irq_2_ir_lock, flags);
+}
+
 struct irq_remap_ops intel_irq_remap_ops = {
 	.prepare		= intel_prepare_irq_remapping,
 	.enable			= intel_enable_irq_remapping,
 	.disable		= disable_irq_remapping,
 	.reenable		= reenable_irq_remapping,
 	.enable_faulting	= enable_drhd_fault_handling,
+	.batch_flush		= intel_ir_batch_flush,
 };
 
 static void intel_ir_reconfigure_irte(struct irq_data *irqd, bool force)
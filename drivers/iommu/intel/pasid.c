@@ -498,15 +498,21 @@ void intel_pasid_tear_down_entry(struct intel_iommu *iommu, struct device *dev,
 /*
  * This function flushes cache for a newly setup pasid table entry.
  * Caller of it should not modify the in-use pasid table entries.
+ * When the entry is set up as part of a batch of attachments, the
+ * caching mode invalidations are left to intel_iommu_sync_batched_attach(),
+ * which does a single global flush for the whole batch.
  */
-static void pasid_flush_caches(struct intel_iommu *iommu,
-				struct pasid_entry *pte,
-			       u32 pasid, u16 did)
+static void pasid_flush_caches(struct intel_iommu *iommu, struct device *dev,
+			       struct pasid_entry *pte, u32 pasid, u16 did)
 {
 	if (!ecap_coherent(iommu->ecap))
 		clflush_cache_range(pte, sizeof(*pte));
 
-	if (cap_caching_mode(iommu->cap)) {
+	if (cap_caching_mode(iommu->cap) && dev->iommu->attach_batched) {
+		spin_lock(&iommu->lock);
+		iommu->ctx_flush_pending = true;
+		spin_unlock(&iommu->lock);
+	} else if (cap_caching_mode(iommu->cap)) {
 		pasid_cache_invalidation_with_pasid(iommu, did, pasid);
 		qi_flush_piotlb(iommu, did, pasid, 0, -1, 0);
 	} else {
@@ -569,7 +575,7 @@ int intel_pasid_setup_first_level(struct intel_iommu *iommu,
 	pasid_set_present(pte);
 	spin_unlock(&iommu->lock);
 
-	pasid_flush_caches(iommu, pte, pasid, did);
+	pasid_flush_caches(iommu, dev, pte, pasid, did);
 
 	return 0;
 }
@@ -649,7 +655,7 @@ int intel_pasid_setup_second_level(struct intel_iommu *iommu,
 	pasid_set_present(pte);
 	spin_unlock(&iommu->lock);
 
-	pasid_flush_caches(iommu, pte, pasid, did);
+	pasid_flush_caches(iommu, dev, pte, pasid, did);
 
 	return 0;
 }
@@ -685,7 +691,7 @@ int intel_pasid_setup_pass_through(struct intel_iommu *iommu,
 	pasid_set_present(pte);
 	spin_unlock(&iommu->lock);
 
-	pasid_flush_caches(iommu, pte, pasid, did);
+	pasid_flush_caches(iommu, dev, pte, pasid, did);
 
 	return 0;
 }
@@ -834,7 +840,7 @@ int intel_pasid_setup_nested(struct intel_iommu *iommu, struct device *dev,
 	pasid_set_present(pte);
 	spin_unlock(&iommu->lock);
 
-	pasid_flush_caches(iommu, pte, pasid, did);
+	pasid_flush_caches(iommu, dev, pte, pasid, did);
 
 	return 0;
 }
@@ -21,7 +21,6 @@
 
 #include "iommu.h"
 #include "pasid.h"
-#include "perf.h"
 #include "../iommu-sva.h"
 #include "trace.h"
 
@@ -169,24 +168,58 @@ void intel_svm_check(struct intel_iommu *iommu)
 	iommu->flags |= VTD_FLAG_SVM_CAPABLE;
 }
 
+/*
+ * The invalidations of one notifier call are queued in svm->inv_descs and
+ * submitted with a single wait descriptor per IOMMU, instead of waiting for
+ * the IOTLB and the device TLB invalidation of every device in turn.
+ */
+static void intel_svm_inv_submit(struct intel_svm *svm)
+{
+	lockdep_assert_held(&svm->inv_lock);
+
+	if (!svm->inv_count)
+		return;
+	qi_submit_sync(svm->inv_iommu, svm->inv_descs, svm->inv_count, 0);
+	svm->inv_count = 0;
+}
+
+static void intel_svm_inv_add(struct intel_svm *svm,
+			      struct intel_iommu *iommu, struct qi_desc *desc)
+{
+	lockdep_assert_held(&svm->inv_lock);
+
+	if (svm->inv_count && (svm->inv_iommu != iommu ||
+			       svm->inv_count == ARRAY_SIZE(svm->inv_descs)))
+		intel_svm_inv_submit(svm);
+	svm->inv_iommu = iommu;
+	svm->inv_descs[svm->inv_count++] = *desc;
+}
+
+/* pages == -1 invalidates the whole PASID */
 static void __flush_svm_range_dev(struct intel_svm *svm,
 				  struct intel_svm_dev *sdev,
 				  unsigned long address,
 				  unsigned long pages, int ih)
 {
 	struct device_domain_info *info = dev_iommu_priv_get(sdev->dev);
+	unsigned int size_order;
+	struct qi_desc desc;
 
 	if (WARN_ON(!pages))
 		return;
 
-	qi_flush_piotlb(sdev->iommu, sdev->did, svm->pasid, address, pages, ih);
-	if (info->ats_enabled) {
-		qi_flush_dev_iotlb_pasid(sdev->iommu, sdev->sid, info->pfsid,
-					 svm->pasid, sdev->qdep, address,
-					 order_base_2(pages));
-		quirk_extra_dev_tlb_flush(info, address, order_base_2(pages),
-					  svm->pasid, sdev->qdep);
-	}
+	qi_desc_piotlb(sdev->did, svm->pasid, address, pages, ih, &desc);
+	intel_svm_inv_add(svm, sdev->iommu, &desc);
+	if (!info->ats_enabled)
+		return;
+
+	size_order = pages == -1 ? MAX_AGAW_PFN_WIDTH : order_base_2(pages);
+	qi_desc_dev_iotlb_pasid(sdev->sid, info->pfsid, svm->pasid, sdev->qdep,
+				address, size_order, &desc);
+	intel_svm_inv_add(svm, sdev->iommu, &desc);
+	/* See quirk_extra_dev_tlb_flush() */
+	if (info->dtlb_extra_inval)
+		intel_svm_inv_add(svm, sdev->iommu, &desc);
 }
 
 static void intel_flush_svm_range_dev(struct intel_svm *svm,
@@ -194,10 +227,17 @@ static void intel_flush_svm_range_dev(struct intel_svm *svm,
 				      unsigned long address,
 				      unsigned long pages, int ih)
 {
-	unsigned long shift = ilog2(__roundup_pow_of_two(pages));
-	unsigned long align = (1ULL << (VTD_PAGE_SHIFT + shift));
-	unsigned long start = ALIGN_DOWN(address, align);
-	unsigned long end = ALIGN(address + (pages << VTD_PAGE_SHIFT), align);
+	unsigned long shift, align, start, end;
+
+	if (pages == -1) {
+		__flush_svm_range_dev(svm, sdev, 0, -1, ih);
+		return;
+	}
+
+	shift = ilog2(__roundup_pow_of_two(pages));
+	align = (1ULL << (VTD_PAGE_SHIFT + shift));
+	start = ALIGN_DOWN(address, align);
+	end = ALIGN(address + (pages << VTD_PAGE_SHIFT), align);
 
 	while (start < end) {
 		__flush_svm_range_dev(svm, sdev, start, align >> VTD_PAGE_SHIFT, ih);
@@ -209,11 +249,15 @@ static void intel_flush_svm_range(struct intel_svm *svm, unsigned long address,
 				unsigned long pages, int ih)
 {
 	struct intel_svm_dev *sdev;
+	unsigned long flags;
 
+	spin_lock_irqsave(&svm->inv_lock, flags);
 	rcu_read_lock();
 	list_for_each_entry_rcu(sdev, &svm->devs, list)
 		intel_flush_svm_range_dev(svm, sdev, address, pages, ih);
+	intel_svm_inv_submit(svm);
 	rcu_read_unlock();
+	spin_unlock_irqrestore(&svm->inv_lock, flags);
 }
 
 /* Pages have been freed at this point */
@@ -223,6 +267,11 @@ static void intel_arch_invalidate_secondary_tlbs(struct mmu_notifier *mn,
 {
 	struct intel_svm *svm = container_of(mn, struct intel_svm, notifier);
 
+	if (start == 0 && end == -1UL) {
+		intel_flush_svm_range(svm, 0, -1, 0);
+		return;
+	}
+
 	intel_flush_svm_range(svm, start,
 			      (end - start + PAGE_SIZE - 1) >> VTD_PAGE_SHIFT, 0);
 }
@@ -307,6 +356,7 @@ static int intel_svm_bind_mm(struct intel_iommu *iommu, struct device *dev,
 		svm->pasid = mm->pasid;
 		svm->mm = mm;
 		INIT_LIST_HEAD_RCU(&svm->devs);
+		spin_lock_init(&svm->inv_lock);
 
 		svm->notifier.ops = &intel_mmuops;
 		ret = mmu_notifier_register(&svm->notifier, mm);
@@ -573,7 +623,7 @@ static int intel_svm_prq_report(struct intel_iommu *iommu, struct device *dev,
 		event.fault.prm.flags |= IOMMU_FAULT_PAGE_REQUEST_PRIV_DATA;
 		event.fault.prm.private_data[0] = desc->priv_data[0];
 		event.fault.prm.private_data[1] = desc->priv_data[1];
-	} else if (dmar_latency_enabled(iommu, DMAR_LATENCY_PRQ)) {
+	} else if (iommu_latency_enabled(&iommu->iommu, IOMMU_LATENCY_PRQ)) {
 		/*
 		 * If the private data fields are not used by hardware, use it
 		 * to monitor the prq handle latency.
@@ -623,14 +673,40 @@ static void handle_bad_prq_event(struct intel_iommu *iommu,
 	qi_submit_sync(iommu, &desc, 1, 0);
 }
 
+/*
+ * Page requests are handled in batches of PRQ_POLL_BUDGET descriptors, after
+ * which their slots are returned to the hardware and the thread may yield.
+ * The thread keeps going as long as requests arrive, for up to PRQ_DEPTH
+ * descriptors per interrupt. After a burst, the queue is also polled for up
+ * to PRQ_BUSY_POLL_US before the interrupt is re-armed, so that a fault storm
+ * is handled without one interrupt and one thread wakeup per batch.
+ */
+#define PRQ_POLL_BUDGET		64
+#define PRQ_BUSY_POLL_US	20
+
+static bool prq_busy_poll(struct intel_iommu *iommu, int head)
+{
+	ktime_t timeout = ktime_add_us(ktime_get(), PRQ_BUSY_POLL_US);
+
+	do {
+		if ((dmar_readq(iommu->reg + DMAR_PQT_REG) & PRQ_RING_MASK) != head)
+			return true;
+		cpu_relax();
+	} while (ktime_before(ktime_get(), timeout));
+
+	return false;
+}
+
 static irqreturn_t prq_event_thread(int irq, void *d)
 {
 	struct intel_iommu *iommu = d;
+	struct pci_dev *pdev = NULL;
 	struct page_req_dsc *req;
-	int head, tail, handled;
-	struct pci_dev *pdev;
+	int head, tail, handled = 0;
 	u64 address;
 
+	head = dmar_readq(iommu->reg + DMAR_PQH_REG) & PRQ_RING_MASK;
+again:
 	/*
 	 * Clear PPR bit before reading head/tail registers, to ensure that
 	 * we get a new interrupt if needed.
@@ -638,8 +714,6 @@ static irqreturn_t prq_event_thread(int irq, void *d)
 	writel(DMA_PRS_PPR, iommu->reg + DMAR_PRS_REG);
 
 	tail = dmar_readq(iommu->reg + DMAR_PQT_REG) & PRQ_RING_MASK;
-	head = dmar_readq(iommu->reg + DMAR_PQH_REG) & PRQ_RING_MASK;
-	handled = (head != tail);
 	while (head != tail) {
 		req = &iommu->prq[head / sizeof(*req)];
 		address = (u64)req->addr << VTD_PAGE_SHIFT;
@@ -674,9 +748,13 @@ static irqreturn_t prq_event_thread(int irq, void *d)
 		if (unlikely(req->lpig && !req->rd_req && !req->wr_req))
 			goto prq_advance;
 
-		pdev = pci_get_domain_bus_and_slot(iommu->segment,
-						   PCI_BUS_NUM(req->rid),
-						   req->rid & 0xff);
+		/* Requests of a storm mostly come from the same device */
+		if (!pdev || pci_dev_id(pdev) != req->rid) {
+			pci_dev_put(pdev);
+			pdev = pci_get_domain_bus_and_slot(iommu->segment,
+							   PCI_BUS_NUM(req->rid),
+							   req->rid & 0xff);
+		}
 		/*
 		 * If prq is to be handled outside iommu driver via receiver of
 		 * the fault notifiers, we skip the page response here.
@@ -690,13 +768,31 @@ static irqreturn_t prq_event_thread(int irq, void *d)
 			trace_prq_report(iommu, &pdev->dev, req->qw_0, req->qw_1,
 					 req->priv_data[0], req->priv_data[1],
 					 iommu->prq_seq_number++);
-		pci_dev_put(pdev);
 prq_advance:
 		head = (head + sizeof(*req)) & PRQ_RING_MASK;
+		if (++handled % PRQ_POLL_BUDGET == 0) {
+			dmar_writeq(iommu->reg + DMAR_PQH_REG, head);
+			/* Let intel_drain_pasid_prq() see the progress */
+			if (!completion_done(&iommu->prq_complete))
+				complete(&iommu->prq_complete);
+			cond_resched();
+		}
 	}
 
 	dmar_writeq(iommu->reg + DMAR_PQH_REG, tail);
 
+	/*
+	 * Requests that arrive after PPR was cleared raise a new interrupt, so
+	 * stopping here is always safe. Past PRQ_DEPTH requests, leave the CPU
+	 * to others until then.
+	 */
+	if (handled < PRQ_DEPTH &&
+	    ((dmar_readq(iommu->reg + DMAR_PQT_REG) & PRQ_RING_MASK) != head ||
+	     (handled >= PRQ_POLL_BUDGET && prq_busy_poll(iommu, head))))
+		goto again;
+
+	pci_dev_put(pdev);
+
 	/*
 	 * Clear the page request overflow bit and wake up all threads that
 	 * are waiting for the completion of this handling.
@@ -781,7 +877,7 @@ int intel_svm_page_response(struct device *dev,
 			desc.qw2 = prm->private_data[0];
 			desc.qw3 = prm->private_data[1];
 		} else if (prm->private_data[0]) {
-			dmar_latency_update(iommu, DMAR_LATENCY_PRQ,
+			iommu_latency_update(&iommu->iommu, IOMMU_LATENCY_PRQ,
 				ktime_to_ns(ktime_get()) - prm->private_data[0]);
 		}
 
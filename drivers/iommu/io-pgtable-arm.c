@@ -21,6 +21,7 @@
 #include <asm/barrier.h>
 
 #include "io-pgtable-arm.h"
+#include "iommu-pages.h"
 
 #define ARM_LPAE_MAX_ADDR_BITS		52
 #define ARM_LPAE_S2_MAX_CONCAT_PAGES	16
@@ -192,16 +193,15 @@ static void *__arm_lpae_alloc_pages(size_t size, gfp_t gfp,
 {
 	struct device *dev = cfg->iommu_dev;
 	int order = get_order(size);
-	struct page *p;
 	dma_addr_t dma;
 	void *pages;
 
 	VM_BUG_ON((gfp & __GFP_HIGHMEM));
-	p = alloc_pages_node(dev_to_node(dev), gfp | __GFP_ZERO, order);
-	if (!p)
+	pages = iommu_alloc_pages_node(cfg->domain, dev_to_node(dev), gfp,
+				       order);
+	if (!pages)
 		return NULL;
 
-	pages = page_address(p);
 	if (!cfg->coherent_walk) {
 		dma = dma_map_single(dev, pages, size, DMA_TO_DEVICE);
 		if (dma_mapping_error(dev, dma))
@@ -221,7 +221,7 @@ static void *__arm_lpae_alloc_pages(size_t size, gfp_t gfp,
 	dev_err(dev, "Cannot accommodate DMA translation for IOMMU page tables\n");
 	dma_unmap_single(dev, dma, size, DMA_TO_DEVICE);
 out_free:
-	__free_pages(p, order);
+	iommu_free_pages(cfg->domain, pages, order);
 	return NULL;
 }
 
@@ -231,7 +231,7 @@ static void __arm_lpae_free_pages(void *pages, size_t size,
 	if (!cfg->coherent_walk)
 		dma_unmap_single(cfg->iommu_dev, __arm_lpae_dma_addr(pages),
 				 size, DMA_TO_DEVICE);
-	free_pages((unsigned long)pages, get_order(size));
+	iommu_free_pages(cfg->domain, pages, get_order(size));
 }
 
 static void __arm_lpae_sync_pte(arm_lpae_iopte *ptep, int num_entries,
@@ -340,10 +340,23 @@ static arm_lpae_iopte arm_lpae_install_table(arm_lpae_iopte *table,
 	return old;
 }
 
+/*
+ * The leaf table arm_lpae_map_ranges() wrote last. Runs are usually close
+ * together in IOVA, so the next one can often be installed there directly
+ * instead of walking down from the pgd again.
+ */
+struct arm_lpae_map_cursor {
+	arm_lpae_iopte *table;
+	unsigned long iova;	/* first IOVA translated by @table */
+	u64 span;		/* bytes translated by @table */
+	int lvl;
+};
+
 static int __arm_lpae_map(struct arm_lpae_io_pgtable *data, unsigned long iova,
 			  phys_addr_t paddr, size_t size, size_t pgcount,
 			  arm_lpae_iopte prot, int lvl, arm_lpae_iopte *ptep,
-			  gfp_t gfp, size_t *mapped)
+			  gfp_t gfp, size_t *mapped,
+			  struct arm_lpae_map_cursor *cursor)
 {
 	arm_lpae_iopte *cptep, pte;
 	size_t block_size = ARM_LPAE_BLOCK_SIZE(lvl, data);
@@ -363,6 +376,13 @@ static int __arm_lpae_map(struct arm_lpae_io_pgtable *data, unsigned long iova,
 		if (!ret)
 			*mapped += num_entries * size;
 
+		if (cursor) {
+			cursor->table = ptep - map_idx_start;
+			cursor->lvl = lvl;
+			cursor->span = block_size << (data->bits_per_level +
+						      ARM_LPAE_PGD_IDX(lvl, data));
+			cursor->iova = iova & ~(cursor->span - 1);
+		}
 		return ret;
 	}
 
@@ -394,7 +414,7 @@ static int __arm_lpae_map(struct arm_lpae_io_pgtable *data, unsigned long iova,
 
 	/* Rinse, repeat */
 	return __arm_lpae_map(data, iova, paddr, size, pgcount, prot, lvl + 1,
-			      cptep, gfp, mapped);
+			      cptep, gfp, mapped, cursor);
 }
 
 static arm_lpae_iopte arm_lpae_prot_to_pte(struct arm_lpae_io_pgtable *data,
@@ -486,7 +506,7 @@ static int arm_lpae_map_pages(struct io_pgtable_ops *ops, unsigned long iova,
 
 	prot = arm_lpae_prot_to_pte(data, iommu_prot);
 	ret = __arm_lpae_map(data, iova, paddr, pgsize, pgcount, prot, lvl,
-			     ptep, gfp, mapped);
+			     ptep, gfp, mapped, NULL);
 	/*
 	 * Synchronise all PTE updates for the new mapping before there's
 	 * a chance for anything to kick off a table walk for the new iova.
@@ -496,6 +516,109 @@ static int arm_lpae_map_pages(struct io_pgtable_ops *ops, unsigned long iova,
 	return ret;
 }
 
+/* The largest block size the run can use at this position */
+static size_t arm_lpae_range_pgsize(struct arm_lpae_io_pgtable *data,
+				    unsigned long iova, phys_addr_t paddr,
+				    size_t size)
+{
+	unsigned long pgsizes;
+	u64 addr_merge = (u64)iova | paddr;
+
+	pgsizes = data->iop.cfg.pgsize_bitmap & GENMASK(__fls(size), 0);
+	if (addr_merge && __ffs64(addr_merge) < BITS_PER_LONG)
+		pgsizes &= GENMASK(__ffs64(addr_merge), 0);
+	return pgsizes ? BIT(__fls(pgsizes)) : 0;
+}
+
+static int arm_lpae_map_cursor(struct arm_lpae_io_pgtable *data,
+			       struct arm_lpae_map_cursor *cursor,
+			       unsigned long iova, phys_addr_t paddr,
+			       size_t pgsize, size_t pgcount,
+			       arm_lpae_iopte prot, gfp_t gfp, size_t *mapped)
+{
+	int ret, idx, num_entries;
+
+	if (!cursor->table ||
+	    pgsize != ARM_LPAE_BLOCK_SIZE(cursor->lvl, data) ||
+	    iova - cursor->iova >= cursor->span) {
+		cursor->table = NULL;
+		return __arm_lpae_map(data, iova, paddr, pgsize, pgcount, prot,
+				      data->start_level, data->pgd, gfp, mapped,
+				      cursor);
+	}
+
+	idx = ARM_LPAE_LVL_IDX(iova, cursor->lvl, data);
+	num_entries = min_t(size_t, pgcount,
+			    (cursor->span / pgsize) - idx);
+	ret = arm_lpae_init_pte(data, iova, paddr, prot, cursor->lvl,
+				num_entries, cursor->table + idx);
+	if (!ret)
+		*mapped += num_entries * pgsize;
+	return ret;
+}
+
+static int arm_lpae_map_ranges(struct io_pgtable_ops *ops,
+			       const struct iommu_map_range *ranges,
+			       unsigned int nr, int iommu_prot, gfp_t gfp,
+			       size_t *mapped)
+{
+	struct arm_lpae_io_pgtable *data = io_pgtable_ops_to_data(ops);
+	struct io_pgtable_cfg *cfg = &data->iop.cfg;
+	struct arm_lpae_map_cursor cursor = {};
+	arm_lpae_iopte prot;
+	unsigned int i;
+	int ret = 0;
+
+	/* If no access, then nothing to do */
+	if (!(iommu_prot & (IOMMU_READ | IOMMU_WRITE)))
+		return 0;
+
+	prot = arm_lpae_prot_to_pte(data, iommu_prot);
+	for (i = 0; i != nr; i++) {
+		unsigned long iova = ranges[i].iova;
+		phys_addr_t paddr = ranges[i].paddr;
+		size_t size = ranges[i].size;
+		long iaext = (s64)iova >> cfg->ias;
+
+		if (cfg->quirks & IO_PGTABLE_QUIRK_ARM_TTBR1)
+			iaext = ~iaext;
+		if (WARN_ON(iaext || paddr >> cfg->oas)) {
+			ret = -ERANGE;
+			break;
+		}
+
+		while (size) {
+			size_t pgsize = arm_lpae_range_pgsize(data, iova, paddr,
+							      size);
+			size_t done = 0;
+
+			if (WARN_ON(!pgsize)) {
+				ret = -EINVAL;
+				goto out;
+			}
+
+			/*
+			 * A leaf write stops at the end of its table, which is
+			 * where the next larger block size could start.
+			 */
+			ret = arm_lpae_map_cursor(data, &cursor, iova, paddr,
+						  pgsize, size / pgsize, prot,
+						  gfp, &done);
+			*mapped += done;
+			if (ret)
+				goto out;
+			iova += done;
+			paddr += done;
+			size -= done;
+		}
+	}
+out:
+	/* See arm_lpae_map_pages() */
+	wmb();
+
+	return ret;
+}
+
 static void __arm_lpae_free_pgtable(struct arm_lpae_io_pgtable *data, int lvl,
 				    arm_lpae_iopte *ptep)
 {
@@ -711,6 +834,114 @@ static phys_addr_t arm_lpae_iova_to_phys(struct io_pgtable_ops *ops,
 	return iopte_to_paddr(pte, data) | iova;
 }
 
+/*
+ * Replace the table at *ptep, translating the block at iova, by a block entry
+ * if all its entries are leaves mapping physically contiguous memory with the
+ * same attributes. The block is installed over the live table, which is only
+ * allowed with IO_PGTABLE_QUIRK_ARM_BBML2, and the old table is freed once
+ * the walk caches were invalidated.
+ */
+static bool arm_lpae_collapse_table(struct arm_lpae_io_pgtable *data,
+				    unsigned long iova, int lvl,
+				    arm_lpae_iopte *ptep)
+{
+	struct io_pgtable_cfg *cfg = &data->iop.cfg;
+	size_t blk_size = ARM_LPAE_BLOCK_SIZE(lvl, data);
+	size_t sz = ARM_LPAE_BLOCK_SIZE(lvl + 1, data);
+	arm_lpae_iopte pte = READ_ONCE(*ptep);
+	arm_lpae_iopte *tablep, prot;
+	phys_addr_t paddr;
+	int i;
+
+	if (!(blk_size & cfg->pgsize_bitmap))
+		return false;
+
+	tablep = iopte_deref(pte, data);
+	if (!iopte_leaf(tablep[0], lvl + 1, data->iop.fmt))
+		return false;
+
+	paddr = iopte_to_paddr(tablep[0], data);
+	if (!IS_ALIGNED(paddr, blk_size))
+		return false;
+
+	prot = iopte_prot(tablep[0]);
+	for (i = 1; i < ARM_LPAE_PTES_PER_TABLE(data); i++) {
+		arm_lpae_iopte cur = READ_ONCE(tablep[i]);
+
+		if (!iopte_leaf(cur, lvl + 1, data->iop.fmt) ||
+		    iopte_prot(cur) != prot ||
+		    iopte_to_paddr(cur, data) != paddr + i * sz)
+			return false;
+	}
+
+	__arm_lpae_init_pte(data, paddr, prot, lvl, 1, ptep);
+	io_pgtable_tlb_flush_walk(&data->iop, iova, blk_size,
+				  ARM_LPAE_GRANULE(data));
+	__arm_lpae_free_pages(tablep, ARM_LPAE_GRANULE(data), cfg);
+	return true;
+}
+
+static size_t __arm_lpae_collapse(struct arm_lpae_io_pgtable *data,
+				  unsigned long iova, unsigned long last,
+				  int lvl, arm_lpae_iopte *ptep)
+{
+	size_t blk_size = ARM_LPAE_BLOCK_SIZE(lvl, data);
+	size_t collapsed = 0;
+
+	/* Tables at the last level only hold leaves */
+	if (lvl == ARM_LPAE_MAX_LEVELS - 1)
+		return 0;
+
+	ptep += ARM_LPAE_LVL_IDX(iova, lvl, data);
+	while (true) {
+		unsigned long blk_iova = ALIGN_DOWN(iova, blk_size);
+		unsigned long blk_last = blk_iova + blk_size - 1;
+		arm_lpae_iopte pte = READ_ONCE(*ptep);
+
+		if (pte && !iopte_leaf(pte, lvl, data->iop.fmt)) {
+			size_t sub;
+
+			/* Collapse bottom up so small blocks can merge again */
+			sub = __arm_lpae_collapse(data, iova, min(last, blk_last),
+						  lvl + 1, iopte_deref(pte, data));
+			if (iova == blk_iova && blk_last <= last &&
+			    arm_lpae_collapse_table(data, blk_iova, lvl, ptep))
+				collapsed += blk_size;
+			else
+				collapsed += sub;
+		}
+
+		if (blk_last >= last)
+			break;
+		iova = blk_last + 1;
+		ptep++;
+	}
+	return collapsed;
+}
+
+static size_t arm_lpae_collapse_pages(struct io_pgtable_ops *ops,
+				      unsigned long iova, size_t size)
+{
+	struct arm_lpae_io_pgtable *data = io_pgtable_ops_to_data(ops);
+	struct io_pgtable_cfg *cfg = &data->iop.cfg;
+	unsigned long last = iova + size - 1;
+	long iaext = (s64)iova >> cfg->ias;
+	long last_iaext = (s64)last >> cfg->ias;
+
+	if (WARN_ON(!size || last < iova))
+		return 0;
+
+	if (cfg->quirks & IO_PGTABLE_QUIRK_ARM_TTBR1) {
+		iaext = ~iaext;
+		last_iaext = ~last_iaext;
+	}
+	if (WARN_ON(iaext || last_iaext))
+		return 0;
+
+	return __arm_lpae_collapse(data, iova, last, data->start_level,
+				   data->pgd);
+}
+
 static void arm_lpae_restrict_pgsizes(struct io_pgtable_cfg *cfg)
 {
 	unsigned long granule, page_sizes;
@@ -787,9 +1018,12 @@ arm_lpae_alloc_pgtable(struct io_pgtable_cfg *cfg)
 
 	data->iop.ops = (struct io_pgtable_ops) {
 		.map_pages	= arm_lpae_map_pages,
+		.map_ranges	= arm_lpae_map_ranges,
 		.unmap_pages	= arm_lpae_unmap_pages,
 		.iova_to_phys	= arm_lpae_iova_to_phys,
 	};
+	if (cfg->quirks & IO_PGTABLE_QUIRK_ARM_BBML2)
+		data->iop.ops.collapse_pages = arm_lpae_collapse_pages;
 
 	return data;
 }
@@ -804,7 +1038,8 @@ arm_64_lpae_alloc_pgtable_s1(struct io_pgtable_cfg *cfg, void *cookie)
 
 	if (cfg->quirks & ~(IO_PGTABLE_QUIRK_ARM_NS |
 			    IO_PGTABLE_QUIRK_ARM_TTBR1 |
-			    IO_PGTABLE_QUIRK_ARM_OUTER_WBWA))
+			    IO_PGTABLE_QUIRK_ARM_OUTER_WBWA |
+			    IO_PGTABLE_QUIRK_ARM_BBML2))
 		return NULL;
 
 	data = arm_lpae_alloc_pgtable(cfg);
@@ -906,7 +1141,7 @@ arm_64_lpae_alloc_pgtable_s2(struct io_pgtable_cfg *cfg, void *cookie)
 	typeof(&cfg->arm_lpae_s2_cfg.vtcr) vtcr = &cfg->arm_lpae_s2_cfg.vtcr;
 
 	/* The NS quirk doesn't apply at stage 2 */
-	if (cfg->quirks)
+	if (cfg->quirks & ~IO_PGTABLE_QUIRK_ARM_BBML2)
 		return NULL;
 
 	data = arm_lpae_alloc_pgtable(cfg);
@@ -1163,6 +1398,7 @@ static int __init arm_lpae_run_tests(struct io_pgtable_cfg *cfg)
 	unsigned long iova;
 	size_t size, mapped;
 	struct io_pgtable_ops *ops;
+	struct iommu_map_range ranges[3];
 
 	selftest_running = true;
 
@@ -1247,6 +1483,49 @@ static int __init arm_lpae_run_tests(struct io_pgtable_cfg *cfg)
 			iova += SZ_1G;
 		}
 
+		/* Scattered runs in one call */
+		size = 1UL << __ffs(cfg->pgsize_bitmap);
+		iova = 3UL * SZ_1G;
+		ranges[0] = (struct iommu_map_range){ iova, 0, size };
+		ranges[1] = (struct iommu_map_range){ iova + size, 4 * size,
+						      2 * size };
+		ranges[2] = (struct iommu_map_range){ iova + 8 * size, size,
+						      size };
+		mapped = 0;
+		if (ops->map_ranges(ops, ranges, ARRAY_SIZE(ranges),
+				    IOMMU_READ | IOMMU_WRITE, GFP_KERNEL,
+				    &mapped) || mapped != 4 * size)
+			return __FAIL(ops, i);
+
+		if (ops->iova_to_phys(ops, iova + 42) != 42 ||
+		    ops->iova_to_phys(ops, iova + 2 * size + 42) !=
+			    5 * size + 42 ||
+		    ops->iova_to_phys(ops, iova + 8 * size + 42) != size + 42)
+			return __FAIL(ops, i);
+
+		if (ops->unmap_pages(ops, iova, size, 3, NULL) != 3 * size ||
+		    ops->unmap_pages(ops, iova + 8 * size, size, 1, NULL) != size)
+			return __FAIL(ops, i);
+
+		/* Collapse a block remapped with pages */
+		j = find_next_bit(&cfg->pgsize_bitmap, BITS_PER_LONG,
+				  __ffs(cfg->pgsize_bitmap) + 1);
+		iova = SZ_1G;
+		if (ops->unmap_pages(ops, iova, 1UL << j, 1, NULL) != 1UL << j)
+			return __FAIL(ops, i);
+
+		if (ops->map_pages(ops, iova, iova, size, (1UL << j) / size,
+				   IOMMU_READ, GFP_KERNEL, &mapped))
+			return __FAIL(ops, i);
+
+		if (ops->collapse_pages(ops, iova, 1UL << j) != 1UL << j ||
+		    ops->collapse_pages(ops, iova, 1UL << j))
+			return __FAIL(ops, i);
+
+		if (ops->iova_to_phys(ops, iova + (1UL << j) - 42) !=
+		    iova + (1UL << j) - 42)
+			return __FAIL(ops, i);
+
 		free_io_pgtable_ops(ops);
 	}
 
@@ -1272,6 +1551,7 @@ static int __init arm_lpae_do_selftests(void)
 		.tlb = &dummy_tlb_ops,
 		.oas = 48,
 		.coherent_walk = true,
+		.quirks = IO_PGTABLE_QUIRK_ARM_BBML2,
 		.iommu_dev = &dev,
 	};
 
@@ -10,6 +10,10 @@
 #include <linux/pci.h>
 #include <linux/iommu.h>
 #include <linux/debugfs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "iommu-priv.h"
 
 struct dentry *iommu_debugfs_dir;
 EXPORT_SYMBOL_GPL(iommu_debugfs_dir);
@@ -49,3 +53,339 @@ void iommu_debugfs_setup(void)
 		pr_warn("*************************************************************\n");
 	}
 }
+
+#ifdef CONFIG_IOMMU_LATENCY
+enum iommu_latency_count {
+	COUNTS_10e2 = 0,	/* < 0.1us	*/
+	COUNTS_10e3,		/* 0.1us ~ 1us	*/
+	COUNTS_10e4,		/* 1us ~ 10us	*/
+	COUNTS_10e5,		/* 10us ~ 100us	*/
+	COUNTS_10e6,		/* 100us ~ 1ms	*/
+	COUNTS_10e7,		/* 1ms ~ 10ms	*/
+	COUNTS_10e8_plus,	/* 10ms and plus*/
+	COUNTS_MIN,
+	COUNTS_MAX,
+	COUNTS_SUM,
+	COUNTS_NUM
+};
+
+struct iommu_latency_statistic {
+	bool enabled;
+	u64 counter[COUNTS_NUM];
+	u64 samples;
+};
+
+struct iommu_latency {
+	/* Taken with IRQs off or under drivers' raw spinlocks */
+	raw_spinlock_t lock;
+	struct iommu_latency_statistic stat[IOMMU_LATENCY_NUM];
+};
+
+/* Serializes allocating the statistics and creating the debugfs files */
+static DEFINE_MUTEX(iommu_latency_mutex);
+static struct dentry *iommu_latency_dir;
+
+static const char * const latency_counter_names[] = {
+	"                  <0.1us",
+	"   0.1us-1us", "    1us-10us", "  10us-100us",
+	"   100us-1ms", "    1ms-10ms", "      >=10ms",
+	"     min(us)", "     max(us)", " average(us)"
+};
+
+static const char * const latency_type_names[] = {
+	[IOMMU_LATENCY_INV_IOTLB]	= "inv_iotlb",
+	[IOMMU_LATENCY_INV_DEVTLB]	= "inv_devtlb",
+	[IOMMU_LATENCY_INV_IEC]		= "inv_iec",
+	[IOMMU_LATENCY_PRQ]		= "svm_prq",
+	[IOMMU_LATENCY_CMD_QUEUE]	= "cmd_queue",
+	[IOMMU_LATENCY_CMD_SYNC]	= "cmd_sync",
+};
+
+bool iommu_latency_enabled(struct iommu_device *iommu,
+			   enum iommu_latency_type type)
+{
+	struct iommu_latency *lat = READ_ONCE(iommu->latency);
+
+	return lat && READ_ONCE(lat->stat[type].enabled);
+}
+EXPORT_SYMBOL_GPL(iommu_latency_enabled);
+
+/**
+ * iommu_latency_enable - Start collecting latency statistics
+ * @iommu: IOMMU to collect for
+ * @type: kind of command to collect for
+ *
+ * Must be called from process context. Returns 0 on success or if @type is
+ * already enabled.
+ */
+int iommu_latency_enable(struct iommu_device *iommu,
+			 enum iommu_latency_type type)
+{
+	struct iommu_latency *lat;
+	unsigned long flags;
+
+	mutex_lock(&iommu_latency_mutex);
+	lat = iommu->latency;
+	if (!lat) {
+		lat = kzalloc(sizeof(*lat), GFP_KERNEL);
+		if (!lat) {
+			mutex_unlock(&iommu_latency_mutex);
+			return -ENOMEM;
+		}
+		raw_spin_lock_init(&lat->lock);
+		/* Publish the initialized lock to the update path */
+		smp_store_release(&iommu->latency, lat);
+	}
+
+	raw_spin_lock_irqsave(&lat->lock, flags);
+	if (!lat->stat[type].enabled) {
+		memset(&lat->stat[type], 0, sizeof(lat->stat[type]));
+		lat->stat[type].counter[COUNTS_MIN] = U64_MAX;
+		WRITE_ONCE(lat->stat[type].enabled, true);
+	}
+	raw_spin_unlock_irqrestore(&lat->lock, flags);
+	mutex_unlock(&iommu_latency_mutex);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(iommu_latency_enable);
+
+/**
+ * iommu_latency_disable - Stop collecting latency statistics
+ * @iommu: IOMMU to stop collecting for
+ * @type: kind of command
+ *
+ * The statistics collected so far are dropped.
+ */
+void iommu_latency_disable(struct iommu_device *iommu,
+			   enum iommu_latency_type type)
+{
+	struct iommu_latency *lat = iommu->latency;
+	unsigned long flags;
+
+	if (!lat)
+		return;
+
+	raw_spin_lock_irqsave(&lat->lock, flags);
+	WRITE_ONCE(lat->stat[type].enabled, false);
+	raw_spin_unlock_irqrestore(&lat->lock, flags);
+}
+EXPORT_SYMBOL_GPL(iommu_latency_disable);
+
+/**
+ * iommu_latency_update - Account the latency of one command
+ * @iommu: IOMMU that executed the command
+ * @type: kind of command
+ * @latency: time to completion in nanoseconds
+ *
+ * Callable from any context, does nothing unless @type is enabled. See also
+ * iommu_latency_start() and iommu_latency_end().
+ */
+void iommu_latency_update(struct iommu_device *iommu,
+			  enum iommu_latency_type type, u64 latency)
+{
+	struct iommu_latency *lat = smp_load_acquire(&iommu->latency);
+	struct iommu_latency_statistic *lstat;
+	unsigned long flags;
+
+	if (!lat)
+		return;
+	lstat = &lat->stat[type];
+
+	raw_spin_lock_irqsave(&lat->lock, flags);
+	if (!lstat->enabled)
+		goto out_unlock;
+
+	if (latency < 100)
+		lstat->counter[COUNTS_10e2]++;
+	else if (latency < 1000)
+		lstat->counter[COUNTS_10e3]++;
+	else if (latency < 10000)
+		lstat->counter[COUNTS_10e4]++;
+	else if (latency < 100000)
+		lstat->counter[COUNTS_10e5]++;
+	else if (latency < 1000000)
+		lstat->counter[COUNTS_10e6]++;
+	else if (latency < 10000000)
+		lstat->counter[COUNTS_10e7]++;
+	else
+		lstat->counter[COUNTS_10e8_plus]++;
+
+	lstat->counter[COUNTS_MIN] = min(lstat->counter[COUNTS_MIN], latency);
+	lstat->counter[COUNTS_MAX] = max(lstat->counter[COUNTS_MAX], latency);
+	lstat->counter[COUNTS_SUM] += latency;
+	lstat->samples++;
+out_unlock:
+	raw_spin_unlock_irqrestore(&lat->lock, flags);
+}
+EXPORT_SYMBOL_GPL(iommu_latency_update);
+
+/**
+ * iommu_latency_snapshot - Format the enabled statistics as a table
+ * @iommu: IOMMU to report on
+ * @str: output buffer
+ * @size: size of @str
+ *
+ * Returns the number of characters written.
+ */
+int iommu_latency_snapshot(struct iommu_device *iommu, char *str, size_t size)
+{
+	struct iommu_latency *lat = smp_load_acquire(&iommu->latency);
+	unsigned long flags;
+	int bytes = 0, i, j;
+
+	memset(str, 0, size);
+
+	for (i = 0; i < COUNTS_NUM; i++)
+		bytes += scnprintf(str + bytes, size - bytes,
+				   "%s", latency_counter_names[i]);
+	if (!lat)
+		return bytes;
+
+	for (i = 0; i < IOMMU_LATENCY_NUM; i++) {
+		struct iommu_latency_statistic lstat;
+
+		/* Format a copy, the raw lock is only held to read it */
+		raw_spin_lock_irqsave(&lat->lock, flags);
+		lstat = lat->stat[i];
+		raw_spin_unlock_irqrestore(&lat->lock, flags);
+
+		if (!lstat.enabled)
+			continue;
+
+		bytes += scnprintf(str + bytes, size - bytes,
+				   "\n%12s", latency_type_names[i]);
+
+		for (j = 0; j < COUNTS_NUM; j++) {
+			u64 val = lstat.counter[j];
+
+			switch (j) {
+			case COUNTS_MIN:
+				if (val == U64_MAX)
+					val = 0;
+				else
+					val = div_u64(val, 1000);
+				break;
+			case COUNTS_MAX:
+				val = div_u64(val, 1000);
+				break;
+			case COUNTS_SUM:
+				if (lstat.samples)
+					val = div64_u64(val,
+							lstat.samples * 1000);
+				else
+					val = 0;
+				break;
+			default:
+				break;
+			}
+
+			bytes += scnprintf(str + bytes, size - bytes,
+					   "%12lld", val);
+		}
+	}
+
+	return bytes;
+}
+EXPORT_SYMBOL_GPL(iommu_latency_snapshot);
+
+#define LATENCY_BUF_SIZE	1024
+
+static int iommu_latency_show(struct seq_file *m, void *v)
+{
+	struct iommu_device *iommu = m->private;
+	char *buf;
+
+	buf = kmalloc(LATENCY_BUF_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	iommu_latency_snapshot(iommu, buf, LATENCY_BUF_SIZE);
+	seq_puts(m, buf);
+	seq_putc(m, '\n');
+	kfree(buf);
+	return 0;
+}
+
+static int iommu_latency_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, iommu_latency_show, inode->i_private);
+}
+
+/*
+ * Writing the name of a command type enables it, "all" enables every type and
+ * "none" disables all of them and drops the statistics.
+ */
+static ssize_t iommu_latency_write(struct file *filp, const char __user *ubuf,
+				   size_t cnt, loff_t *ppos)
+{
+	struct iommu_device *iommu = file_inode(filp)->i_private;
+	bool enable, all;
+	char buf[16];
+	int i, ret;
+
+	if (cnt >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, cnt))
+		return -EFAULT;
+	buf[cnt] = 0;
+
+	all = sysfs_streq(buf, "all") || sysfs_streq(buf, "none");
+	enable = !sysfs_streq(buf, "none");
+
+	for (i = 0; i < IOMMU_LATENCY_NUM; i++) {
+		if (!all && !sysfs_streq(buf, latency_type_names[i]))
+			continue;
+		if (!enable) {
+			iommu_latency_disable(iommu, i);
+			continue;
+		}
+		ret = iommu_latency_enable(iommu, i);
+		if (ret)
+			return ret;
+		if (!all)
+			break;
+	}
+	if (!all && i == IOMMU_LATENCY_NUM)
+		return -EINVAL;
+
+	*ppos += cnt;
+	return cnt;
+}
+
+static const struct file_operations iommu_latency_fops = {
+	.open		= iommu_latency_open,
+	.write		= iommu_latency_write,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Every registered IOMMU gets a /sys/kernel/debug/iommu/latency/<name> file,
+ * named after its sysfs device.
+ */
+void iommu_latency_add(struct iommu_device *iommu)
+{
+	if (!iommu_debugfs_dir || !iommu->dev)
+		return;
+
+	mutex_lock(&iommu_latency_mutex);
+	if (!iommu_latency_dir)
+		iommu_latency_dir = debugfs_create_dir("latency",
+						       iommu_debugfs_dir);
+	debugfs_create_file(dev_name(iommu->dev), 0644, iommu_latency_dir,
+			    iommu, &iommu_latency_fops);
+	mutex_unlock(&iommu_latency_mutex);
+}
+
+void iommu_latency_remove(struct iommu_device *iommu)
+{
+	mutex_lock(&iommu_latency_mutex);
+	if (iommu_latency_dir && iommu->dev)
+		debugfs_lookup_and_remove(dev_name(iommu->dev),
+					  iommu_latency_dir);
+	kfree(iommu->latency);
+	iommu->latency = NULL;
+	mutex_unlock(&iommu_latency_mutex);
+}
+#endif /* CONFIG_IOMMU_LATENCY */
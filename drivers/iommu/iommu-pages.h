@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Helpers for allocating IOMMU page table memory
+ *
+ * Every page is accounted to the node's NR_IOMMU_PAGES, to the secondary page
+ * table statistics of the memory cgroup it was charged to when allocated with
+ * __GFP_ACCOUNT, and to the domain it belongs to, if any. Tables that are not
+ * owned by a domain, like context or PASID tables, pass a NULL domain.
+ */
+#ifndef __IOMMU_PAGES_H
+#define __IOMMU_PAGES_H
+
+#include <linux/iommu.h>
+#include <linux/mm.h>
+#include <linux/vmstat.h>
+
+static inline void iommu_pages_account(struct iommu_domain *domain,
+				       struct page *page, long nr)
+{
+	mod_node_page_state(page_pgdat(page), NR_IOMMU_PAGES, nr);
+	mod_lruvec_page_state(page, NR_SECONDARY_PAGETABLE, nr);
+	if (domain)
+		atomic_long_add(nr, &domain->pgtable_pages);
+}
+
+/**
+ * iommu_alloc_pages_node - Allocate zeroed page table memory
+ * @domain: domain the memory is accounted to, or NULL
+ * @nid: memory NUMA node id
+ * @gfp: allocation flags, __GFP_ACCOUNT charges the current memory cgroup
+ * @order: log2 of the number of pages
+ *
+ * Returns the virtual address of the pages or NULL.
+ */
+static inline void *iommu_alloc_pages_node(struct iommu_domain *domain,
+					   int nid, gfp_t gfp,
+					   unsigned int order)
+{
+	struct page *page;
+
+	page = alloc_pages_node(nid, gfp | __GFP_ZERO, order);
+	if (unlikely(!page))
+		return NULL;
+
+	iommu_pages_account(domain, page, 1L << order);
+	iommu_perf_count(NULL, IOMMU_PERF_PGTABLE_PAGES, 1UL << order, 0);
+	return page_address(page);
+}
+
+/**
+ * iommu_free_pages - Free memory from iommu_alloc_pages_node()
+ * @domain: domain the memory was accounted to
+ * @virt: virtual address of the pages, may be NULL
+ * @order: order the pages were allocated with
+ */
+static inline void iommu_free_pages(struct iommu_domain *domain, void *virt,
+				    unsigned int order)
+{
+	struct page *page;
+
+	if (!virt)
+		return;
+
+	page = virt_to_page(virt);
+	iommu_pages_account(domain, page, -(1L << order));
+	__free_pages(page, order);
+}
+
+/**
+ * iommu_put_pages_list - Free a list of single page table pages
+ * @domain: domain the pages were accounted to
+ * @list: pages linked through page->lru, emptied on return
+ *
+ * For freeing tables that were unlinked under a lock and could only be
+ * released after the IOTLB was flushed.
+ */
+static inline void iommu_put_pages_list(struct iommu_domain *domain,
+					struct list_head *list)
+{
+	struct page *page;
+
+	list_for_each_entry(page, list, lru)
+		iommu_pages_account(domain, page, -1);
+	put_pages_list(list);
+}
+
+#endif /* __IOMMU_PAGES_H */
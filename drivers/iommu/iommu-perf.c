@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * IOMMU software performance counters
+ *
+ * Exposes the work the IOMMU core does on behalf of its users as events of a
+ * software perf PMU named "iommu", for instance:
+ *
+ *   perf stat -a -e iommu/map_bytes/,iommu/iotlb_sync/
+ *   perf stat -e iommu/map_pages,pgsize_shift=21/ -- <cmd>
+ *   perf record -e iommu/unmap,group_en=1,group=12/ -c 100 -g -a
+ *
+ * Events count in the context of the task or CPU doing the map, unmap or
+ * invalidation, like the generic software events. They can be restricted to
+ * an iommu group (see /sys/kernel/iommu_groups), and then count the work done
+ * on whichever domain the group is attached to at that moment. Page table
+ * allocations and interrupt remapping entry updates are not attributed to a
+ * domain and are only counted by unfiltered events.
+ *
+ * When no event exists all counting sites are patched out with a static key.
+ */
+#define pr_fmt(fmt)	"iommu: " fmt
+
+#include <linux/iommu.h>
+#include <linux/perf_event.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
+
+#include "iommu-priv.h"
+
+DEFINE_STATIC_KEY_FALSE(iommu_perf_enabled);
+EXPORT_SYMBOL_GPL(iommu_perf_enabled);
+
+/* Events currently scheduled on each CPU */
+static DEFINE_PER_CPU(struct hlist_head, iommu_perf_events);
+
+PMU_FORMAT_ATTR(event,		"config:0-7");
+PMU_FORMAT_ATTR(group,		"config1:0-31");
+PMU_FORMAT_ATTR(group_en,	"config1:32");
+PMU_FORMAT_ATTR(pgsize_shift,	"config2:0-5");
+
+#define iommu_perf_group(event)		((int)lower_32_bits((event)->attr.config1))
+#define iommu_perf_group_en(event)	((event)->attr.config1 & BIT_ULL(32))
+#define iommu_perf_pgsize(event)	((event)->attr.config2 ? \
+					 1UL << (event)->attr.config2 : 0)
+
+static struct attribute *iommu_perf_format_attrs[] = {
+	&format_attr_event.attr,
+	&format_attr_group.attr,
+	&format_attr_group_en.attr,
+	&format_attr_pgsize_shift.attr,
+	NULL
+};
+
+static struct attribute_group iommu_perf_format_attr_group = {
+	.name = "format",
+	.attrs = iommu_perf_format_attrs,
+};
+
+/* The event codes are the values of enum iommu_perf_counter */
+#define IOMMU_PERF_EVENT_ATTR(_name, _counter)				\
+	PMU_EVENT_ATTR_STRING(_name, event_attr_##_name,		\
+			      "event=" __stringify(_counter))
+
+IOMMU_PERF_EVENT_ATTR(map,		0);
+IOMMU_PERF_EVENT_ATTR(map_bytes,	1);
+IOMMU_PERF_EVENT_ATTR(map_pages,	2);
+IOMMU_PERF_EVENT_ATTR(unmap,		3);
+IOMMU_PERF_EVENT_ATTR(unmap_bytes,	4);
+IOMMU_PERF_EVENT_ATTR(iotlb_sync,	5);
+IOMMU_PERF_EVENT_ATTR(flush_iotlb_all,	6);
+IOMMU_PERF_EVENT_ATTR(pgtable_pages,	7);
+IOMMU_PERF_EVENT_ATTR(irte_write,	8);
+IOMMU_PERF_EVENT_ATTR(irte_flush,	9);
+
+static struct attribute *iommu_perf_events_attrs[] = {
+	&event_attr_map.attr.attr,
+	&event_attr_map_bytes.attr.attr,
+	&event_attr_map_pages.attr.attr,
+	&event_attr_unmap.attr.attr,
+	&event_attr_unmap_bytes.attr.attr,
+	&event_attr_iotlb_sync.attr.attr,
+	&event_attr_flush_iotlb_all.attr.attr,
+	&event_attr_pgtable_pages.attr.attr,
+	&event_attr_irte_write.attr.attr,
+	&event_attr_irte_flush.attr.attr,
+	NULL
+};
+
+static struct attribute_group iommu_perf_events_attr_group = {
+	.name = "events",
+	.attrs = iommu_perf_events_attrs,
+};
+
+static const struct attribute_group *iommu_perf_attr_groups[] = {
+	&iommu_perf_format_attr_group,
+	&iommu_perf_events_attr_group,
+	NULL
+};
+
+static noinline void iommu_perf_overflow(struct perf_event *event, u64 val)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	struct perf_sample_data data;
+	struct pt_regs regs = {};
+
+	if (local64_sub_return(val, &hwc->period_left) > 0)
+		return;
+	local64_set(&hwc->period_left, hwc->sample_period);
+
+	perf_fetch_caller_regs(&regs);
+	perf_sample_data_init(&data, 0, hwc->last_period);
+	/* Throttled, perf will start the event again on unthrottle */
+	if (perf_event_overflow(event, &data, &regs))
+		hwc->state = PERF_HES_STOPPED;
+}
+
+void __iommu_perf_count(struct iommu_domain *domain,
+			enum iommu_perf_counter counter, u64 val,
+			size_t pgsize)
+{
+	struct perf_event *event;
+
+	if (!val)
+		return;
+
+	rcu_read_lock();
+	preempt_disable_notrace();
+	hlist_for_each_entry_rcu(event, this_cpu_ptr(&iommu_perf_events),
+				 hlist_entry) {
+		if (event->attr.config != counter ||
+		    (event->hw.state & PERF_HES_STOPPED))
+			continue;
+		if (event->pmu_private &&
+		    (!domain || !iommu_group_domain_is(event->pmu_private,
+							domain)))
+			continue;
+		if (counter == IOMMU_PERF_MAP_PAGES && event->attr.config2 &&
+		    iommu_perf_pgsize(event) != pgsize)
+			continue;
+
+		local64_add(val, &event->count);
+		if (is_sampling_event(event))
+			iommu_perf_overflow(event, val);
+	}
+	preempt_enable_notrace();
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL_GPL(__iommu_perf_count);
+
+static void iommu_perf_event_destroy(struct perf_event *event)
+{
+	iommu_group_put(event->pmu_private);
+	static_branch_dec(&iommu_perf_enabled);
+}
+
+static int iommu_perf_event_init(struct perf_event *event)
+{
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	if (event->attr.config >= IOMMU_PERF_NR_COUNTERS)
+		return -EINVAL;
+
+	if (event->attr.config2 >= BITS_PER_LONG)
+		return -EINVAL;
+
+	/* The counters are exact, there is no rate to adjust a period to */
+	if (event->attr.freq)
+		return -EINVAL;
+
+	if (has_branch_stack(event))
+		return -EOPNOTSUPP;
+
+	if (iommu_perf_group_en(event)) {
+		event->pmu_private =
+			iommu_group_get_by_id(iommu_perf_group(event));
+		if (!event->pmu_private)
+			return -ENODEV;
+	}
+
+	static_branch_inc(&iommu_perf_enabled);
+	event->destroy = iommu_perf_event_destroy;
+	return 0;
+}
+
+static void iommu_perf_start(struct perf_event *event, int flags)
+{
+	event->hw.state = 0;
+}
+
+static void iommu_perf_stop(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED;
+}
+
+static int iommu_perf_add(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (is_sampling_event(event)) {
+		hwc->last_period = hwc->sample_period;
+		local64_set(&hwc->period_left, hwc->sample_period);
+	}
+	hwc->state = (flags & PERF_EF_START) ? 0 : PERF_HES_STOPPED;
+	hlist_add_head_rcu(&event->hlist_entry,
+			   this_cpu_ptr(&iommu_perf_events));
+	return 0;
+}
+
+static void iommu_perf_del(struct perf_event *event, int flags)
+{
+	hlist_del_rcu(&event->hlist_entry);
+}
+
+/* event->count is updated directly by __iommu_perf_count() */
+static void iommu_perf_read(struct perf_event *event)
+{
+}
+
+static struct pmu iommu_perf_pmu = {
+	.task_ctx_nr	= perf_sw_context,
+	.attr_groups	= iommu_perf_attr_groups,
+	.capabilities	= PERF_PMU_CAP_NO_EXCLUDE,
+	.event_init	= iommu_perf_event_init,
+	.add		= iommu_perf_add,
+	.del		= iommu_perf_del,
+	.start		= iommu_perf_start,
+	.stop		= iommu_perf_stop,
+	.read		= iommu_perf_read,
+};
+
+static int __init iommu_perf_init(void)
+{
+	int ret;
+
+	ret = perf_pmu_register(&iommu_perf_pmu, "iommu", -1);
+	if (ret)
+		pr_err("Failed to register the perf PMU: %d\n", ret);
+	return ret;
+}
+device_initcall(iommu_perf_init);
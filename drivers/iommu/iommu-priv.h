@@ -17,6 +17,9 @@ static inline const struct iommu_ops *dev_iommu_ops(struct device *dev)
 	return dev->iommu->iommu_dev->ops;
 }
 
+struct iommu_group *iommu_group_get_by_id(int id);
+bool iommu_group_domain_is(struct iommu_group *group,
+			   struct iommu_domain *domain);
 int iommu_group_replace_domain(struct iommu_group *group,
 			       struct iommu_domain *new_domain);
 int iommu_replace_device_pasid(struct iommu_domain *domain,
@@ -29,4 +32,17 @@ void iommu_device_unregister_bus(struct iommu_device *iommu,
 				 struct bus_type *bus,
 				 struct notifier_block *nb);
 
+#ifdef CONFIG_IOMMU_LATENCY
+void iommu_latency_add(struct iommu_device *iommu);
+void iommu_latency_remove(struct iommu_device *iommu);
+#else
+static inline void iommu_latency_add(struct iommu_device *iommu)
+{
+}
+
+static inline void iommu_latency_remove(struct iommu_device *iommu)
+{
+}
+#endif
+
 #endif /* __LINUX_IOMMU_PRIV_H */
@@ -7,6 +7,7 @@
 #define pr_fmt(fmt)    "iommu: " fmt
 
 #include <linux/amba/bus.h>
+#include <linux/async.h>
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/bits.h>
@@ -46,6 +47,7 @@ static DEFINE_IDA(iommu_global_pasid_ida);
 static unsigned int iommu_def_domain_type __read_mostly;
 static bool iommu_dma_strict __read_mostly = IS_ENABLED(CONFIG_IOMMU_DEFAULT_DMA_STRICT);
 static u32 iommu_cmd_line __read_mostly;
+static bool iommu_async_probe __read_mostly = true;
 
 struct iommu_group {
 	struct kobject kobj;
@@ -271,6 +273,7 @@ int iommu_device_register(struct iommu_device *iommu,
 	spin_lock(&iommu_device_lock);
 	list_add_tail(&iommu->list, &iommu_device_list);
 	spin_unlock(&iommu_device_lock);
+	iommu_latency_add(iommu);
 
 	for (int i = 0; i < ARRAY_SIZE(iommu_buses) && !err; i++) {
 		iommu_buses[i]->iommu_ops = ops;
@@ -290,6 +293,7 @@ void iommu_device_unregister(struct iommu_device *iommu)
 	spin_lock(&iommu_device_lock);
 	list_del(&iommu->list);
 	spin_unlock(&iommu_device_lock);
+	iommu_latency_remove(iommu);
 }
 EXPORT_SYMBOL_GPL(iommu_device_unregister);
 
@@ -470,7 +474,7 @@ static void iommu_deinit_device(struct device *dev)
 			iommu_domain_free(group->blocking_domain);
 			group->blocking_domain = NULL;
 		}
-		group->domain = NULL;
+		WRITE_ONCE(group->domain, NULL);
 	}
 
 	/* Caller must put iommu_group */
@@ -479,24 +483,44 @@ static void iommu_deinit_device(struct device *dev)
 	dev_iommu_free(dev);
 }
 
+/*
+ * Serialise to avoid races between IOMMU drivers registering in parallel
+ * and/or the "replay" calls from ACPI/OF code via client driver probe. Once
+ * the latter have been cleaned up we should probably be able to use
+ * device_lock() here to minimise the scope, but for now enforcing a simple
+ * global ordering is fine.
+ */
+static DEFINE_MUTEX(iommu_probe_device_lock);
+
+/* The batch of the PF a VF is being created for, see iommu_probe_batch_begin() */
+static struct list_head *iommu_probe_batch_list(struct device *dev)
+{
+	struct pci_dev *physfn;
+
+	lockdep_assert_held(&iommu_probe_device_lock);
+
+	if (!dev_is_pci(dev) || !to_pci_dev(dev)->is_virtfn)
+		return NULL;
+
+	physfn = pci_physfn(to_pci_dev(dev));
+	if (!physfn->dev.iommu)
+		return NULL;
+	return physfn->dev.iommu->probe_batch;
+}
+
 static int __iommu_probe_device(struct device *dev, struct list_head *group_list)
 {
 	const struct iommu_ops *ops = dev->bus->iommu_ops;
 	struct iommu_group *group;
-	static DEFINE_MUTEX(iommu_probe_device_lock);
 	struct group_device *gdev;
 	int ret;
 
 	if (!ops)
 		return -ENODEV;
-	/*
-	 * Serialise to avoid races between IOMMU drivers registering in
-	 * parallel and/or the "replay" calls from ACPI/OF code via client
-	 * driver probe. Once the latter have been cleaned up we should
-	 * probably be able to use device_lock() here to minimise the scope,
-	 * but for now enforcing a simple global ordering is fine.
-	 */
+
 	mutex_lock(&iommu_probe_device_lock);
+	if (!group_list)
+		group_list = iommu_probe_batch_list(dev);
 
 	/* Device is probed already if in a group */
 	if (dev->iommu_group) {
@@ -540,6 +564,7 @@ static int __iommu_probe_device(struct device *dev, struct list_head *group_list
 		 */
 		if (list_empty(&group->entry))
 			list_add_tail(&group->entry, group_list);
+		dev->iommu->attach_batched = 1;
 	}
 	mutex_unlock(&group->mutex);
 	mutex_unlock(&iommu_probe_device_lock);
@@ -571,6 +596,10 @@ int iommu_probe_device(struct device *dev)
 	if (ret)
 		return ret;
 
+	/* Finalized by iommu_probe_batch_end() once the group is set up */
+	if (dev->iommu->attach_batched)
+		return 0;
+
 	ops = dev_iommu_ops(dev);
 	if (ops->probe_finalize)
 		ops->probe_finalize(dev);
@@ -614,6 +643,13 @@ static void __iommu_group_remove_device(struct device *dev)
 
 		list_del(&device->list);
 		__iommu_group_free_device(group, device);
+		/*
+		 * A VF failing to be created while the IOMMU probe of its
+		 * siblings is batched is removed by the thread that owns the
+		 * batch, drop the group from the batch before it goes away.
+		 */
+		if (list_empty(&group->devices))
+			list_del_init(&group->entry);
 		if (dev->iommu && dev->iommu->iommu_dev)
 			iommu_deinit_device(dev);
 		else
@@ -669,6 +705,12 @@ static int __init iommu_dma_setup(char *str)
 }
 early_param("iommu.strict", iommu_dma_setup);
 
+static int __init iommu_async_probe_setup(char *str)
+{
+	return kstrtobool(str, &iommu_async_probe);
+}
+early_param("iommu.async_probe", iommu_async_probe_setup);
+
 void iommu_set_dma_strict(void)
 {
 	iommu_dma_strict = true;
@@ -880,6 +922,20 @@ static ssize_t iommu_group_show_type(struct iommu_group *group,
 	return sysfs_emit(buf, "%s\n", type);
 }
 
+/* Size of the page tables of the domain the group is currently attached to */
+static ssize_t iommu_group_show_pgtable_pages(struct iommu_group *group,
+					      char *buf)
+{
+	long pages = 0;
+
+	mutex_lock(&group->mutex);
+	if (group->domain)
+		pages = atomic_long_read(&group->domain->pgtable_pages);
+	mutex_unlock(&group->mutex);
+
+	return sysfs_emit(buf, "%ld\n", pages);
+}
+
 static IOMMU_GROUP_ATTR(name, S_IRUGO, iommu_group_show_name, NULL);
 
 static IOMMU_GROUP_ATTR(reserved_regions, 0444,
@@ -888,6 +944,9 @@ static IOMMU_GROUP_ATTR(reserved_regions, 0444,
 static IOMMU_GROUP_ATTR(type, 0644, iommu_group_show_type,
 			iommu_group_store_type);
 
+static IOMMU_GROUP_ATTR(pgtable_pages, 0444, iommu_group_show_pgtable_pages,
+			NULL);
+
 static void iommu_group_release(struct kobject *kobj)
 {
 	struct iommu_group *group = to_iommu_group(kobj);
@@ -978,6 +1037,12 @@ struct iommu_group *iommu_group_alloc(void)
 		return ERR_PTR(ret);
 	}
 
+	ret = iommu_group_create_file(group, &iommu_group_attr_pgtable_pages);
+	if (ret) {
+		kobject_put(group->devices_kobj);
+		return ERR_PTR(ret);
+	}
+
 	pr_debug("Allocated group %d\n", group->id);
 
 	return group;
@@ -1517,6 +1582,45 @@ int iommu_group_id(struct iommu_group *group)
 }
 EXPORT_SYMBOL_GPL(iommu_group_id);
 
+/**
+ * iommu_group_get_by_id - Find a group by its sysfs group number
+ * @id: sysfs group number
+ *
+ * Return the group with a reference held, to be released with
+ * iommu_group_put(), or NULL if there is no such group.
+ */
+struct iommu_group *iommu_group_get_by_id(int id)
+{
+	struct iommu_group *group;
+	struct kobject *kobj;
+	char name[12];
+
+	snprintf(name, sizeof(name), "%d", id);
+	kobj = kset_find_obj(iommu_group_kset, name);
+	if (!kobj)
+		return NULL;
+	group = container_of(kobj, struct iommu_group, kobj);
+	kobject_get(group->devices_kobj);
+	kobject_put(kobj);
+	return group;
+}
+
+/**
+ * iommu_group_domain_is - Check the domain currently attached to a group
+ * @group: the group to check
+ * @domain: a domain the caller holds, e.g. one it is mapping through
+ *
+ * Lockless, for filtering events in any context. The answer may be stale by
+ * the time it is used if the group changes domain concurrently, but a domain
+ * only matches while it is attached, so a freed and reallocated domain is
+ * never mistaken for the group's.
+ */
+bool iommu_group_domain_is(struct iommu_group *group,
+			   struct iommu_domain *domain)
+{
+	return READ_ONCE(group->domain) == domain;
+}
+
 static struct iommu_group *get_pci_alias_group(struct pci_dev *pdev,
 					       unsigned long *devfns);
 
@@ -1851,9 +1955,144 @@ static void iommu_group_do_probe_finalize(struct device *dev)
 		ops->probe_finalize(dev);
 }
 
-int bus_iommu_probe(const struct bus_type *bus)
+struct iommu_group_setup {
+	struct iommu_group *group;
+	int ret;
+};
+
+static void iommu_group_setup_default_domain(struct iommu_group_setup *setup)
+{
+	struct iommu_group *group = setup->group;
+
+	mutex_lock(&group->mutex);
+	/*
+	 * We go to the trouble of deferred default domain creation so that the
+	 * cross-group default domain type and the setup of the
+	 * IOMMU_RESV_DIRECT will work correctly in non-hotpug scenarios.
+	 */
+	setup->ret = iommu_setup_default_domain(group, 0);
+	mutex_unlock(&group->mutex);
+}
+
+static void iommu_group_setup_async(void *data, async_cookie_t cookie)
+{
+	iommu_group_setup_default_domain(data);
+}
+
+/*
+ * Complete the cache invalidations the drivers left pending while attaching
+ * the devices of @group, once per IOMMU instance as long as consecutive
+ * devices sit behind the same one.
+ */
+static void iommu_group_sync_batched_attach(struct iommu_group *group,
+					    struct iommu_device **last_iommu)
 {
+	struct group_device *gdev;
+
+	mutex_lock(&group->mutex);
+	for_each_group_device(group, gdev) {
+		const struct iommu_ops *ops = dev_iommu_ops(gdev->dev);
+		struct dev_iommu *param = gdev->dev->iommu;
+
+		if (!param->attach_batched)
+			continue;
+		param->attach_batched = 0;
+
+		if (ops->sync_batched_attach && param->iommu_dev != *last_iommu) {
+			ops->sync_batched_attach(gdev->dev);
+			*last_iommu = param->iommu_dev;
+		}
+	}
+	mutex_unlock(&group->mutex);
+}
+
+static void iommu_group_probe_finalize(struct iommu_group *group)
+{
+	struct group_device *gdev;
+
+	/*
+	 * FIXME: Mis-locked because the ops->probe_finalize() call-back
+	 * of some IOMMU drivers calls arm_iommu_attach_device() which
+	 * in-turn might call back into IOMMU core code, where it tries
+	 * to take group->mutex, resulting in a deadlock.
+	 */
+	for_each_group_device(group, gdev)
+		iommu_group_do_probe_finalize(gdev->dev);
+}
+
+/*
+ * Set up the default domains of the groups that __iommu_probe_device() left on
+ * @group_list, then finalize their devices. The groups are independent of each
+ * other once every device has been placed in one, so allocating their default
+ * domains and installing the direct mappings can run concurrently. Errors and
+ * probe_finalize() are still processed in list order.
+ */
+static int iommu_setup_group_list(struct list_head *group_list)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(setup_domain);
+	struct iommu_device *last_iommu = NULL;
+	struct iommu_group_setup *setups;
 	struct iommu_group *group, *next;
+	unsigned int i, nr_groups = 0;
+	int ret = 0;
+
+	list_for_each_entry(group, group_list, entry)
+		nr_groups++;
+	if (!nr_groups)
+		return 0;
+
+	setups = kcalloc(nr_groups, sizeof(*setups), GFP_KERNEL);
+	if (!setups) {
+		/* Fall back to setting up and finalizing one group at a time */
+		list_for_each_entry_safe(group, next, group_list, entry) {
+			struct iommu_group_setup setup = { .group = group };
+
+			list_del_init(&group->entry);
+			iommu_group_setup_default_domain(&setup);
+			last_iommu = NULL;
+			iommu_group_sync_batched_attach(group, &last_iommu);
+			if (setup.ret) {
+				if (!ret)
+					ret = setup.ret;
+				continue;
+			}
+			iommu_group_probe_finalize(group);
+		}
+		return ret;
+	}
+
+	i = 0;
+	list_for_each_entry_safe(group, next, group_list, entry) {
+		/* Remove item from the list */
+		list_del_init(&group->entry);
+		setups[i].group = group;
+		if (iommu_async_probe && nr_groups > 1)
+			async_schedule_domain(iommu_group_setup_async, &setups[i],
+					      &setup_domain);
+		else
+			iommu_group_setup_default_domain(&setups[i]);
+		i++;
+	}
+	async_synchronize_full_domain(&setup_domain);
+
+	for (i = 0; i < nr_groups; i++)
+		iommu_group_sync_batched_attach(setups[i].group, &last_iommu);
+
+	for (i = 0; i < nr_groups; i++) {
+		if (setups[i].ret) {
+			if (!ret)
+				ret = setups[i].ret;
+			continue;
+		}
+		iommu_group_probe_finalize(setups[i].group);
+	}
+
+	kfree(setups);
+	return ret;
+}
+
+int bus_iommu_probe(const struct bus_type *bus)
+{
 	LIST_HEAD(group_list);
 	int ret;
 
@@ -1861,38 +2100,69 @@ int bus_iommu_probe(const struct bus_type *bus)
 	if (ret)
 		return ret;
 
-	list_for_each_entry_safe(group, next, &group_list, entry) {
-		struct group_device *gdev;
+	return iommu_setup_group_list(&group_list);
+}
 
-		mutex_lock(&group->mutex);
+/**
+ * iommu_probe_batch_begin() - Start batching the IOMMU probe of new VFs
+ * @dev: the PF whose VFs are about to be created
+ *
+ * Until iommu_probe_batch_end(), VFs of @dev that land in a new iommu_group are
+ * only added to their group. Their default domains are then set up together,
+ * and the drivers get to complete the context or device table cache
+ * invalidations of all the attaches at once. The VFs must not be bound to a
+ * driver before the batch ends. Does nothing if @dev is not behind an IOMMU.
+ *
+ * The caller serialises against other batches on @dev, in practice by holding
+ * the device lock of the PF while enabling SR-IOV.
+ */
+void iommu_probe_batch_begin(struct device *dev)
+{
+	struct list_head *batch;
 
-		/* Remove item from the list */
-		list_del_init(&group->entry);
+	if (!dev->iommu || !dev->iommu_group)
+		return;
 
-		/*
-		 * We go to the trouble of deferred default domain creation so
-		 * that the cross-group default domain type and the setup of the
-		 * IOMMU_RESV_DIRECT will work correctly in non-hotpug scenarios.
-		 */
-		ret = iommu_setup_default_domain(group, 0);
-		if (ret) {
-			mutex_unlock(&group->mutex);
-			return ret;
-		}
-		mutex_unlock(&group->mutex);
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return;
+	INIT_LIST_HEAD(batch);
 
-		/*
-		 * FIXME: Mis-locked because the ops->probe_finalize() call-back
-		 * of some IOMMU drivers calls arm_iommu_attach_device() which
-		 * in-turn might call back into IOMMU core code, where it tries
-		 * to take group->mutex, resulting in a deadlock.
-		 */
-		for_each_group_device(group, gdev)
-			iommu_group_do_probe_finalize(gdev->dev);
-	}
+	mutex_lock(&iommu_probe_device_lock);
+	WARN_ON(dev->iommu->probe_batch);
+	dev->iommu->probe_batch = batch;
+	mutex_unlock(&iommu_probe_device_lock);
+}
+EXPORT_SYMBOL_GPL(iommu_probe_batch_begin);
 
-	return 0;
+/**
+ * iommu_probe_batch_end() - Set up the VFs probed since iommu_probe_batch_begin()
+ * @dev: the PF passed to iommu_probe_batch_begin()
+ *
+ * Returns 0 on success, or the error of the first group whose default domain
+ * could not be set up. The VFs in the groups that did succeed are finalized
+ * either way.
+ */
+int iommu_probe_batch_end(struct device *dev)
+{
+	struct list_head *batch;
+	int ret;
+
+	if (!dev->iommu)
+		return 0;
+
+	mutex_lock(&iommu_probe_device_lock);
+	batch = dev->iommu->probe_batch;
+	dev->iommu->probe_batch = NULL;
+	mutex_unlock(&iommu_probe_device_lock);
+	if (!batch)
+		return 0;
+
+	ret = iommu_setup_group_list(batch);
+	kfree(batch);
+	return ret;
 }
+EXPORT_SYMBOL_GPL(iommu_probe_batch_end);
 
 bool iommu_present(const struct bus_type *bus)
 {
@@ -2286,7 +2556,7 @@ static int __iommu_group_set_domain_internal(struct iommu_group *group,
 			if (!WARN_ON(!ops->set_platform_dma_ops))
 				ops->set_platform_dma_ops(gdev->dev);
 		}
-		group->domain = NULL;
+		WRITE_ONCE(group->domain, NULL);
 		return 0;
 	}
 
@@ -2314,7 +2584,7 @@ static int __iommu_group_set_domain_internal(struct iommu_group *group,
 			goto err_revert;
 		}
 	}
-	group->domain = new_domain;
+	WRITE_ONCE(group->domain, new_domain);
 	return result;
 
 err_revert:
@@ -2437,6 +2707,7 @@ static int __iommu_map_pages(struct iommu_domain *domain, unsigned long iova,
 		ret = ops->map(domain, iova, paddr, pgsize, prot, gfp);
 		*mapped = ret ? 0 : pgsize;
 	}
+	iommu_perf_count(domain, IOMMU_PERF_MAP_PAGES, *mapped / pgsize, pgsize);
 
 	return ret;
 }
@@ -2493,10 +2764,13 @@ static int __iommu_map(struct iommu_domain *domain, unsigned long iova,
 	}
 
 	/* unroll mapping in case something went wrong */
-	if (ret)
+	if (ret) {
 		iommu_unmap(domain, orig_iova, orig_size - size);
-	else
+	} else {
 		trace_map(orig_iova, orig_paddr, orig_size);
+		iommu_perf_count(domain, IOMMU_PERF_MAP, 1, 0);
+		iommu_perf_count(domain, IOMMU_PERF_MAP_BYTES, orig_size, 0);
+	}
 
 	return ret;
 }
@@ -2586,6 +2860,8 @@ static size_t __iommu_unmap(struct iommu_domain *domain,
 	}
 
 	trace_unmap(orig_iova, size, unmapped);
+	iommu_perf_count(domain, IOMMU_PERF_UNMAP, 1, 0);
+	iommu_perf_count(domain, IOMMU_PERF_UNMAP_BYTES, unmapped, 0);
 	return unmapped;
 }
 
@@ -2611,12 +2887,269 @@ size_t iommu_unmap_fast(struct iommu_domain *domain,
 }
 EXPORT_SYMBOL_GPL(iommu_unmap_fast);
 
+/**
+ * iommu_iotlb_sync_add() - Flush a gather as part of a multi-domain flush
+ * @multi: flush state shared by the domains
+ * @domain: domain @iotlb_gather was filled for
+ * @iotlb_gather: ranges unmapped from @domain
+ *
+ * Issues the invalidations for @iotlb_gather and leaves waiting for them to
+ * iommu_iotlb_multi_sync() when the driver supports it, otherwise this is a
+ * plain iommu_iotlb_sync(). @iotlb_gather is reinitialised either way.
+ */
+void iommu_iotlb_sync_add(struct iommu_iotlb_multi_gather *multi,
+			  struct iommu_domain *domain,
+			  struct iommu_iotlb_gather *iotlb_gather)
+{
+	const struct iommu_domain_ops *ops = domain->ops;
+
+	if (!ops->iotlb_sync_nowait || !ops->iotlb_sync_wait) {
+		iommu_iotlb_sync(domain, iotlb_gather);
+		return;
+	}
+
+	if (multi->nr == ARRAY_SIZE(multi->domains))
+		iommu_iotlb_multi_sync(multi);
+
+	iommu_perf_count(domain, IOMMU_PERF_IOTLB_SYNC, 1, 0);
+	ops->iotlb_sync_nowait(domain, iotlb_gather);
+	iommu_iotlb_gather_init(iotlb_gather);
+	multi->domains[multi->nr++] = domain;
+}
+EXPORT_SYMBOL_GPL(iommu_iotlb_sync_add);
+
+/**
+ * iommu_iotlb_multi_sync() - Wait for the flushes of a multi-domain flush
+ * @multi: flush state passed to iommu_iotlb_sync_add()
+ *
+ * Once this returns the invalidations of every gather added to @multi have
+ * completed. Runs of domains sharing the same driver are waited for with one
+ * ->iotlb_sync_wait() call.
+ */
+void iommu_iotlb_multi_sync(struct iommu_iotlb_multi_gather *multi)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < multi->nr; i = j) {
+		const struct iommu_domain_ops *ops = multi->domains[i]->ops;
+
+		for (j = i + 1; j < multi->nr; j++)
+			if (multi->domains[j]->ops != ops)
+				break;
+		ops->iotlb_sync_wait(&multi->domains[i], j - i);
+	}
+	multi->nr = 0;
+}
+EXPORT_SYMBOL_GPL(iommu_iotlb_multi_sync);
+
+/**
+ * iommu_collapse() - Re-promote small IOPTEs to huge IOPTEs
+ * @domain: paging domain to act on
+ * @iova: start of the range
+ * @size: length of the range
+ * @collapsed: returns the number of bytes now mapped by new huge IOPTEs
+ *
+ * Once a huge IOPTE is split by a partial unmap it stays split, even after the
+ * hole is mapped again with the same contiguous memory, and the IOTLB reach of
+ * the domain slowly degrades. Walk the range and replace every table that
+ * maps a suitably aligned, physically contiguous block with uniform
+ * permissions by a single huge IOPTE, then invalidate the IOTLB.
+ *
+ * Only huge IOPTEs that fit entirely within the range are created, the caller
+ * must not map or unmap within the range while this runs. Translations stay
+ * valid throughout.
+ */
+int iommu_collapse(struct iommu_domain *domain, unsigned long iova,
+		   size_t size, size_t *collapsed)
+{
+	struct iommu_iotlb_gather iotlb_gather;
+	unsigned int min_pagesz;
+
+	*collapsed = 0;
+	if (!(domain->type & __IOMMU_DOMAIN_PAGING) || !domain->pgsize_bitmap)
+		return -EINVAL;
+
+	if (!domain->ops->collapse_pages)
+		return -EOPNOTSUPP;
+
+	min_pagesz = 1 << __ffs(domain->pgsize_bitmap);
+	if (!size || !IS_ALIGNED(iova | size, min_pagesz) ||
+	    iova + size - 1 < iova)
+		return -EINVAL;
+
+	iommu_iotlb_gather_init(&iotlb_gather);
+	*collapsed = domain->ops->collapse_pages(domain, iova, size,
+						 &iotlb_gather);
+	if (*collapsed)
+		iommu_iotlb_sync(domain, &iotlb_gather);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(iommu_collapse);
+
+/*
+ * map_ranges does not report how it split the runs, account the same leaf
+ * entries __iommu_map() would have used.
+ */
+static void iommu_perf_count_ranges(struct iommu_domain *domain,
+				    const struct iommu_map_range *ranges,
+				    unsigned int nr)
+{
+	size_t pgsize, count, size, total = 0;
+	unsigned long iova;
+	phys_addr_t paddr;
+	unsigned int i;
+
+	for (i = 0; i != nr; i++) {
+		iova = ranges[i].iova;
+		paddr = ranges[i].paddr;
+		size = ranges[i].size;
+		while (size) {
+			pgsize = iommu_pgsize(domain, iova, paddr, size, &count);
+			iommu_perf_count(domain, IOMMU_PERF_MAP_PAGES, count,
+					 pgsize);
+			iova += pgsize * count;
+			paddr += pgsize * count;
+			size -= pgsize * count;
+		}
+		total += ranges[i].size;
+	}
+	iommu_perf_count(domain, IOMMU_PERF_MAP, nr, 0);
+	iommu_perf_count(domain, IOMMU_PERF_MAP_BYTES, total, 0);
+}
+
+/* Unmap the first @size bytes of @ranges, in the order they were mapped */
+static void iommu_unmap_ranges(struct iommu_domain *domain,
+			       const struct iommu_map_range *ranges,
+			       unsigned int nr, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i != nr && size; i++) {
+		size_t len = min(size, ranges[i].size);
+
+		iommu_unmap(domain, ranges[i].iova, len);
+		size -= len;
+	}
+}
+
+static int __iommu_map_batch(struct iommu_domain *domain,
+			     const struct iommu_map_range *ranges,
+			     unsigned int nr, int prot, gfp_t gfp)
+{
+	const struct iommu_domain_ops *ops = domain->ops;
+	unsigned int min_pagesz;
+	size_t mapped = 0;
+	unsigned int i;
+	int ret;
+
+	if (!ops->map_ranges) {
+		for (i = 0; i != nr; i++) {
+			ret = __iommu_map(domain, ranges[i].iova,
+					  ranges[i].paddr, ranges[i].size,
+					  prot, gfp);
+			if (ret) {
+				iommu_unmap_ranges(domain, ranges, i, SIZE_MAX);
+				return ret;
+			}
+		}
+		return 0;
+	}
+
+	if (unlikely(domain->pgsize_bitmap == 0UL))
+		return -ENODEV;
+
+	if (unlikely(!(domain->type & __IOMMU_DOMAIN_PAGING)))
+		return -EINVAL;
+
+	/* Validate everything up front so the driver can just walk */
+	min_pagesz = 1 << __ffs(domain->pgsize_bitmap);
+	for (i = 0; i != nr; i++) {
+		if (!IS_ALIGNED(ranges[i].iova | ranges[i].paddr |
+				ranges[i].size, min_pagesz) ||
+		    !ranges[i].size) {
+			pr_err("unaligned: iova 0x%lx pa %pa size 0x%zx min_pagesz 0x%x\n",
+			       ranges[i].iova, &ranges[i].paddr, ranges[i].size,
+			       min_pagesz);
+			return -EINVAL;
+		}
+	}
+
+	ret = ops->map_ranges(domain, ranges, nr, prot, gfp, &mapped);
+	if (ret) {
+		iommu_unmap_ranges(domain, ranges, nr, mapped);
+		return ret;
+	}
+
+	for (i = 0; i != nr; i++)
+		trace_map(ranges[i].iova, ranges[i].paddr, ranges[i].size);
+	if (iommu_perf_active())
+		iommu_perf_count_ranges(domain, ranges, nr);
+	return 0;
+}
+
+/**
+ * iommu_map_batch() - Map several physically contiguous runs at once
+ * @domain: Domain to map into
+ * @ranges: Runs to map, see &struct iommu_map_range
+ * @nr: Number of entries in @ranges
+ * @prot: IOMMU_READ/IOMMU_WRITE/etc for all of the runs
+ * @gfp: Allocation flags for page table memory
+ *
+ * This is equivalent to calling iommu_map() on each run, but drivers
+ * implementing &iommu_domain_ops.map_ranges get the whole list in one call
+ * and only the IOVA ranges that are actually contiguous are synced
+ * separately. Either all of the runs are mapped or none are.
+ *
+ * Return: 0 on success or a negative errno.
+ */
+int iommu_map_batch(struct iommu_domain *domain,
+		    const struct iommu_map_range *ranges, unsigned int nr,
+		    int prot, gfp_t gfp)
+{
+	const struct iommu_domain_ops *ops = domain->ops;
+	unsigned long sync_iova;
+	size_t sync_size = 0;
+	unsigned int i;
+	int ret;
+
+	might_sleep_if(gfpflags_allow_blocking(gfp));
+
+	/* Discourage passing strange GFP flags */
+	if (WARN_ON_ONCE(gfp & (__GFP_COMP | __GFP_DMA | __GFP_DMA32 |
+				__GFP_HIGHMEM)))
+		return -EINVAL;
+
+	ret = __iommu_map_batch(domain, ranges, nr, prot, gfp);
+	if (ret || !ops->iotlb_sync_map)
+		return ret;
+
+	for (i = 0; i != nr; i++) {
+		if (sync_size && ranges[i].iova == sync_iova + sync_size) {
+			sync_size += ranges[i].size;
+			continue;
+		}
+		if (sync_size)
+			ops->iotlb_sync_map(domain, sync_iova, sync_size);
+		sync_iova = ranges[i].iova;
+		sync_size = ranges[i].size;
+	}
+	if (sync_size)
+		ops->iotlb_sync_map(domain, sync_iova, sync_size);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(iommu_map_batch);
+
+/* How many coalesced sg runs iommu_map_sg() hands to the driver at once */
+#define IOMMU_MAP_SG_RUNS 8
+
 ssize_t iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 		     struct scatterlist *sg, unsigned int nents, int prot,
 		     gfp_t gfp)
 {
 	const struct iommu_domain_ops *ops = domain->ops;
-	size_t len = 0, mapped = 0;
+	struct iommu_map_range runs[IOMMU_MAP_SG_RUNS];
+	size_t len = 0, mapped = 0, queued = 0;
+	unsigned int nr_runs = 0;
 	phys_addr_t start;
 	unsigned int i = 0;
 	int ret;
@@ -2632,14 +3165,21 @@ ssize_t iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 		phys_addr_t s_phys = sg_phys(sg);
 
 		if (len && s_phys != start + len) {
-			ret = __iommu_map(domain, iova + mapped, start,
-					len, prot, gfp);
-
-			if (ret)
-				goto out_err;
-
-			mapped += len;
+			runs[nr_runs].iova = iova + mapped + queued;
+			runs[nr_runs].paddr = start;
+			runs[nr_runs].size = len;
+			queued += len;
 			len = 0;
+
+			if (++nr_runs == ARRAY_SIZE(runs)) {
+				ret = __iommu_map_batch(domain, runs, nr_runs,
+							prot, gfp);
+				if (ret)
+					goto out_err;
+				mapped += queued;
+				queued = 0;
+				nr_runs = 0;
+			}
 		}
 
 		if (sg_dma_is_bus_address(sg))
@@ -2657,6 +3197,13 @@ ssize_t iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 			sg = sg_next(sg);
 	}
 
+	if (nr_runs) {
+		ret = __iommu_map_batch(domain, runs, nr_runs, prot, gfp);
+		if (ret)
+			goto out_err;
+		mapped += queued;
+	}
+
 	if (ops->iotlb_sync_map)
 		ops->iotlb_sync_map(domain, iova, mapped);
 	return mapped;
@@ -3032,8 +3579,8 @@ static int iommu_setup_default_domain(struct iommu_group *group,
 
 /*
  * Changing the default domain through sysfs requires the users to unbind the
- * drivers from the devices in the iommu group, except for a DMA -> DMA-FQ
- * transition. Return failure if this isn't met.
+ * drivers from the devices in the iommu group, except for switching between
+ * DMA and DMA-FQ. Return failure if this isn't met.
  *
  * We need to consider the race between this and the device release path.
  * group->mutex is used here to guarantee that the device release path
@@ -3075,6 +3622,15 @@ static ssize_t iommu_group_store_type(struct iommu_group *group,
 		goto out_unlock;
 	}
 
+	/* Nor to drain it and return to strict invalidation */
+	if (req_type == IOMMU_DOMAIN_DMA &&
+	    group->default_domain->type == IOMMU_DOMAIN_DMA_FQ) {
+		iommu_dma_disable_fq(group->default_domain);
+		group->default_domain->type = IOMMU_DOMAIN_DMA;
+		ret = count;
+		goto out_unlock;
+	}
+
 	/* Otherwise, ensure that device exists and no driver is bound. */
 	if (list_empty(&group->devices) || group->owner_cnt) {
 		ret = -EPERM;
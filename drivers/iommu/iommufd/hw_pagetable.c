@@ -415,3 +415,35 @@ int iommufd_hwpt_invalidate(struct iommufd_ucmd *ucmd)
 	iommufd_put_object(&hwpt->obj);
 	return rc;
 }
+
+int iommufd_hwpt_collapse(struct iommufd_ucmd *ucmd)
+{
+	struct iommu_hwpt_collapse *cmd = ucmd->cmd;
+	struct iommufd_hw_pagetable *hwpt;
+	unsigned long collapsed;
+	int rc;
+
+	if (cmd->flags || cmd->__reserved)
+		return -EOPNOTSUPP;
+
+	hwpt = iommufd_get_hwpt(ucmd, cmd->hwpt_id);
+	if (IS_ERR(hwpt))
+		return PTR_ERR(hwpt);
+
+	/* Only the IOAS backed page tables have a layout the kernel knows */
+	if (hwpt->user_managed) {
+		rc = -EINVAL;
+		goto out_put_hwpt;
+	}
+
+	rc = iopt_collapse_domain(&hwpt->ioas->iopt, hwpt->domain, cmd->iova,
+				  cmd->length, &collapsed);
+	if (rc)
+		goto out_put_hwpt;
+
+	cmd->out_collapsed = collapsed;
+	rc = iommufd_ucmd_respond(ucmd, sizeof(*cmd));
+out_put_hwpt:
+	iommufd_put_object(&hwpt->obj);
+	return rc;
+}
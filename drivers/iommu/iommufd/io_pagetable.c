@@ -15,9 +15,9 @@
 #include <linux/err.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/rbtree_augmented.h>
 
 #include "io_pagetable.h"
-#include "double_span.h"
 
 struct iopt_pages_list {
 	struct iopt_pages *pages;
@@ -69,47 +69,222 @@ struct iopt_area *iopt_area_contig_next(struct iopt_area_contig_iter *iter)
 	return iter->area;
 }
 
-static bool __alloc_iova_check_hole(struct interval_tree_double_span_iter *span,
+static bool __alloc_iova_check_used(struct interval_tree_span_iter *span,
 				    unsigned long length,
 				    unsigned long iova_alignment,
 				    unsigned long page_offset)
 {
-	if (span->is_used || span->last_hole - span->start_hole < length - 1)
+	if (span->is_hole || span->last_used - span->start_used < length - 1)
 		return false;
 
-	span->start_hole = ALIGN(span->start_hole, iova_alignment) |
+	span->start_used = ALIGN(span->start_used, iova_alignment) |
 			   page_offset;
-	if (span->start_hole > span->last_hole ||
-	    span->last_hole - span->start_hole < length - 1)
+	if (span->start_used > span->last_used ||
+	    span->last_used - span->start_used < length - 1)
 		return false;
 	return true;
 }
 
-static bool __alloc_iova_check_used(struct interval_tree_span_iter *span,
-				    unsigned long length,
-				    unsigned long iova_alignment,
-				    unsigned long page_offset)
+/*
+ * area_gap_tree holds the same areas as area_itree, ordered by IOVA. As areas
+ * never overlap each subtree can be augmented with the largest hole between
+ * its areas, which lets iopt_alloc_iova() skip over any subtree that is too
+ * densely populated for the requested length instead of visiting every hole.
+ */
+static bool iopt_area_gap_compute(struct iopt_area *area, bool exit)
 {
-	if (span->is_hole || span->last_used - span->start_used < length - 1)
+	struct iopt_area_gap gap = {
+		.first = iopt_area_iova(area),
+		.last = iopt_area_last_iova(area),
+	};
+	struct iopt_area *child;
+
+	if (area->gap_node.rb_left) {
+		child = rb_entry(area->gap_node.rb_left, struct iopt_area,
+				 gap_node);
+		gap.first = child->gap.first;
+		gap.max_gap = max(child->gap.max_gap,
+				  iopt_area_iova(area) - child->gap.last - 1);
+	}
+	if (area->gap_node.rb_right) {
+		child = rb_entry(area->gap_node.rb_right, struct iopt_area,
+				 gap_node);
+		gap.last = child->gap.last;
+		gap.max_gap = max3(gap.max_gap, child->gap.max_gap,
+				   child->gap.first - iopt_area_last_iova(area) -
+					   1);
+	}
+	if (exit && !memcmp(&area->gap, &gap, sizeof(gap)))
+		return true;
+	area->gap = gap;
+	return false;
+}
+
+RB_DECLARE_CALLBACKS(static, iopt_area_gap_callbacks, struct iopt_area,
+		     gap_node, gap, iopt_area_gap_compute);
+
+static void iopt_area_insert_tree(struct io_pagetable *iopt,
+				  struct iopt_area *area)
+{
+	struct rb_node **link = &iopt->area_gap_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct iopt_area *cur;
+
+	lockdep_assert_held_write(&iopt->iova_rwsem);
+
+	interval_tree_insert(&area->node, &iopt->area_itree);
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct iopt_area, gap_node);
+		if (iopt_area_iova(area) < iopt_area_iova(cur))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	area->gap = (struct iopt_area_gap){
+		.first = iopt_area_iova(area),
+		.last = iopt_area_last_iova(area),
+	};
+	rb_link_node(&area->gap_node, parent, link);
+	iopt_area_gap_callbacks_propagate(parent, NULL);
+	rb_insert_augmented(&area->gap_node, &iopt->area_gap_tree,
+			    &iopt_area_gap_callbacks);
+}
+
+static void iopt_area_remove_tree(struct io_pagetable *iopt,
+				  struct iopt_area *area)
+{
+	lockdep_assert_held_write(&iopt->iova_rwsem);
+
+	interval_tree_remove(&area->node, &iopt->area_itree);
+	rb_erase_augmented(&area->gap_node, &iopt->area_gap_tree,
+			   &iopt_area_gap_callbacks);
+}
+
+struct iopt_gap_search {
+	/* Lowest IOVA not known to be used or rejected */
+	unsigned long cursor;
+	unsigned long last;
+	unsigned long length;
+	unsigned long iova_alignment;
+	unsigned long page_offset;
+	bool found;
+};
+
+static bool iopt_gap_check_hole(struct iopt_gap_search *search,
+				unsigned long last_hole)
+{
+	unsigned long start;
+
+	last_hole = min(last_hole, search->last);
+	if (search->cursor > last_hole ||
+	    last_hole - search->cursor < search->length - 1)
 		return false;
 
-	span->start_used = ALIGN(span->start_used, iova_alignment) |
-			   page_offset;
-	if (span->start_used > span->last_used ||
-	    span->last_used - span->start_used < length - 1)
+	start = ALIGN(search->cursor, search->iova_alignment) |
+		search->page_offset;
+	if (start < search->cursor || start > last_hole ||
+	    last_hole - start < search->length - 1)
 		return false;
+	search->cursor = start;
+	search->found = true;
 	return true;
 }
 
+/* Move the cursor past used IOVA, returns true once the range is exhausted */
+static bool iopt_gap_advance(struct iopt_gap_search *search,
+			     unsigned long last_used)
+{
+	if (last_used >= search->last)
+		return true;
+	search->cursor = max(search->cursor, last_used + 1);
+	return false;
+}
+
+/* Check the hole in front of an area and move the cursor past it */
+static bool iopt_area_gap_visit(struct iopt_area *area,
+				struct iopt_gap_search *search)
+{
+	if (iopt_area_iova(area) > search->cursor &&
+	    iopt_gap_check_hole(search, iopt_area_iova(area) - 1))
+		return true;
+	return iopt_gap_advance(search, iopt_area_last_iova(area));
+}
+
+/* The next node to visit in IOVA order once the subtree of node is done */
+static struct rb_node *iopt_area_gap_up(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	while ((parent = rb_parent(node)) && node == parent->rb_right)
+		node = parent;
+	return parent;
+}
+
+/*
+ * Visit the holes in front of every area of the tree in IOVA order, returns
+ * true once the search is over. Subtrees that are already behind the cursor,
+ * or whose internal holes are all shorter than the length, are not descended
+ * into. The tree is walked with the parent pointers rather than recursion.
+ */
+static bool iopt_area_gap_search(struct rb_node *node,
+				 struct iopt_gap_search *search)
+{
+	bool descend = true;
+	struct iopt_area *area;
+
+	while (node) {
+		area = rb_entry(node, struct iopt_area, gap_node);
+
+		if (descend) {
+			if (area->gap.last < search->cursor ||
+			    area->gap.first > search->last) {
+				node = iopt_area_gap_up(node);
+				descend = false;
+				continue;
+			}
+			if (area->gap.first >= search->cursor &&
+			    area->gap.max_gap < search->length) {
+				if (area->gap.first > search->cursor &&
+				    iopt_gap_check_hole(search,
+							area->gap.first - 1))
+					return true;
+				if (iopt_gap_advance(search, area->gap.last))
+					return true;
+				node = iopt_area_gap_up(node);
+				descend = false;
+				continue;
+			}
+			if (node->rb_left) {
+				node = node->rb_left;
+				continue;
+			}
+		}
+
+		/* The left subtree is done, visit the area then the right one */
+		if (iopt_area_gap_visit(area, search))
+			return true;
+		if (node->rb_right) {
+			node = node->rb_right;
+			descend = true;
+		} else {
+			node = iopt_area_gap_up(node);
+			descend = false;
+		}
+	}
+	return false;
+}
+
 /*
  * Automatically find a block of IOVA that is not being used and not reserved.
  * Does not return a 0 IOVA even if it is valid.
  */
 static int iopt_alloc_iova(struct io_pagetable *iopt, unsigned long *iova,
-			   unsigned long uptr, unsigned long length)
+			   unsigned long addr, unsigned long length)
 {
-	unsigned long page_offset = uptr % PAGE_SIZE;
-	struct interval_tree_double_span_iter used_span;
+	unsigned long page_offset = addr % PAGE_SIZE;
+	struct interval_tree_span_iter reserved_span;
 	struct interval_tree_span_iter allowed_span;
 	unsigned long iova_alignment;
 
@@ -120,15 +295,15 @@ static int iopt_alloc_iova(struct io_pagetable *iopt, unsigned long *iova,
 		return -EOVERFLOW;
 
 	/*
-	 * Keep alignment present in the uptr when building the IOVA, this
+	 * Keep alignment present in addr when building the IOVA, which
 	 * increases the chance we can map a THP.
 	 */
-	if (!uptr)
+	if (!addr)
 		iova_alignment = roundup_pow_of_two(length);
 	else
 		iova_alignment = min_t(unsigned long,
 				       roundup_pow_of_two(length),
-				       1UL << __ffs64(uptr));
+				       1UL << __ffs64(addr));
 
 	if (iova_alignment < iopt->iova_alignment)
 		return -EINVAL;
@@ -145,15 +320,30 @@ static int iopt_alloc_iova(struct io_pagetable *iopt, unsigned long *iova,
 					     iova_alignment, page_offset))
 			continue;
 
-		interval_tree_for_each_double_span(
-			&used_span, &iopt->reserved_itree, &iopt->area_itree,
-			allowed_span.start_used, allowed_span.last_used) {
-			if (!__alloc_iova_check_hole(&used_span, length,
-						     iova_alignment,
-						     page_offset))
+		interval_tree_for_each_span(&reserved_span,
+					    &iopt->reserved_itree,
+					    allowed_span.start_used,
+					    allowed_span.last_used) {
+			struct iopt_gap_search search = {
+				.cursor = reserved_span.start_hole,
+				.last = reserved_span.last_hole,
+				.length = length,
+				.iova_alignment = iova_alignment,
+				.page_offset = page_offset,
+			};
+
+			if (!reserved_span.is_hole ||
+			    reserved_span.last_hole - reserved_span.start_hole <
+				    length - 1)
 				continue;
 
-			*iova = used_span.start_hole;
+			if (!iopt_area_gap_search(iopt->area_gap_tree.rb_node,
+						  &search))
+				iopt_gap_check_hole(&search, search.last);
+			if (!search.found)
+				continue;
+
+			*iova = search.cursor;
 			return 0;
 		}
 	}
@@ -217,7 +407,7 @@ static int iopt_insert_area(struct io_pagetable *iopt, struct iopt_area *area,
 	 * initialized yet.
 	 */
 	area->iopt = iopt;
-	interval_tree_insert(&area->node, &iopt->area_itree);
+	iopt_area_insert_tree(iopt, area);
 	return 0;
 }
 
@@ -227,6 +417,7 @@ static int iopt_alloc_area_pages(struct io_pagetable *iopt,
 				 int iommu_prot, unsigned int flags)
 {
 	struct iopt_pages_list *elm;
+	unsigned long start;
 	unsigned long iova;
 	int rc = 0;
 
@@ -246,9 +437,22 @@ static int iopt_alloc_area_pages(struct io_pagetable *iopt,
 		/* Use the first entry to guess the ideal IOVA alignment */
 		elm = list_first_entry(pages_list, struct iopt_pages_list,
 				       next);
-		rc = iopt_alloc_iova(
-			iopt, dst_iova,
-			(uintptr_t)elm->pages->uptr + elm->start_byte, length);
+		switch (elm->pages->type) {
+		case IOPT_ADDRESS_USER:
+			start = elm->start_byte + (uintptr_t)elm->pages->uptr;
+			break;
+		case IOPT_ADDRESS_FILE:
+			start = elm->start_byte + elm->pages->start;
+			break;
+		case IOPT_ADDRESS_DMABUF:
+			/*
+			 * Match the physical alignment so BARs can use the
+			 * largest IOPTEs the domain supports
+			 */
+			start = elm->start_byte + elm->pages->phys;
+			break;
+		}
+		rc = iopt_alloc_iova(iopt, dst_iova, start, length);
 		if (rc)
 			goto out_unlock;
 		if (IS_ENABLED(CONFIG_IOMMUFD_TEST) &&
@@ -268,8 +472,12 @@ static int iopt_alloc_area_pages(struct io_pagetable *iopt,
 	 */
 	iova = *dst_iova;
 	list_for_each_entry(elm, pages_list, next) {
+		int prot = iommu_prot;
+
+		if (elm->pages->type == IOPT_ADDRESS_DMABUF)
+			prot |= IOMMU_MMIO;
 		rc = iopt_insert_area(iopt, elm->area, elm->pages, iova,
-				      elm->start_byte, elm->length, iommu_prot);
+				      elm->start_byte, elm->length, prot);
 		if (rc)
 			goto out_unlock;
 		iova += elm->length;
@@ -286,7 +494,7 @@ static void iopt_abort_area(struct iopt_area *area)
 		WARN_ON(area->pages);
 	if (area->iopt) {
 		down_write(&area->iopt->iova_rwsem);
-		interval_tree_remove(&area->node, &area->iopt->area_itree);
+		iopt_area_remove_tree(area->iopt, area);
 		up_write(&area->iopt->iova_rwsem);
 	}
 	kfree(area);
@@ -363,6 +571,34 @@ int iopt_map_pages(struct io_pagetable *iopt, struct list_head *pages_list,
 	return rc;
 }
 
+static int iopt_map_common(struct iommufd_ctx *ictx, struct io_pagetable *iopt,
+			   struct iopt_pages *pages, unsigned long *iova,
+			   unsigned long length, unsigned long start_byte,
+			   int iommu_prot, unsigned int flags)
+{
+	struct iopt_pages_list elm = {};
+	LIST_HEAD(pages_list);
+	int rc;
+
+	elm.pages = pages;
+	if (ictx->account_mode == IOPT_PAGES_ACCOUNT_MM &&
+	    elm.pages->account_mode == IOPT_PAGES_ACCOUNT_USER)
+		elm.pages->account_mode = IOPT_PAGES_ACCOUNT_MM;
+	elm.start_byte = start_byte;
+	elm.length = length;
+	list_add(&elm.next, &pages_list);
+
+	rc = iopt_map_pages(iopt, &pages_list, length, iova, iommu_prot, flags);
+	if (rc) {
+		if (elm.area)
+			iopt_abort_area(elm.area);
+		if (elm.pages)
+			iopt_put_pages(elm.pages);
+		return rc;
+	}
+	return 0;
+}
+
 /**
  * iopt_map_user_pages() - Map a user VA to an iova in the io page table
  * @ictx: iommufd_ctx the iopt is part of
@@ -387,29 +623,75 @@ int iopt_map_user_pages(struct iommufd_ctx *ictx, struct io_pagetable *iopt,
 			unsigned long length, int iommu_prot,
 			unsigned int flags)
 {
-	struct iopt_pages_list elm = {};
-	LIST_HEAD(pages_list);
-	int rc;
+	struct iopt_pages *pages;
 
-	elm.pages = iopt_alloc_pages(uptr, length, iommu_prot & IOMMU_WRITE);
-	if (IS_ERR(elm.pages))
-		return PTR_ERR(elm.pages);
-	if (ictx->account_mode == IOPT_PAGES_ACCOUNT_MM &&
-	    elm.pages->account_mode == IOPT_PAGES_ACCOUNT_USER)
-		elm.pages->account_mode = IOPT_PAGES_ACCOUNT_MM;
-	elm.start_byte = uptr - elm.pages->uptr;
-	elm.length = length;
-	list_add(&elm.next, &pages_list);
+	pages = iopt_alloc_user_pages(uptr, length, iommu_prot & IOMMU_WRITE);
+	if (IS_ERR(pages))
+		return PTR_ERR(pages);
 
-	rc = iopt_map_pages(iopt, &pages_list, length, iova, iommu_prot, flags);
-	if (rc) {
-		if (elm.area)
-			iopt_abort_area(elm.area);
-		if (elm.pages)
-			iopt_put_pages(elm.pages);
-		return rc;
-	}
-	return 0;
+	return iopt_map_common(ictx, iopt, pages, iova, length,
+			       uptr - pages->uptr, iommu_prot, flags);
+}
+
+/**
+ * iopt_map_file_pages() - Like iopt_map_user_pages, but map a file.
+ * @ictx: iommufd_ctx the iopt is part of
+ * @iopt: io_pagetable to act on
+ * @iova: If IOPT_ALLOC_IOVA is set this is unused on input and contains
+ *        the chosen iova on output. Otherwise is the iova to map to on input
+ * @file: file to map
+ * @start: map file starting at this byte offset
+ * @length: Number of bytes to map
+ * @iommu_prot: Combination of IOMMU_READ/WRITE/etc bits for the mapping
+ * @flags: IOPT_ALLOC_IOVA or zero
+ *
+ * The pages are pinned straight out of the file's page cache, the file does not
+ * need to be mmap'd and the mapping is unaffected by changes to any mm.
+ */
+int iopt_map_file_pages(struct iommufd_ctx *ictx, struct io_pagetable *iopt,
+			unsigned long *iova, struct file *file,
+			unsigned long start, unsigned long length,
+			int iommu_prot, unsigned int flags)
+{
+	struct iopt_pages *pages;
+
+	pages = iopt_alloc_file_pages(file, start, length,
+				      iommu_prot & IOMMU_WRITE);
+	if (IS_ERR(pages))
+		return PTR_ERR(pages);
+	return iopt_map_common(ictx, iopt, pages, iova, length,
+			       start - pages->start, iommu_prot, flags);
+}
+
+/**
+ * iopt_map_dmabuf_pages() - Map the MMIO range behind a dma-buf
+ * @ictx: iommufd_ctx the iopt is part of
+ * @iopt: io_pagetable to act on
+ * @iova: If IOPT_ALLOC_IOVA is set this is unused on input and contains
+ *        the chosen iova on output. Otherwise is the iova to map to on input
+ * @dmabuf: dma-buf to map, must implement dma_buf_get_mmio_range()
+ * @start: map the dma-buf starting at this byte offset
+ * @length: Number of bytes to map
+ * @iommu_prot: Combination of IOMMU_READ/WRITE/etc bits for the mapping
+ * @flags: IOPT_ALLOC_IOVA or zero
+ *
+ * This is used to map a peer device's BAR so devices attached to the domains
+ * of the iopt can do peer-to-peer DMA to it. Nothing is pinned, the dma-buf
+ * reference keeps the range valid until the mapping is destroyed.
+ */
+int iopt_map_dmabuf_pages(struct iommufd_ctx *ictx, struct io_pagetable *iopt,
+			  unsigned long *iova, struct dma_buf *dmabuf,
+			  unsigned long start, unsigned long length,
+			  int iommu_prot, unsigned int flags)
+{
+	struct iopt_pages *pages;
+
+	pages = iopt_alloc_dmabuf_pages(dmabuf, start, length,
+					iommu_prot & IOMMU_WRITE);
+	if (IS_ERR(pages))
+		return PTR_ERR(pages);
+	return iopt_map_common(ictx, iopt, pages, iova, length,
+			       start % PAGE_SIZE, iommu_prot, flags);
 }
 
 int iopt_get_pages(struct io_pagetable *iopt, unsigned long iova,
@@ -567,6 +849,96 @@ int iopt_unmap_all(struct io_pagetable *iopt, unsigned long *unmapped)
 	return rc;
 }
 
+/**
+ * iopt_collapse_domain() - Re-promote the IOPTEs of a domain to huge IOPTEs
+ * @iopt: io_pagetable the domain is filled from
+ * @domain: domain to act on
+ * @iova: Starting iova of the range
+ * @length: Number of bytes in the range
+ * @collapsed: Return number of bytes now mapped by new huge IOPTEs
+ *
+ * Huge IOPTEs are only formed within a single area, like iopt_area_fill_domain()
+ * does. Areas are always unmapped as a whole, while some drivers unmap all of
+ * a huge IOPTE when only part of it is unmapped.
+ */
+int iopt_collapse_domain(struct io_pagetable *iopt,
+			 struct iommu_domain *domain, unsigned long iova,
+			 unsigned long length, unsigned long *collapsed)
+{
+	struct iopt_area *area;
+	unsigned long last;
+	int rc = 0;
+
+	*collapsed = 0;
+	if (!length)
+		return -EINVAL;
+	if (check_add_overflow(iova, length - 1, &last))
+		return -EOVERFLOW;
+
+	/*
+	 * Holding both locks for read keeps the domains and every area with
+	 * pages stable, areas being mapped or unmapped have no pages yet.
+	 */
+	down_read(&iopt->domains_rwsem);
+	down_read(&iopt->iova_rwsem);
+	if (iopt->disable_large_pages ||
+	    (iova | length) & (iopt->iova_alignment - 1)) {
+		rc = -EINVAL;
+		goto out_unlock;
+	}
+
+	for (area = iopt_area_iter_first(iopt, iova, last); area;
+	     area = iopt_area_iter_next(area, iova, last)) {
+		unsigned long start = max(iova, iopt_area_iova(area));
+		unsigned long end = min(last, iopt_area_last_iova(area));
+		size_t done;
+
+		if (!area->pages)
+			continue;
+
+		rc = iommu_collapse(domain, start, end - start + 1, &done);
+		if (rc)
+			break;
+		*collapsed += done;
+		cond_resched();
+	}
+out_unlock:
+	up_read(&iopt->iova_rwsem);
+	up_read(&iopt->domains_rwsem);
+	return rc;
+}
+
+/**
+ * iopt_change_process() - Move all the mappings to the calling process
+ * @iopt: io_pagetable to act on
+ *
+ * See iopt_pages_change_process(). Holding iova_rwsem for write keeps the
+ * areas from being mapped or unmapped and keeps iommufd_access_rw() out while
+ * their pages move. On failure some pages may have moved already, calling
+ * again moves the rest.
+ */
+int iopt_change_process(struct io_pagetable *iopt)
+{
+	struct iopt_area *area;
+	int rc = 0;
+
+	down_read(&iopt->domains_rwsem);
+	down_write(&iopt->iova_rwsem);
+	for (area = iopt_area_iter_first(iopt, 0, ULONG_MAX); area;
+	     area = iopt_area_iter_next(area, 0, ULONG_MAX)) {
+		if (!area->pages)
+			continue;
+
+		rc = iopt_pages_change_process(area->pages);
+		if (rc)
+			break;
+		cond_resched();
+	}
+	up_write(&iopt->iova_rwsem);
+	up_read(&iopt->domains_rwsem);
+	return rc;
+}
+
 /* The caller must always free all the nodes in the allowed_iova rb_root. */
 int iopt_set_allow_iova(struct io_pagetable *iopt,
 			struct rb_root_cached *allowed_iova)
@@ -640,6 +1012,7 @@ void iopt_init_table(struct io_pagetable *iopt)
 	init_rwsem(&iopt->iova_rwsem);
 	init_rwsem(&iopt->domains_rwsem);
 	iopt->area_itree = RB_ROOT_CACHED;
+	iopt->area_gap_tree = RB_ROOT;
 	iopt->allowed_itree = RB_ROOT_CACHED;
 	iopt->reserved_itree = RB_ROOT_CACHED;
 	xa_init_flags(&iopt->domains, XA_FLAGS_ACCOUNT);
@@ -670,6 +1043,7 @@ void iopt_destroy_table(struct io_pagetable *iopt)
 	WARN_ON(!xa_empty(&iopt->domains));
 	WARN_ON(!xa_empty(&iopt->access_list));
 	WARN_ON(!RB_EMPTY_ROOT(&iopt->area_itree.rb_root));
+	WARN_ON(!RB_EMPTY_ROOT(&iopt->area_gap_tree));
 }
 
 /**
@@ -1034,7 +1408,7 @@ static int iopt_area_split(struct iopt_area *area, unsigned long iova)
 		goto err_unlock;
 	}
 
-	interval_tree_remove(&area->node, &iopt->area_itree);
+	iopt_area_remove_tree(iopt, area);
 	rc = iopt_insert_area(iopt, lhs, area->pages, start_iova,
 			      iopt_area_start_byte(area, start_iova),
 			      (new_start - 1) - start_iova + 1,
@@ -1063,9 +1437,9 @@ static int iopt_area_split(struct iopt_area *area, unsigned long iova)
 	return 0;
 
 err_remove_lhs:
-	interval_tree_remove(&lhs->node, &iopt->area_itree);
+	iopt_area_remove_tree(iopt, lhs);
 err_insert:
-	interval_tree_insert(&area->node, &iopt->area_itree);
+	iopt_area_insert_tree(iopt, area);
 err_unlock:
 	mutex_unlock(&pages->mutex);
 	kfree(rhs);
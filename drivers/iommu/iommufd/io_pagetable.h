@@ -31,13 +31,24 @@ struct iommu_domain;
  * as the pages code can rely on the storage_domain without having to get the
  * iopt->domains_rwsem.
  *
- * The io_pagetable::iova_rwsem protects node
+ * The io_pagetable::iova_rwsem protects node, gap_node and gap
  * The iopt_pages::mutex protects pages_node
  * iopt and iommu_prot are immutable
  * The pages::mutex protects num_accesses
  */
+struct iopt_area_gap {
+	/* First and last IOVA covered by the areas of the subtree */
+	unsigned long first;
+	unsigned long last;
+	/* Largest number of free IOVAs between two areas of the subtree */
+	unsigned long max_gap;
+};
+
 struct iopt_area {
 	struct interval_tree_node node;
+	/* io_pagetable::area_gap_tree, augmented with gap */
+	struct rb_node gap_node;
+	struct iopt_area_gap gap;
 	struct interval_tree_node pages_node;
 	struct io_pagetable *iopt;
 	struct iopt_pages *pages;
@@ -175,16 +186,26 @@ enum {
 	IOPT_PAGES_ACCOUNT_MM = 2,
 };
 
+enum iopt_address_type {
+	IOPT_ADDRESS_USER = 0,
+	IOPT_ADDRESS_FILE = 1,
+	IOPT_ADDRESS_DMABUF = 2,
+};
+
 /*
  * This holds a pinned page list for multiple areas of IO address space. The
- * pages always originate from a linear chunk of userspace VA. Multiple
+ * pages always originate from a linear chunk of userspace VA, from a linear
+ * range of a memfd or from the MMIO range behind a dma-buf. Multiple
  * io_pagetable's, through their iopt_area's, can share a single iopt_pages
  * which avoids multi-pinning and double accounting of page consumption.
  *
+ * MMIO has no struct page, so IOPT_ADDRESS_DMABUF pages are never pinned or
+ * accounted and cannot be used by an iommufd_access.
+ *
  * indexes in this structure are measured in PAGE_SIZE units, are 0 based from
- * the start of the uptr and extend to npages. pages are pinned dynamically
- * according to the intervals in the access_itree and domains_itree, npinned
- * records the current number of pages pinned.
+ * the start of the uptr or file start and extend to npages. pages are pinned
+ * dynamically according to the intervals in the access_itree and
+ * domains_itree, npinned records the current number of pages pinned.
  */
 struct iopt_pages {
 	struct kref kref;
@@ -195,7 +216,18 @@ struct iopt_pages {
 	struct task_struct *source_task;
 	struct mm_struct *source_mm;
 	struct user_struct *source_user;
-	void __user *uptr;
+	enum iopt_address_type type;
+	union {
+		void __user *uptr;		/* IOPT_ADDRESS_USER */
+		struct {			/* IOPT_ADDRESS_FILE */
+			struct file *file;
+			unsigned long start;
+		};
+		struct {			/* IOPT_ADDRESS_DMABUF */
+			struct dma_buf *dmabuf;
+			phys_addr_t phys;
+		};
+	};
 	bool writable:1;
 	u8 account_mode;
 
@@ -206,8 +238,13 @@ struct iopt_pages {
 	struct rb_root_cached domains_itree;
 };
 
-struct iopt_pages *iopt_alloc_pages(void __user *uptr, unsigned long length,
-				    bool writable);
+struct iopt_pages *iopt_alloc_user_pages(void __user *uptr,
+					 unsigned long length, bool writable);
+struct iopt_pages *iopt_alloc_file_pages(struct file *file, unsigned long start,
+					 unsigned long length, bool writable);
+struct iopt_pages *iopt_alloc_dmabuf_pages(struct dma_buf *dmabuf,
+					   unsigned long start,
+					   unsigned long length, bool writable);
 void iopt_release_pages(struct kref *kref);
 static inline void iopt_put_pages(struct iopt_pages *pages)
 {
@@ -228,6 +265,7 @@ void iopt_area_remove_access(struct iopt_area *area, unsigned long start,
 			    unsigned long last);
 int iopt_pages_rw_access(struct iopt_pages *pages, unsigned long start_byte,
 			 void *data, unsigned long length, unsigned int flags);
+int iopt_pages_change_process(struct iopt_pages *pages);
 
 /*
  * Each interval represents an active iopt_access_pages(), it acts as an
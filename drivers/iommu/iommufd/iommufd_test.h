@@ -25,6 +25,7 @@ enum {
 	IOMMU_TEST_OP_PASID_REPLACE,
 	IOMMU_TEST_OP_PASID_DETACH,
 	IOMMU_TEST_OP_PASID_CHECK_DOMAIN,
+	IOMMU_TEST_OP_DMABUF_GET,
 };
 
 enum {
@@ -51,6 +52,9 @@ enum {
 	MOCK_NESTED_DOMAIN_IOTLB_NUM = 4,
 };
 
+/* Physical address the mock MMIO dma-bufs claim to be backed by */
+#define MOCK_DMABUF_PHYS (1UL << 30)
+
 struct iommu_test_cmd {
 	__u32 size;
 	__u32 op;
@@ -135,6 +139,11 @@ struct iommu_test_cmd {
 			__u64 out_result_ptr;
 			/* @id is stdev_id for IOMMU_TEST_OP_HWPT_GET_DOMAIN */
 		} pasid_check;
+		struct {
+			__aligned_u64 length;
+			__u32 open_flags;
+			__u32 out_fd;
+		} dmabuf_get;
 	};
 	__u32 last;
 };
@@ -8,6 +8,7 @@
  */
 #define pr_fmt(fmt) "iommufd: " fmt
 
+#include <linux/async.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/module.h>
@@ -15,6 +16,7 @@
 #include <linux/miscdevice.h>
 #include <linux/mutex.h>
 #include <linux/bug.h>
+#include <linux/workqueue.h>
 #include <uapi/linux/iommufd.h>
 #include <linux/iommufd.h>
 
@@ -28,6 +30,7 @@ struct iommufd_object_ops {
 };
 static const struct iommufd_object_ops iommufd_object_ops[];
 static struct miscdevice vfio_misc_dev;
+static struct workqueue_struct *iommufd_release_wq;
 
 struct iommufd_object *_iommufd_object_alloc(struct iommufd_ctx *ictx,
 					     size_t size,
@@ -242,9 +245,18 @@ static int iommufd_fops_open(struct inode *inode, struct file *filp)
 	return 0;
 }
 
-static int iommufd_fops_release(struct inode *inode, struct file *filp)
+static void iommufd_destroy_leaf(void *data, async_cookie_t cookie)
 {
-	struct iommufd_ctx *ictx = filp->private_data;
+	struct iommufd_object *obj = data;
+
+	iommufd_object_ops[obj->type].destroy(obj);
+	kfree(obj);
+}
+
+static void iommufd_ctx_destroy_objects(struct iommufd_ctx *ictx,
+					bool parallel)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(destroy_domain);
 	struct iommufd_object *obj;
 
 	/*
@@ -255,6 +267,10 @@ static int iommufd_fops_release(struct inode *inode, struct file *filp)
 	 * Repeatedly destroying all the "1 users" leaf objects will progress
 	 * until the entire list is destroyed. If this can't progress then there
 	 * is some bug related to object refcounting.
+	 *
+	 * The leaves of one pass don't depend on each other, when @parallel
+	 * they are destroyed concurrently, eg the IOAS's of a context unmap
+	 * their domains and unpin their pages at the same time.
 	 */
 	while (!xa_empty(&ictx->objects)) {
 		unsigned int destroyed = 0;
@@ -265,18 +281,79 @@ static int iommufd_fops_release(struct inode *inode, struct file *filp)
 				continue;
 			destroyed++;
 			xa_erase(&ictx->objects, index);
-			iommufd_object_ops[obj->type].destroy(obj);
-			kfree(obj);
+			if (parallel)
+				async_schedule_domain(iommufd_destroy_leaf, obj,
+						      &destroy_domain);
+			else
+				iommufd_destroy_leaf(obj, 0);
 		}
+		async_synchronize_full_domain(&destroy_domain);
 		/* Bug related to users refcount */
 		if (WARN_ON(!destroyed))
 			break;
 	}
 	WARN_ON(!xa_empty(&ictx->groups));
 	kfree(ictx);
+}
+
+static void iommufd_ctx_release_work(struct work_struct *work)
+{
+	struct iommufd_ctx *ictx =
+		container_of(work, struct iommufd_ctx, release_work);
+
+	iommufd_ctx_destroy_objects(ictx, true);
+}
+
+/*
+ * Wait for the contexts released with IOMMU_OPTION_ASYNC_RELEASE to be
+ * destroyed.
+ */
+void iommufd_flush_release(void)
+{
+	flush_workqueue(iommufd_release_wq);
+}
+
+static int iommufd_fops_release(struct inode *inode, struct file *filp)
+{
+	struct iommufd_ctx *ictx = filp->private_data;
+
+	/*
+	 * Every device and access holds a reference on the file, so no device
+	 * can be attached to any of the domains anymore and DMA is already
+	 * fenced, only the selftest mock devices may remain. What is left is
+	 * unmapping the domains and unpinning the pages, which can take a long
+	 * time for a large VM. With IOMMU_OPTION_ASYNC_RELEASE this is left to
+	 * a worker.
+	 */
+	if (ictx->async_release) {
+		INIT_WORK(&ictx->release_work, iommufd_ctx_release_work);
+		queue_work(iommufd_release_wq, &ictx->release_work);
+		return 0;
+	}
+
+	iommufd_ctx_destroy_objects(ictx, false);
 	return 0;
 }
 
+static int iommufd_option_async_release(struct iommu_option *cmd,
+					struct iommufd_ctx *ictx)
+{
+	if (cmd->object_id)
+		return -EOPNOTSUPP;
+
+	if (cmd->op == IOMMU_OPTION_OP_GET) {
+		cmd->val64 = ictx->async_release;
+		return 0;
+	}
+	if (cmd->op == IOMMU_OPTION_OP_SET) {
+		if (cmd->val64 > 1)
+			return -EINVAL;
+		ictx->async_release = cmd->val64;
+		return 0;
+	}
+	return -EOPNOTSUPP;
+}
+
 static int iommufd_option(struct iommufd_ucmd *ucmd)
 {
 	struct iommu_option *cmd = ucmd->cmd;
@@ -292,6 +369,9 @@ static int iommufd_option(struct iommufd_ucmd *ucmd)
 	case IOMMU_OPTION_HUGE_PAGES:
 		rc = iommufd_ioas_option(ucmd);
 		break;
+	case IOMMU_OPTION_ASYNC_RELEASE:
+		rc = iommufd_option_async_release(cmd, ucmd->ictx);
+		break;
 	default:
 		return -EOPNOTSUPP;
 	}
@@ -308,11 +388,14 @@ union ucmd_buffer {
 	struct iommu_hw_info info;
 	struct iommu_hwpt_alloc hwpt;
 	struct iommu_hwpt_invalidate cache;
+	struct iommu_hwpt_collapse collapse;
 	struct iommu_ioas_alloc alloc;
 	struct iommu_ioas_allow_iovas allow_iovas;
+	struct iommu_ioas_change_process change_process;
 	struct iommu_ioas_copy ioas_copy;
 	struct iommu_ioas_iova_ranges iova_ranges;
 	struct iommu_ioas_map map;
+	struct iommu_ioas_map_file map_file;
 	struct iommu_ioas_unmap unmap;
 	struct iommu_option option;
 	struct iommu_set_dev_data set_dev_data;
@@ -345,18 +428,24 @@ static const struct iommufd_ioctl_op iommufd_ioctl_ops[] = {
 		 __reserved),
 	IOCTL_OP(IOMMU_HWPT_ALLOC, iommufd_hwpt_alloc, struct iommu_hwpt_alloc,
 		 __reserved),
+	IOCTL_OP(IOMMU_HWPT_COLLAPSE, iommufd_hwpt_collapse,
+		 struct iommu_hwpt_collapse, out_collapsed),
 	IOCTL_OP(IOMMU_HWPT_INVALIDATE, iommufd_hwpt_invalidate,
 		 struct iommu_hwpt_invalidate, out_driver_error_code),
 	IOCTL_OP(IOMMU_IOAS_ALLOC, iommufd_ioas_alloc_ioctl,
 		 struct iommu_ioas_alloc, out_ioas_id),
 	IOCTL_OP(IOMMU_IOAS_ALLOW_IOVAS, iommufd_ioas_allow_iovas,
 		 struct iommu_ioas_allow_iovas, allowed_iovas),
+	IOCTL_OP(IOMMU_IOAS_CHANGE_PROCESS, iommufd_ioas_change_process,
+		 struct iommu_ioas_change_process, ioas_id),
 	IOCTL_OP(IOMMU_IOAS_COPY, iommufd_ioas_copy, struct iommu_ioas_copy,
 		 src_iova),
 	IOCTL_OP(IOMMU_IOAS_IOVA_RANGES, iommufd_ioas_iova_ranges,
 		 struct iommu_ioas_iova_ranges, out_iova_alignment),
 	IOCTL_OP(IOMMU_IOAS_MAP, iommufd_ioas_map, struct iommu_ioas_map,
 		 iova),
+	IOCTL_OP(IOMMU_IOAS_MAP_FILE, iommufd_ioas_map_file,
+		 struct iommu_ioas_map_file, iova),
 	IOCTL_OP(IOMMU_IOAS_UNMAP, iommufd_ioas_unmap, struct iommu_ioas_unmap,
 		 length),
 	IOCTL_OP(IOMMU_OPTION, iommufd_option, struct iommu_option,
@@ -523,9 +612,13 @@ static int __init iommufd_init(void)
 {
 	int ret;
 
+	iommufd_release_wq = alloc_workqueue("iommufd_release", WQ_UNBOUND, 0);
+	if (!iommufd_release_wq)
+		return -ENOMEM;
+
 	ret = misc_register(&iommu_misc_dev);
 	if (ret)
-		return ret;
+		goto err_wq;
 
 	if (IS_ENABLED(CONFIG_IOMMUFD_VFIO_CONTAINER)) {
 		ret = misc_register(&vfio_misc_dev);
@@ -542,15 +635,20 @@ static int __init iommufd_init(void)
 		misc_deregister(&vfio_misc_dev);
 err_misc:
 	misc_deregister(&iommu_misc_dev);
+err_wq:
+	destroy_workqueue(iommufd_release_wq);
 	return ret;
 }
 
 static void __exit iommufd_exit(void)
 {
+	/* Pending releases may still destroy selftest mock objects */
+	iommufd_flush_release();
 	iommufd_test_exit();
 	if (IS_ENABLED(CONFIG_IOMMUFD_VFIO_CONTAINER))
 		misc_deregister(&vfio_misc_dev);
 	misc_deregister(&iommu_misc_dev);
+	destroy_workqueue(iommufd_release_wq);
 }
 
 module_init(iommufd_init);
@@ -561,5 +659,6 @@ MODULE_ALIAS_MISCDEV(VFIO_MINOR);
 MODULE_ALIAS("devname:vfio/vfio");
 #endif
 MODULE_IMPORT_NS(IOMMUFD_INTERNAL);
+MODULE_IMPORT_NS(DMA_BUF);
 MODULE_DESCRIPTION("I/O Address Space Management for passthrough devices");
 MODULE_LICENSE("GPL");
@@ -45,11 +45,15 @@
  * last_iova + 1 can overflow. An iopt_pages index will always be much less than
  * ULONG_MAX so last_index + 1 cannot overflow.
  */
+#include <linux/dma-buf.h>
+#include <linux/file.h>
 #include <linux/overflow.h>
 #include <linux/slab.h>
 #include <linux/iommu.h>
 #include <linux/sched/mm.h>
 #include <linux/highmem.h>
+#include <linux/hugetlb.h>
+#include <linux/shmem_fs.h>
 #include <linux/kthread.h>
 #include <linux/iommufd.h>
 
@@ -63,6 +67,9 @@
 #endif
 #define BATCH_BACKUP_SIZE 32
 
+/* Unpinning a large area gives back the pinned page accounting in chunks */
+#define UNPIN_ACCOUNT_CHUNK (SZ_1G / PAGE_SIZE)
+
 /*
  * More memory makes pin_user_pages() and the batching more efficient, but as
  * this is only a performance optimization don't try too hard to get it. A 64k
@@ -472,12 +479,17 @@ static int batch_iommu_map_small(struct iommu_domain *domain,
 	return rc;
 }
 
+/* Number of batch entries handed to iommu_map_batch() at once */
+#define BATCH_MAP_RANGES 8
+
 static int batch_to_domain(struct pfn_batch *batch, struct iommu_domain *domain,
 			   struct iopt_area *area, unsigned long start_index)
 {
 	bool disable_large_pages = area->iopt->disable_large_pages;
 	unsigned long last_iova = iopt_area_last_iova(area);
+	struct iommu_map_range ranges[BATCH_MAP_RANGES];
 	unsigned int page_offset = 0;
+	unsigned int nr_ranges = 0;
 	unsigned long start_iova;
 	unsigned long next_iova;
 	unsigned int cur = 0;
@@ -493,19 +505,36 @@ static int batch_to_domain(struct pfn_batch *batch, struct iommu_domain *domain,
 		next_iova = min(last_iova + 1,
 				next_iova + batch->npfns[cur] * PAGE_SIZE -
 					page_offset);
-		if (disable_large_pages)
+		if (disable_large_pages) {
 			rc = batch_iommu_map_small(
 				domain, iova,
 				PFN_PHYS(batch->pfns[cur]) + page_offset,
 				next_iova - iova, area->iommu_prot);
-		else
-			rc = iommu_map(domain, iova,
-				       PFN_PHYS(batch->pfns[cur]) + page_offset,
-				       next_iova - iova, area->iommu_prot,
-				       GFP_KERNEL_ACCOUNT);
-		if (rc)
-			goto err_unmap;
-		iova = next_iova;
+			if (rc)
+				goto err_unmap;
+			iova = next_iova;
+		} else {
+			/* iova only covers what was already mapped */
+			ranges[nr_ranges].iova =
+				nr_ranges ? ranges[nr_ranges - 1].iova +
+						    ranges[nr_ranges - 1].size :
+					    iova;
+			ranges[nr_ranges].paddr =
+				PFN_PHYS(batch->pfns[cur]) + page_offset;
+			ranges[nr_ranges].size =
+				next_iova - ranges[nr_ranges].iova;
+			nr_ranges++;
+			if (nr_ranges == ARRAY_SIZE(ranges) ||
+			    cur + 1 == batch->end) {
+				rc = iommu_map_batch(domain, ranges, nr_ranges,
+						     area->iommu_prot,
+						     GFP_KERNEL_ACCOUNT);
+				if (rc)
+					goto err_unmap;
+				iova = next_iova;
+				nr_ranges = 0;
+			}
+		}
 		page_offset = 0;
 		cur++;
 	}
@@ -627,6 +656,10 @@ static void batch_unpin(struct pfn_batch *batch, struct iopt_pages *pages,
 {
 	unsigned int cur = 0;
 
+	/* MMIO pfns are never pinned */
+	if (pages->type == IOPT_ADDRESS_DMABUF)
+		return;
+
 	while (first_page_off) {
 		if (batch->npfns[cur] > first_page_off)
 			break;
@@ -648,6 +681,21 @@ static void batch_unpin(struct pfn_batch *batch, struct iopt_pages *pages,
 	}
 }
 
+/*
+ * The MMIO range behind a dma-buf is physically contiguous, so the pfns can be
+ * generated directly without looking anything up.
+ */
+static void batch_from_mmio(struct pfn_batch *batch, struct iopt_pages *pages,
+			    unsigned long start_index, unsigned long last_index)
+{
+	unsigned long pfn = PHYS_PFN(pages->phys) + start_index;
+	unsigned long end_pfn = PHYS_PFN(pages->phys) + last_index + 1;
+
+	for (; pfn != end_pfn; pfn++)
+		if (!batch_add_pfn(batch, pfn))
+			break;
+}
+
 static void copy_data_page(struct page *page, void *data, unsigned long offset,
 			   size_t length, unsigned int flags)
 {
@@ -691,13 +739,20 @@ static unsigned long batch_rw(struct pfn_batch *batch, void *data,
 	return copied;
 }
 
-/* pfn_reader_user is just the pin_user_pages() path */
+/*
+ * pfn_reader_user is just the pin_user_pages() path, or memfd_pin_folios() for
+ * IOPT_ADDRESS_FILE
+ */
 struct pfn_reader_user {
 	struct page **upages;
 	size_t upages_len;
 	unsigned long upages_start;
 	unsigned long upages_end;
 	unsigned int gup_flags;
+	/* Only for IOPT_ADDRESS_FILE */
+	struct file *file;
+	struct folio **ufolios;
+	size_t ufolios_len;
 	/*
 	 * 1 means mmget() and mmap_read_lock(), 0 means only mmget(), -1 is
 	 * neither
@@ -712,6 +767,9 @@ static void pfn_reader_user_init(struct pfn_reader_user *user,
 	user->upages_start = 0;
 	user->upages_end = 0;
 	user->locked = -1;
+	user->file = (pages->type == IOPT_ADDRESS_FILE) ? pages->file : NULL;
+	user->ufolios = NULL;
+	user->ufolios_len = 0;
 
 	user->gup_flags = FOLL_LONGTERM;
 	if (pages->writable)
@@ -731,6 +789,47 @@ static void pfn_reader_user_destroy(struct pfn_reader_user *user,
 
 	kfree(user->upages);
 	user->upages = NULL;
+	kfree(user->ufolios);
+	user->ufolios = NULL;
+}
+
+/*
+ * Pin the folios backing a file range and return one pin per page in upages so
+ * the result is indistinguishable from pin_user_pages(). Each folio is looked up
+ * and pinned once, the per-page pins are then added with a single refcount
+ * update per folio.
+ */
+static long pin_memfd_pages(struct pfn_reader_user *user, unsigned long start,
+			    unsigned long npages)
+{
+	unsigned long end = start + (npages << PAGE_SHIFT) - 1;
+	struct page **upages = user->upages;
+	unsigned long npages_out = 0;
+	pgoff_t offset;
+	long nfolios;
+	long i;
+
+	nfolios = memfd_pin_folios(user->file, start, end, user->ufolios,
+				   user->ufolios_len / sizeof(*user->ufolios),
+				   &offset);
+	if (nfolios <= 0)
+		return nfolios;
+
+	offset >>= PAGE_SHIFT;
+	for (i = 0; i != nfolios; i++) {
+		struct folio *folio = user->ufolios[i];
+		unsigned long npin = min(folio_nr_pages(folio) - offset, npages);
+		unsigned long j;
+
+		/* memfd_pin_folios() already holds one pin on the folio */
+		folio_add_pins(folio, npin - 1);
+		for (j = 0; j != npin; j++)
+			*upages++ = folio_page(folio, offset + j);
+		npages -= npin;
+		npages_out += npin;
+		offset = 0;
+	}
+	return npages_out;
 }
 
 static int pfn_reader_user_pin(struct pfn_reader_user *user,
@@ -756,7 +855,15 @@ static int pfn_reader_user_pin(struct pfn_reader_user *user,
 			return -ENOMEM;
 	}
 
-	if (user->locked == -1) {
+	if (user->file && !user->ufolios) {
+		user->ufolios_len = user->upages_len / sizeof(*user->upages) *
+				    sizeof(*user->ufolios);
+		user->ufolios = temp_kmalloc(&user->ufolios_len, NULL, 0);
+		if (!user->ufolios)
+			return -ENOMEM;
+	}
+
+	if (!user->file && user->locked == -1) {
 		/*
 		 * The majority of usages will run the map task within the mm
 		 * providing the pages, so we can optimize into
@@ -771,16 +878,22 @@ static int pfn_reader_user_pin(struct pfn_reader_user *user,
 
 	npages = min_t(unsigned long, last_index - start_index + 1,
 		       user->upages_len / sizeof(*user->upages));
-
+	if (user->file)
+		npages = min_t(unsigned long, npages,
+			       user->ufolios_len / sizeof(*user->ufolios));
 
 	if (iommufd_should_fail())
 		return -EFAULT;
 
-	uptr = (uintptr_t)(pages->uptr + start_index * PAGE_SIZE);
-	if (!remote_mm)
+	if (user->file) {
+		rc = pin_memfd_pages(user, pages->start + start_index * PAGE_SIZE,
+				     npages);
+	} else if (!remote_mm) {
+		uptr = (uintptr_t)(pages->uptr + start_index * PAGE_SIZE);
 		rc = pin_user_pages_fast(uptr, npages, user->gup_flags,
 					 user->upages);
-	else {
+	} else {
+		uptr = (uintptr_t)(pages->uptr + start_index * PAGE_SIZE);
 		if (!user->locked) {
 			mmap_read_lock(pages->source_mm);
 			user->locked = 1;
@@ -833,11 +946,11 @@ static int update_mm_locked_vm(struct iopt_pages *pages, unsigned long npages,
 	bool do_put = false;
 	int rc;
 
-	if (user && user->locked) {
+	if (user && user->locked == 1) {
 		mmap_read_unlock(pages->source_mm);
 		user->locked = 0;
 		/* If we had the lock then we also have a get */
-	} else if ((!user || !user->upages) &&
+	} else if ((!user || user->locked == -1) &&
 		   pages->source_mm != current->mm) {
 		if (!mmget_not_zero(pages->source_mm))
 			return -EINVAL;
@@ -1007,6 +1120,12 @@ static int pfn_reader_fill_span(struct pfn_reader *pfns)
 		return 0;
 	}
 
+	if (pfns->pages->type == IOPT_ADDRESS_DMABUF) {
+		batch_from_mmio(&pfns->batch, pfns->pages, start_index,
+				span->last_hole);
+		return 0;
+	}
+
 	if (start_index >= pfns->user.upages_end) {
 		rc = pfn_reader_user_pin(&pfns->user, pfns->pages, start_index,
 					 span->last_hole);
@@ -1138,11 +1257,10 @@ static int pfn_reader_first(struct pfn_reader *pfns, struct iopt_pages *pages,
 	return 0;
 }
 
-struct iopt_pages *iopt_alloc_pages(void __user *uptr, unsigned long length,
-				    bool writable)
+static struct iopt_pages *iopt_alloc_pages(unsigned long start_byte,
+					   unsigned long length, bool writable)
 {
 	struct iopt_pages *pages;
-	unsigned long end;
 
 	/*
 	 * The iommu API uses size_t as the length, and protect the DIV_ROUND_UP
@@ -1151,9 +1269,6 @@ struct iopt_pages *iopt_alloc_pages(void __user *uptr, unsigned long length,
 	if (length > SIZE_MAX - PAGE_SIZE || length == 0)
 		return ERR_PTR(-EINVAL);
 
-	if (check_add_overflow((unsigned long)uptr, length, &end))
-		return ERR_PTR(-EOVERFLOW);
-
 	pages = kzalloc(sizeof(*pages), GFP_KERNEL_ACCOUNT);
 	if (!pages)
 		return ERR_PTR(-ENOMEM);
@@ -1163,8 +1278,7 @@ struct iopt_pages *iopt_alloc_pages(void __user *uptr, unsigned long length,
 	mutex_init(&pages->mutex);
 	pages->source_mm = current->mm;
 	mmgrab(pages->source_mm);
-	pages->uptr = (void __user *)ALIGN_DOWN((uintptr_t)uptr, PAGE_SIZE);
-	pages->npages = DIV_ROUND_UP(length + (uptr - pages->uptr), PAGE_SIZE);
+	pages->npages = DIV_ROUND_UP(length + start_byte, PAGE_SIZE);
 	pages->access_itree = RB_ROOT_CACHED;
 	pages->domains_itree = RB_ROOT_CACHED;
 	pages->writable = writable;
@@ -1178,6 +1292,85 @@ struct iopt_pages *iopt_alloc_pages(void __user *uptr, unsigned long length,
 	return pages;
 }
 
+struct iopt_pages *iopt_alloc_user_pages(void __user *uptr,
+					 unsigned long length, bool writable)
+{
+	unsigned long start_byte = (uintptr_t)uptr % PAGE_SIZE;
+	struct iopt_pages *pages;
+	unsigned long end;
+
+	if (check_add_overflow((unsigned long)uptr, length, &end))
+		return ERR_PTR(-EOVERFLOW);
+
+	pages = iopt_alloc_pages(start_byte, length, writable);
+	if (IS_ERR(pages))
+		return pages;
+	pages->uptr = (void __user *)ALIGN_DOWN((uintptr_t)uptr, PAGE_SIZE);
+	pages->type = IOPT_ADDRESS_USER;
+	return pages;
+}
+
+struct iopt_pages *iopt_alloc_file_pages(struct file *file, unsigned long start,
+					 unsigned long length, bool writable)
+{
+	unsigned long start_byte = start % PAGE_SIZE;
+	struct iopt_pages *pages;
+	unsigned long end;
+
+	if (check_add_overflow(start, length, &end))
+		return ERR_PTR(-EOVERFLOW);
+
+	/* Only memfds have page caches memfd_pin_folios() can pin from */
+	if (!shmem_file(file) && !is_file_hugepages(file))
+		return ERR_PTR(-EINVAL);
+
+	if (writable && !(file->f_mode & FMODE_WRITE))
+		return ERR_PTR(-EPERM);
+
+	pages = iopt_alloc_pages(start_byte, length, writable);
+	if (IS_ERR(pages))
+		return pages;
+	pages->file = get_file(file);
+	pages->start = start - start_byte;
+	pages->type = IOPT_ADDRESS_FILE;
+	return pages;
+}
+
+struct iopt_pages *iopt_alloc_dmabuf_pages(struct dma_buf *dmabuf,
+					   unsigned long start,
+					   unsigned long length, bool writable)
+{
+	unsigned long start_byte = start % PAGE_SIZE;
+	struct iopt_pages *pages;
+	phys_addr_t phys;
+	unsigned long end;
+	size_t size;
+	int rc;
+
+	if (check_add_overflow(start, length, &end))
+		return ERR_PTR(-EOVERFLOW);
+
+	rc = dma_buf_get_mmio_range(dmabuf, &phys, &size);
+	if (rc)
+		return ERR_PTR(rc);
+	if (end > size || !PAGE_ALIGNED(phys))
+		return ERR_PTR(-EINVAL);
+
+	if (writable && !(dmabuf->file->f_mode & FMODE_WRITE))
+		return ERR_PTR(-EPERM);
+
+	pages = iopt_alloc_pages(start_byte, length, writable);
+	if (IS_ERR(pages))
+		return pages;
+	get_dma_buf(dmabuf);
+	pages->dmabuf = dmabuf;
+	pages->phys = phys + start - start_byte;
+	pages->type = IOPT_ADDRESS_DMABUF;
+	/* Nothing is pinned, so there is nothing to account */
+	pages->account_mode = IOPT_PAGES_ACCOUNT_NONE;
+	return pages;
+}
+
 void iopt_release_pages(struct kref *kref)
 {
 	struct iopt_pages *pages = container_of(kref, struct iopt_pages, kref);
@@ -1190,6 +1383,10 @@ void iopt_release_pages(struct kref *kref)
 	mutex_destroy(&pages->mutex);
 	put_task_struct(pages->source_task);
 	free_uid(pages->source_user);
+	if (pages->type == IOPT_ADDRESS_FILE)
+		fput(pages->file);
+	else if (pages->type == IOPT_ADDRESS_DMABUF)
+		dma_buf_put(pages->dmabuf);
 	kfree(pages);
 }
 
@@ -1248,6 +1445,11 @@ iopt_area_unpin_domain(struct pfn_batch *batch, struct iopt_area *area,
 		batch_unpin(batch, pages, 0,
 			    batch_last_index - start_index + 1);
 		start_index = batch_last_index + 1;
+		if (pages->last_npinned - pages->npinned >=
+		    UNPIN_ACCOUNT_CHUNK) {
+			update_unpinned(pages);
+			cond_resched();
+		}
 
 		batch_clear_carry(batch,
 				  *unmapped_end_index - batch_last_index - 1);
@@ -1491,6 +1693,7 @@ int iopt_area_fill_domains(struct iopt_area *area, struct iopt_pages *pages)
  */
 void iopt_area_unfill_domains(struct iopt_area *area, struct iopt_pages *pages)
 {
+	struct iommu_iotlb_multi_gather multi;
 	struct io_pagetable *iopt = area->iopt;
 	struct iommu_domain *domain;
 	unsigned long index;
@@ -1501,11 +1704,27 @@ void iopt_area_unfill_domains(struct iopt_area *area, struct iopt_pages *pages)
 	if (!area->storage_domain)
 		goto out_unlock;
 
-	xa_for_each(&iopt->domains, index, domain)
-		if (domain != area->storage_domain)
-			iopt_area_unmap_domain_range(
-				area, domain, iopt_area_index(area),
-				iopt_area_last_index(area));
+	/*
+	 * The other domains are unmapped first so the PFNs can be unpinned
+	 * from the storage_domain. Their invalidations only have to complete
+	 * before that, so wait for all of them at once.
+	 */
+	iommu_iotlb_multi_gather_init(&multi);
+	xa_for_each(&iopt->domains, index, domain) {
+		struct iommu_iotlb_gather gather;
+		size_t unmapped;
+
+		if (domain == area->storage_domain)
+			continue;
+
+		iommu_iotlb_gather_init(&gather);
+		unmapped = iommu_unmap_fast(domain, iopt_area_iova(area),
+					    iopt_area_length(area), &gather);
+		iommu_iotlb_sync_add(&multi, domain, &gather);
+		/* See iommu_unmap_nofail() */
+		WARN_ON(unmapped != iopt_area_length(area));
+	}
+	iommu_iotlb_multi_sync(&multi);
 
 	interval_tree_remove(&area->pages_node, &pages->domains_itree);
 	iopt_area_unfill_domain(area, pages, area->storage_domain);
@@ -1775,6 +1994,21 @@ static int iopt_pages_rw_slow(struct iopt_pages *pages,
 	return rc;
 }
 
+/*
+ * iopt_pages_change_process() can replace source_mm, read it and take the
+ * reference under the mutex.
+ */
+static struct mm_struct *iopt_pages_get_mm(struct iopt_pages *pages)
+{
+	struct mm_struct *mm = NULL;
+
+	mutex_lock(&pages->mutex);
+	if (mmget_not_zero(pages->source_mm))
+		mm = pages->source_mm;
+	mutex_unlock(&pages->mutex);
+	return mm;
+}
+
 /*
  * A medium speed path that still allows DMA inconsistencies, but doesn't do any
  * memory allocations or interval tree searches.
@@ -1784,9 +2018,11 @@ static int iopt_pages_rw_page(struct iopt_pages *pages, unsigned long index,
 			      unsigned long length, unsigned int flags)
 {
 	struct page *page = NULL;
+	struct mm_struct *mm;
 	int rc;
 
-	if (!mmget_not_zero(pages->source_mm))
+	mm = iopt_pages_get_mm(pages);
+	if (!mm)
 		return iopt_pages_rw_slow(pages, index, index, offset, data,
 					  length, flags);
 
@@ -1795,12 +2031,11 @@ static int iopt_pages_rw_page(struct iopt_pages *pages, unsigned long index,
 		goto out_mmput;
 	}
 
-	mmap_read_lock(pages->source_mm);
+	mmap_read_lock(mm);
 	rc = pin_user_pages_remote(
-		pages->source_mm, (uintptr_t)(pages->uptr + index * PAGE_SIZE),
-		1, (flags & IOMMUFD_ACCESS_RW_WRITE) ? FOLL_WRITE : 0, &page,
-		NULL);
-	mmap_read_unlock(pages->source_mm);
+		mm, (uintptr_t)(pages->uptr + index * PAGE_SIZE), 1,
+		(flags & IOMMUFD_ACCESS_RW_WRITE) ? FOLL_WRITE : 0, &page, NULL);
+	mmap_read_unlock(mm);
 	if (rc != 1) {
 		if (WARN_ON(rc >= 0))
 			rc = -EINVAL;
@@ -1811,7 +2046,7 @@ static int iopt_pages_rw_page(struct iopt_pages *pages, unsigned long index,
 	rc = 0;
 
 out_mmput:
-	mmput(pages->source_mm);
+	mmput(mm);
 	return rc;
 }
 
@@ -1831,7 +2066,8 @@ int iopt_pages_rw_access(struct iopt_pages *pages, unsigned long start_byte,
 {
 	unsigned long start_index = start_byte / PAGE_SIZE;
 	unsigned long last_index = (start_byte + length - 1) / PAGE_SIZE;
-	bool change_mm = current->mm != pages->source_mm;
+	bool change_mm = current->mm != READ_ONCE(pages->source_mm);
+	struct mm_struct *mm = NULL;
 	int rc = 0;
 
 	if (IS_ENABLED(CONFIG_IOMMUFD_TEST) &&
@@ -1841,6 +2077,16 @@ int iopt_pages_rw_access(struct iopt_pages *pages, unsigned long start_byte,
 	if ((flags & IOMMUFD_ACCESS_RW_WRITE) && !pages->writable)
 		return -EPERM;
 
+	/* MMIO has no struct page to kmap */
+	if (pages->type == IOPT_ADDRESS_DMABUF)
+		return -EINVAL;
+
+	/* There is no VA to copy through, always go through the page cache */
+	if (pages->type == IOPT_ADDRESS_FILE)
+		return iopt_pages_rw_slow(pages, start_index, last_index,
+					  start_byte % PAGE_SIZE, data, length,
+					  flags);
+
 	if (!(flags & IOMMUFD_ACCESS_RW_KTHREAD) && change_mm) {
 		if (start_index == last_index)
 			return iopt_pages_rw_page(pages, start_index,
@@ -1856,12 +2102,13 @@ int iopt_pages_rw_access(struct iopt_pages *pages, unsigned long start_byte,
 	 * ignore any pinning inconsistencies, unlike a real DMA path.
 	 */
 	if (change_mm) {
-		if (!mmget_not_zero(pages->source_mm))
+		mm = iopt_pages_get_mm(pages);
+		if (!mm)
 			return iopt_pages_rw_slow(pages, start_index,
 						  last_index,
 						  start_byte % PAGE_SIZE, data,
 						  length, flags);
-		kthread_use_mm(pages->source_mm);
+		kthread_use_mm(mm);
 	}
 
 	if (flags & IOMMUFD_ACCESS_RW_WRITE) {
@@ -1873,8 +2120,8 @@ int iopt_pages_rw_access(struct iopt_pages *pages, unsigned long start_byte,
 	}
 
 	if (change_mm) {
-		kthread_unuse_mm(pages->source_mm);
-		mmput(pages->source_mm);
+		kthread_unuse_mm(mm);
+		mmput(mm);
 	}
 
 	return rc;
@@ -1921,6 +2168,10 @@ int iopt_area_add_access(struct iopt_area *area, unsigned long start_index,
 	if ((flags & IOMMUFD_ACCESS_RW_WRITE) && !pages->writable)
 		return -EPERM;
 
+	/* There are no struct pages to return for MMIO */
+	if (pages->type == IOPT_ADDRESS_DMABUF)
+		return -EINVAL;
+
 	mutex_lock(&pages->mutex);
 	access = iopt_pages_get_exact_access(pages, start_index, last_index);
 	if (access) {
@@ -1989,3 +2240,163 @@ void iopt_area_remove_access(struct iopt_area *area, unsigned long start_index,
 out_unlock:
 	mutex_unlock(&pages->mutex);
 }
+
+/*
+ * Check that the user VA of the pages maps, in the calling process, the same
+ * pages that are currently pinned. Only the ranges that are pinned need to
+ * match, the rest will be pinned from the calling process when it is used.
+ */
+static int iopt_pages_check_user(struct iopt_pages *pages,
+				 unsigned long start_index, unsigned long npages,
+				 struct page **expected, struct page **found)
+{
+	unsigned long i;
+	bool same = true;
+	int rc;
+
+	rc = get_user_pages_fast(
+		(uintptr_t)(pages->uptr + start_index * PAGE_SIZE), npages,
+		pages->writable ? FOLL_WRITE : 0, found);
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i != rc; i++) {
+		if (found[i] != expected[i])
+			same = false;
+		put_page(found[i]);
+	}
+	if (!same)
+		return -EINVAL;
+	if (rc != npages)
+		return -EFAULT;
+	return 0;
+}
+
+static int iopt_pages_check_process(struct iopt_pages *pages)
+{
+	const unsigned long chunk = PAGE_SIZE / sizeof(struct page *);
+	struct interval_tree_double_span_iter span;
+	struct page **expected;
+	struct page **found;
+	int rc = 0;
+
+	expected = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	found = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!expected || !found) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+
+	interval_tree_for_each_double_span(&span, &pages->access_itree,
+					   &pages->domains_itree, 0,
+					   pages->npages - 1) {
+		unsigned long index;
+
+		if (!span.is_used)
+			continue;
+
+		for (index = span.start_used; index <= span.last_used;
+		     index += chunk) {
+			unsigned long last =
+				min(span.last_used, index + chunk - 1);
+
+			if (span.is_used == 1) {
+				iopt_pages_fill_from_xarray(pages, index, last,
+							    expected);
+			} else {
+				rc = iopt_pages_fill_from_domain(pages, index,
+								 last, expected);
+				if (rc)
+					goto out_free;
+			}
+			rc = iopt_pages_check_user(pages, index,
+						   last - index + 1, expected,
+						   found);
+			if (rc)
+				goto out_free;
+			cond_resched();
+		}
+	}
+
+out_free:
+	kfree(found);
+	kfree(expected);
+	return rc;
+}
+
+static void iopt_pages_set_owner(struct iopt_pages *pages,
+				 struct task_struct *task, struct mm_struct *mm,
+				 struct user_struct *user)
+{
+	pages->source_task = task;
+	pages->source_mm = mm;
+	pages->source_user = user;
+}
+
+/*
+ * Charge the pinned pages to the calling process and uncharge them from the
+ * old owner. On failure the old owner keeps the charge.
+ */
+static int iopt_pages_change_owner(struct iopt_pages *pages)
+{
+	struct task_struct *old_task = pages->source_task;
+	struct user_struct *old_user = pages->source_user;
+	struct mm_struct *old_mm = pages->source_mm;
+	unsigned long npinned = pages->last_npinned;
+	int rc;
+
+	if (!npinned) {
+		/* Nothing is charged */
+	} else if (pages->account_mode != IOPT_PAGES_ACCOUNT_MM &&
+		   old_user == current_user()) {
+		/* locked_vm is charged to the user, only pinned_vm moves */
+		atomic64_sub(npinned, &old_mm->pinned_vm);
+		atomic64_add(npinned, &current->mm->pinned_vm);
+	} else {
+		iopt_pages_set_owner(pages, current->group_leader, current->mm,
+				     current_user());
+		rc = do_update_pinned(pages, npinned, true, NULL);
+		iopt_pages_set_owner(pages, old_task, old_mm, old_user);
+		if (rc)
+			return rc;
+		/* Fails if the old mm is gone, there is nothing to uncharge */
+		do_update_pinned(pages, npinned, false, NULL);
+	}
+
+	mmgrab(current->mm);
+	iopt_pages_set_owner(pages, get_task_struct(current->group_leader),
+			     current->mm, get_uid(current_user()));
+	put_task_struct(old_task);
+	mmdrop(old_mm);
+	free_uid(old_user);
+	return 0;
+}
+
+/**
+ * iopt_pages_change_process() - Make the calling process own the pages
+ * @pages: The pages to move
+ *
+ * Future pins are made from the calling process and the pages that are already
+ * pinned are charged to it. For user VA pages the calling process must map the
+ * pinned pages at the same VA, this is checked page by page but nothing is
+ * pinned, unpinned or remapped in the domains. Pages that already belong to
+ * the calling process are left alone, so a failed call can be retried.
+ */
+int iopt_pages_change_process(struct iopt_pages *pages)
+{
+	int rc = 0;
+
+	mutex_lock(&pages->mutex);
+	if (pages->source_mm == current->mm)
+		goto out_unlock;
+
+	if (pages->type == IOPT_ADDRESS_USER) {
+		rc = iopt_pages_check_process(pages);
+		if (rc)
+			goto out_unlock;
+	}
+	rc = iopt_pages_change_owner(pages);
+out_unlock:
+	mutex_unlock(&pages->mutex);
+	return rc;
+}
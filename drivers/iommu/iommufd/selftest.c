@@ -4,6 +4,7 @@
  * Kernel side components to support tools/testing/selftests/iommu
  */
 #include <linux/slab.h>
+#include <linux/dma-buf.h>
 #include <linux/iommu.h>
 #include <linux/xarray.h>
 #include <linux/file.h>
@@ -391,6 +392,24 @@ static phys_addr_t mock_domain_iova_to_phys(struct iommu_domain *domain,
 	return (xa_to_value(ent) & MOCK_PFN_MASK) * MOCK_IO_PAGE_SIZE;
 }
 
+/*
+ * The mock only has one page size so nothing ever collapses, but check that
+ * iommufd only asks for fully mapped ranges.
+ */
+static size_t mock_domain_collapse_pages(struct iommu_domain *domain,
+					 unsigned long iova, size_t size,
+					 struct iommu_iotlb_gather *gather)
+{
+	struct mock_iommu_domain *mock =
+		container_of(domain, struct mock_iommu_domain, domain);
+	unsigned long cur;
+
+	WARN_ON(iova % MOCK_IO_PAGE_SIZE || size % MOCK_IO_PAGE_SIZE);
+	for (cur = iova; cur != iova + size; cur += MOCK_IO_PAGE_SIZE)
+		WARN_ON(!xa_load(&mock->pfns, cur / MOCK_IO_PAGE_SIZE));
+	return 0;
+}
+
 static bool mock_domain_capable(struct device *dev, enum iommu_cap cap)
 {
 	return cap == IOMMU_CAP_CACHE_COHERENCY;
@@ -478,6 +497,7 @@ static const struct iommu_ops mock_ops = {
 			.attach_dev = mock_domain_nop_attach,
 			.map_pages = mock_domain_map_pages,
 			.unmap_pages = mock_domain_unmap_pages,
+			.collapse_pages = mock_domain_collapse_pages,
 			.iova_to_phys = mock_domain_iova_to_phys,
 			.set_dev_pasid = mock_domain_set_dev_pasid_nop,
 		},
@@ -807,6 +827,9 @@ static int iommufd_test_md_check_refs(struct iommufd_ucmd *ucmd,
 	    check_add_overflow((uintptr_t)uptr, (uintptr_t)length, &end))
 		return -EINVAL;
 
+	/* Let contexts closed with IOMMU_OPTION_ASYNC_RELEASE finish unpinning */
+	iommufd_flush_release();
+
 	for (; length; length -= PAGE_SIZE) {
 		struct page *pages[1];
 		long npages;
@@ -1337,6 +1360,74 @@ static int iommufd_test_pasid_check_domain(struct iommufd_ucmd *ucmd,
 	return rc;
 }
 
+/*
+ * A dma-buf that pretends to export a BAR at MOCK_DMABUF_PHYS. Only the mock
+ * domain ever sees the address, nothing accesses it.
+ */
+static struct sg_table *
+iommufd_test_dmabuf_map(struct dma_buf_attachment *attachment,
+			enum dma_data_direction dir)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+static void iommufd_test_dmabuf_unmap(struct dma_buf_attachment *attachment,
+				      struct sg_table *sgt,
+				      enum dma_data_direction dir)
+{
+}
+
+static int iommufd_test_dmabuf_get_mmio_range(struct dma_buf *dmabuf,
+					      phys_addr_t *phys, size_t *size)
+{
+	*phys = MOCK_DMABUF_PHYS;
+	*size = dmabuf->size;
+	return 0;
+}
+
+static void iommufd_test_dmabuf_release(struct dma_buf *dmabuf)
+{
+}
+
+static const struct dma_buf_ops iommufd_test_dmabuf_ops = {
+	.map_dma_buf = iommufd_test_dmabuf_map,
+	.unmap_dma_buf = iommufd_test_dmabuf_unmap,
+	.get_mmio_range = iommufd_test_dmabuf_get_mmio_range,
+	.release = iommufd_test_dmabuf_release,
+};
+
+static int iommufd_test_dmabuf_get(struct iommufd_ucmd *ucmd,
+				   struct iommu_test_cmd *cmd)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+	int rc;
+
+	if (!cmd->dmabuf_get.length ||
+	    cmd->dmabuf_get.length % PAGE_SIZE ||
+	    cmd->dmabuf_get.length > SZ_1G ||
+	    cmd->dmabuf_get.open_flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	exp_info.ops = &iommufd_test_dmabuf_ops;
+	exp_info.size = cmd->dmabuf_get.length;
+	exp_info.flags = O_RDWR | cmd->dmabuf_get.open_flags;
+	/* Not used, but dma_buf_export() insists on a priv */
+	exp_info.priv = ucmd->ictx;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	rc = dma_buf_fd(dmabuf, cmd->dmabuf_get.open_flags);
+	if (rc < 0) {
+		dma_buf_put(dmabuf);
+		return rc;
+	}
+	cmd->dmabuf_get.out_fd = rc;
+	return iommufd_ucmd_respond(ucmd, sizeof(*cmd));
+}
+
 void iommufd_selftest_destroy(struct iommufd_object *obj)
 {
 	struct selftest_obj *sobj = container_of(obj, struct selftest_obj, obj);
@@ -1416,6 +1507,8 @@ int iommufd_test(struct iommufd_ucmd *ucmd)
 		return iommufd_test_pasid_detach(ucmd, cmd);
 	case IOMMU_TEST_OP_PASID_CHECK_DOMAIN:
 		return iommufd_test_pasid_check_domain(ucmd, cmd);
+	case IOMMU_TEST_OP_DMABUF_GET:
+		return iommufd_test_dmabuf_get(ucmd, cmd);
 	default:
 		return -EOPNOTSUPP;
 	}
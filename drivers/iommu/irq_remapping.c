@@ -158,3 +158,39 @@ void panic_if_irq_remap(const char *msg)
 	if (irq_remapping_enabled)
 		panic(msg);
 }
+
+DEFINE_PER_CPU(unsigned int, irq_remap_batch_depth);
+
+/**
+ * irq_remapping_batch_begin - Start a batch of remapping entry updates
+ *
+ * Until the matching irq_remapping_batch_end() the entries modified by this
+ * CPU are written but the interrupt entry cache of the remapping hardware is
+ * not invalidated for each of them. irq_remapping_batch_end() invalidates all
+ * of them at once, for instance as one ranged invalidation per IOMMU.
+ *
+ * Interrupts may keep being delivered through the old entries until the batch
+ * ends. The caller must have preemption disabled for the whole batch and must
+ * cope with interrupts still arriving at the old destination, like
+ * fixup_irqs() does for the CPU going offline.
+ */
+void irq_remapping_batch_begin(void)
+{
+	lockdep_assert_preemption_disabled();
+	this_cpu_inc(irq_remap_batch_depth);
+}
+
+/**
+ * irq_remapping_batch_end - Flush the updates of a batch
+ */
+void irq_remapping_batch_end(void)
+{
+	lockdep_assert_preemption_disabled();
+	if (WARN_ON(!this_cpu_read(irq_remap_batch_depth)))
+		return;
+	if (this_cpu_dec_return(irq_remap_batch_depth))
+		return;
+
+	if (irq_remapping_enabled && remap_ops->batch_flush)
+		remap_ops->batch_flush();
+}
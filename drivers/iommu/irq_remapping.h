@@ -12,6 +12,8 @@
 
 #ifdef CONFIG_IRQ_REMAP
 
+#include <linux/percpu.h>
+
 struct irq_data;
 struct msi_msg;
 struct irq_domain;
@@ -42,8 +44,22 @@ struct irq_remap_ops {
 
 	/* Enable fault handling */
 	int  (*enable_faulting)(void);
+
+	/* Flushes the entries left modified by a batch of updates */
+	void (*batch_flush)(void);
 };
 
+DECLARE_PER_CPU(unsigned int, irq_remap_batch_depth);
+
+/*
+ * True when an entry modified by this CPU may skip the cache flush and leave
+ * it to the batch_flush callback, see irq_remapping_batch_begin().
+ */
+static inline bool irq_remapping_batched(void)
+{
+	return this_cpu_read(irq_remap_batch_depth);
+}
+
 extern struct irq_remap_ops intel_irq_remap_ops;
 extern struct irq_remap_ops amd_iommu_irq_ops;
 extern struct irq_remap_ops hyperv_irq_remap_ops;
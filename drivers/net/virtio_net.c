@@ -19,6 +19,7 @@
 #include <linux/average.h>
 #include <linux/filter.h>
 #include <linux/kernel.h>
+#include <linux/dma-mapping.h>
 #include <net/route.h>
 #include <net/xdp.h>
 #include <net/net_failover.h>
@@ -46,6 +47,13 @@ module_param(napi_tx, bool, 0644);
 #define VIRTIO_XDP_REDIR	BIT(1)
 
 #define VIRTIO_XDP_FLAG	BIT(0)
+#define VIRTIO_SLOT_FLAG	BIT(1)
+
+/* Linear skbs that fit a slot, virtio header included, are copied into
+ * pre-mapped TX memory instead of being DMA mapped one by one.
+ */
+#define VIRTNET_SQ_SLOT_SIZE	2048
+#define VIRTNET_SQ_MAX_SLOTS	256
 
 /* RX packet size EWMA. The average packet size is used to determine the packet
  * buffer size when refilling RX rings. As the entire RX ring may be refilled
@@ -140,6 +148,14 @@ struct virtnet_rq_dma {
 	u16 need_sync;
 };
 
+/* A pre-mapped TX copy buffer, see virtnet_sq_alloc_slots(). */
+struct virtnet_sq_slot {
+	struct sk_buff *skb;
+	struct virtnet_sq_slot *next;
+	void *buf;
+	dma_addr_t addr;
+};
+
 /* Internal representation of a send virtqueue */
 struct send_queue {
 	/* Virtqueue associated with this send _queue */
@@ -159,6 +175,11 @@ struct send_queue {
 
 	/* Record whether sq is in reset state. */
 	bool reset;
+
+	/* Pre-mapped copy buffers, NULL when every skb is mapped on xmit */
+	struct virtnet_sq_slot *slots;
+	unsigned int num_slots;
+	struct virtnet_sq_slot *free_slots;
 };
 
 /* Internal representation of a receive virtqueue */
@@ -352,6 +373,28 @@ static struct xdp_frame *ptr_to_xdp(void *ptr)
 	return (struct xdp_frame *)((unsigned long)ptr & ~VIRTIO_XDP_FLAG);
 }
 
+static bool is_sq_slot(void *ptr)
+{
+	return (unsigned long)ptr & VIRTIO_SLOT_FLAG;
+}
+
+static void *sq_slot_to_ptr(struct virtnet_sq_slot *slot)
+{
+	return (void *)((unsigned long)slot | VIRTIO_SLOT_FLAG);
+}
+
+/* Give a completed slot back to the sq and return the skb it carried */
+static struct sk_buff *virtnet_sq_put_slot(struct send_queue *sq, void *ptr)
+{
+	struct virtnet_sq_slot *slot;
+
+	slot = (struct virtnet_sq_slot *)((unsigned long)ptr & ~VIRTIO_SLOT_FLAG);
+	slot->next = sq->free_slots;
+	sq->free_slots = slot;
+
+	return slot->skb;
+}
+
 /* Converting between virtqueue no. and kernel tx/rx queue no.
  * 0:rx0 1:tx0 2:rx1 3:tx1 ... 2N:rxN 2N+1:txN 2N+2:cvq
  */
@@ -744,6 +787,105 @@ static void virtnet_rq_set_premapped(struct virtnet_info *vi)
 	}
 }
 
+static void virtnet_sq_unmap_slots(struct send_queue *sq,
+				   struct virtnet_sq_slot *slots,
+				   unsigned int num)
+{
+	unsigned int per_page = PAGE_SIZE / VIRTNET_SQ_SLOT_SIZE;
+	unsigned int i;
+
+	for (i = 0; i < num; i += per_page) {
+		virtqueue_dma_unmap_single_attrs(sq->vq, slots[i].addr,
+						 PAGE_SIZE, DMA_TO_DEVICE, 0);
+		free_page((unsigned long)slots[i].buf);
+	}
+}
+
+/* Map a ring's worth of TX copy buffers once, a page at a time. */
+static int virtnet_sq_alloc_slots(struct send_queue *sq)
+{
+	unsigned int per_page = PAGE_SIZE / VIRTNET_SQ_SLOT_SIZE;
+	struct device *dma_dev = virtqueue_dma_dev(sq->vq);
+	struct virtnet_sq_slot *slots;
+	unsigned int num, i;
+	dma_addr_t addr;
+	void *buf;
+
+	/* Copying only pays off when every mapping costs IOMMU work */
+	if (!dma_dev || !dma_get_merge_boundary(dma_dev))
+		return -EOPNOTSUPP;
+
+	num = min_t(unsigned int, virtqueue_get_vring_size(sq->vq),
+		    VIRTNET_SQ_MAX_SLOTS);
+	num = rounddown(num, per_page);
+	if (!num)
+		return -EOPNOTSUPP;
+
+	slots = kcalloc(num, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		if (i % per_page) {
+			slots[i].buf = slots[i - 1].buf + VIRTNET_SQ_SLOT_SIZE;
+			slots[i].addr = slots[i - 1].addr + VIRTNET_SQ_SLOT_SIZE;
+			continue;
+		}
+
+		buf = (void *)__get_free_page(GFP_KERNEL);
+		if (!buf)
+			goto err;
+
+		addr = virtqueue_dma_map_single_attrs(sq->vq, buf, PAGE_SIZE,
+						      DMA_TO_DEVICE, 0);
+		if (virtqueue_dma_mapping_error(sq->vq, addr)) {
+			free_page((unsigned long)buf);
+			goto err;
+		}
+
+		slots[i].buf = buf;
+		slots[i].addr = addr;
+	}
+
+	for (i = 0; i < num; i++) {
+		slots[i].next = sq->free_slots;
+		sq->free_slots = &slots[i];
+	}
+	sq->slots = slots;
+	sq->num_slots = num;
+	return 0;
+
+err:
+	virtnet_sq_unmap_slots(sq, slots, i);
+	kfree(slots);
+	return -ENOMEM;
+}
+
+static void virtnet_sq_free_slots(struct send_queue *sq)
+{
+	if (!sq->slots)
+		return;
+
+	virtnet_sq_unmap_slots(sq, sq->slots, sq->num_slots);
+	kfree(sq->slots);
+	sq->slots = NULL;
+	sq->num_slots = 0;
+	sq->free_slots = NULL;
+}
+
+static void virtnet_sq_set_premapped(struct virtnet_info *vi)
+{
+	int i;
+
+	/* The header and the packet share one slot, that is one descriptor */
+	if (!vi->any_header_sg)
+		return;
+
+	/* Queues that fail to set up slots just map every skb */
+	for (i = 0; i < vi->max_queue_pairs; i++)
+		virtnet_sq_alloc_slots(&vi->sq[i]);
+}
+
 static void free_old_xmit_skbs(struct send_queue *sq, bool in_napi)
 {
 	unsigned int len;
@@ -752,6 +894,9 @@ static void free_old_xmit_skbs(struct send_queue *sq, bool in_napi)
 	void *ptr;
 
 	while ((ptr = virtqueue_get_buf(sq->vq, &len)) != NULL) {
+		if (is_sq_slot(ptr))
+			ptr = virtnet_sq_put_slot(sq, ptr);
+
 		if (likely(!is_xdp_frame(ptr))) {
 			struct sk_buff *skb = ptr;
 
@@ -943,6 +1088,9 @@ static int virtnet_xdp_xmit(struct net_device *dev,
 
 	/* Free up any pending old buffers before queueing new ones. */
 	while ((ptr = virtqueue_get_buf(sq->vq, &len)) != NULL) {
+		if (is_sq_slot(ptr))
+			ptr = virtnet_sq_put_slot(sq, ptr);
+
 		if (likely(is_xdp_frame(ptr))) {
 			struct xdp_frame *frame = ptr_to_xdp(ptr);
 
@@ -2274,6 +2422,36 @@ static int virtnet_poll_tx(struct napi_struct *napi, int budget)
 	return 0;
 }
 
+/* Copy a linear skb into a pre-mapped slot. The skb itself stays queued
+ * until completion so socket and BQL accounting are unchanged, but the
+ * device only ever sees the slot and nothing gets mapped per packet.
+ */
+static int virtnet_xmit_slot(struct send_queue *sq, struct sk_buff *skb,
+			     const void *hdr, unsigned int hdr_len)
+{
+	struct virtnet_sq_slot *slot = sq->free_slots;
+	unsigned int len = hdr_len + skb->len;
+	int err;
+
+	memcpy(slot->buf, hdr, hdr_len);
+	memcpy(slot->buf + hdr_len, skb->data, skb->len);
+	virtqueue_dma_sync_single_range_for_device(sq->vq, slot->addr, 0, len,
+						   DMA_TO_DEVICE);
+
+	sg_init_table(sq->sg, 1);
+	sq->sg[0].dma_address = slot->addr;
+	sq->sg[0].length = len;
+
+	slot->skb = skb;
+	err = virtqueue_add_outbuf_premapped(sq->vq, sq->sg, 1,
+					     sq_slot_to_ptr(slot), GFP_ATOMIC);
+	if (err)
+		return err;
+
+	sq->free_slots = slot->next;
+	return 0;
+}
+
 static int xmit_skb(struct send_queue *sq, struct sk_buff *skb)
 {
 	struct virtio_net_hdr_mrg_rxbuf *hdr;
@@ -2303,6 +2481,10 @@ static int xmit_skb(struct send_queue *sq, struct sk_buff *skb)
 	if (vi->mergeable_rx_bufs)
 		hdr->num_buffers = 0;
 
+	if (sq->free_slots && !skb_is_nonlinear(skb) &&
+	    hdr_len + skb->len <= VIRTNET_SQ_SLOT_SIZE)
+		return virtnet_xmit_slot(sq, skb, hdr, hdr_len);
+
 	sg_init_table(sq->sg, skb_shinfo(skb)->nr_frags + (can_push ? 1 : 2));
 	if (can_push) {
 		__skb_push(skb, hdr_len);
@@ -3987,6 +4169,11 @@ static void free_receive_page_frags(struct virtnet_info *vi)
 
 static void virtnet_sq_free_unused_buf(struct virtqueue *vq, void *buf)
 {
+	struct virtnet_info *vi = vq->vdev->priv;
+
+	if (is_sq_slot(buf))
+		buf = virtnet_sq_put_slot(&vi->sq[vq2txq(vq)], buf);
+
 	if (!is_xdp_frame(buf))
 		dev_kfree_skb(buf);
 	else
@@ -4030,6 +4217,10 @@ static void free_unused_bufs(struct virtnet_info *vi)
 static void virtnet_del_vqs(struct virtnet_info *vi)
 {
 	struct virtio_device *vdev = vi->vdev;
+	int i;
+
+	for (i = 0; i < vi->max_queue_pairs; i++)
+		virtnet_sq_free_slots(&vi->sq[i]);
 
 	virtnet_clean_affinity(vi);
 
@@ -4197,6 +4388,7 @@ static int init_vqs(struct virtnet_info *vi)
 		goto err_free;
 
 	virtnet_rq_set_premapped(vi);
+	virtnet_sq_set_premapped(vi);
 
 	cpus_read_lock();
 	virtnet_set_affinity(vi);
@@ -182,6 +182,21 @@ static inline struct nvme_dev *to_nvme_dev(struct nvme_ctrl *ctrl)
 	return container_of(ctrl, struct nvme_dev, ctrl);
 }
 
+/*
+ * PRP and SGL list chunks recycled per queue, so that the I/O path does not
+ * contend on the device wide dma_pool lock for every request. This only
+ * covers the list chunks: data buffers are still mapped per request with
+ * dma_map_sgtable(), and their IOVAs come from the IOMMU's own caches.
+ */
+#define NVME_DESC_CACHE_SIZE	16
+
+struct nvme_desc_cache {
+	spinlock_t lock;
+	unsigned int nr;
+	void *vaddr[NVME_DESC_CACHE_SIZE];
+	dma_addr_t dma[NVME_DESC_CACHE_SIZE];
+};
+
 /*
  * An NVM Express queue.  Each device has at least two (one for admin
  * commands and one for I/O commands).
@@ -214,6 +229,8 @@ struct nvme_queue {
 	__le32 *dbbuf_sq_ei;
 	__le32 *dbbuf_cq_ei;
 	struct completion delete_done;
+	struct nvme_desc_cache small_descs;
+	struct nvme_desc_cache page_descs;
 };
 
 union nvme_descriptor {
@@ -231,6 +248,7 @@ struct nvme_iod {
 	struct nvme_request req;
 	struct nvme_command cmd;
 	bool aborted;
+	bool dma_cached;	/* data uses a cached mapping, don't unmap */
 	s8 nr_allocations;	/* PRP list pool allocations. 0 means small
 				   pool in use */
 	unsigned int dma_len;	/* length of single DMA segment mapping */
@@ -521,10 +539,73 @@ static inline bool nvme_pci_use_sgls(struct nvme_dev *dev, struct request *req,
 	return true;
 }
 
+static inline struct nvme_desc_cache *nvme_desc_cache(struct nvme_queue *nvmeq,
+						      bool small)
+{
+	return small ? &nvmeq->small_descs : &nvmeq->page_descs;
+}
+
+static inline struct dma_pool *nvme_desc_pool(struct nvme_dev *dev, bool small)
+{
+	return small ? dev->prp_small_pool : dev->prp_page_pool;
+}
+
+static void *nvme_desc_alloc(struct nvme_dev *dev, struct nvme_queue *nvmeq,
+		bool small, dma_addr_t *dma_addr)
+{
+	struct nvme_desc_cache *cache = nvme_desc_cache(nvmeq, small);
+	unsigned long flags;
+	void *vaddr = NULL;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (cache->nr) {
+		cache->nr--;
+		vaddr = cache->vaddr[cache->nr];
+		*dma_addr = cache->dma[cache->nr];
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (vaddr)
+		return vaddr;
+	return dma_pool_alloc(nvme_desc_pool(dev, small), GFP_ATOMIC, dma_addr);
+}
+
+static void nvme_desc_free(struct nvme_dev *dev, struct nvme_queue *nvmeq,
+		bool small, void *vaddr, dma_addr_t dma_addr)
+{
+	struct nvme_desc_cache *cache = nvme_desc_cache(nvmeq, small);
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (cache->nr < NVME_DESC_CACHE_SIZE) {
+		cache->vaddr[cache->nr] = vaddr;
+		cache->dma[cache->nr] = dma_addr;
+		cache->nr++;
+		vaddr = NULL;
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (vaddr)
+		dma_pool_free(nvme_desc_pool(dev, small), vaddr, dma_addr);
+}
+
+static void nvme_desc_cache_drain(struct nvme_dev *dev,
+		struct nvme_queue *nvmeq, bool small)
+{
+	struct nvme_desc_cache *cache = nvme_desc_cache(nvmeq, small);
+
+	while (cache->nr) {
+		cache->nr--;
+		dma_pool_free(nvme_desc_pool(dev, small),
+			      cache->vaddr[cache->nr], cache->dma[cache->nr]);
+	}
+}
+
 static void nvme_free_prps(struct nvme_dev *dev, struct request *req)
 {
 	const int last_prp = NVME_CTRL_PAGE_SIZE / sizeof(__le64) - 1;
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	struct nvme_queue *nvmeq = req->mq_hctx->driver_data;
 	dma_addr_t dma_addr = iod->first_dma;
 	int i;
 
@@ -532,7 +613,7 @@ static void nvme_free_prps(struct nvme_dev *dev, struct request *req)
 		__le64 *prp_list = iod->list[i].prp_list;
 		dma_addr_t next_dma_addr = le64_to_cpu(prp_list[last_prp]);
 
-		dma_pool_free(dev->prp_page_pool, prp_list, dma_addr);
+		nvme_desc_free(dev, nvmeq, false, prp_list, dma_addr);
 		dma_addr = next_dma_addr;
 	}
 }
@@ -540,6 +621,7 @@ static void nvme_free_prps(struct nvme_dev *dev, struct request *req)
 static void nvme_unmap_data(struct nvme_dev *dev, struct request *req)
 {
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	struct nvme_queue *nvmeq = req->mq_hctx->driver_data;
 
 	if (iod->dma_len) {
 		dma_unmap_page(dev->dev, iod->first_dma, iod->dma_len,
@@ -549,14 +631,15 @@ static void nvme_unmap_data(struct nvme_dev *dev, struct request *req)
 
 	WARN_ON_ONCE(!iod->sgt.nents);
 
-	dma_unmap_sgtable(dev->dev, &iod->sgt, rq_dma_dir(req), 0);
+	if (!iod->dma_cached)
+		dma_unmap_sgtable(dev->dev, &iod->sgt, rq_dma_dir(req), 0);
 
 	if (iod->nr_allocations == 0)
-		dma_pool_free(dev->prp_small_pool, iod->list[0].sg_list,
-			      iod->first_dma);
+		nvme_desc_free(dev, nvmeq, true, iod->list[0].sg_list,
+			       iod->first_dma);
 	else if (iod->nr_allocations == 1)
-		dma_pool_free(dev->prp_page_pool, iod->list[0].sg_list,
-			      iod->first_dma);
+		nvme_desc_free(dev, nvmeq, false, iod->list[0].sg_list,
+			       iod->first_dma);
 	else
 		nvme_free_prps(dev, req);
 	mempool_free(iod->sgt.sgl, dev->iod_mempool);
@@ -580,7 +663,7 @@ static blk_status_t nvme_pci_setup_prps(struct nvme_dev *dev,
 		struct request *req, struct nvme_rw_command *cmnd)
 {
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
-	struct dma_pool *pool;
+	struct nvme_queue *nvmeq = req->mq_hctx->driver_data;
 	int length = blk_rq_payload_bytes(req);
 	struct scatterlist *sg = iod->sgt.sgl;
 	int dma_len = sg_dma_len(sg);
@@ -589,6 +672,7 @@ static blk_status_t nvme_pci_setup_prps(struct nvme_dev *dev,
 	__le64 *prp_list;
 	dma_addr_t prp_dma;
 	int nprps, i;
+	bool small;
 
 	length -= (NVME_CTRL_PAGE_SIZE - offset);
 	if (length <= 0) {
@@ -611,15 +695,10 @@ static blk_status_t nvme_pci_setup_prps(struct nvme_dev *dev,
 	}
 
 	nprps = DIV_ROUND_UP(length, NVME_CTRL_PAGE_SIZE);
-	if (nprps <= (256 / 8)) {
-		pool = dev->prp_small_pool;
-		iod->nr_allocations = 0;
-	} else {
-		pool = dev->prp_page_pool;
-		iod->nr_allocations = 1;
-	}
+	small = nprps <= (256 / 8);
+	iod->nr_allocations = small ? 0 : 1;
 
-	prp_list = dma_pool_alloc(pool, GFP_ATOMIC, &prp_dma);
+	prp_list = nvme_desc_alloc(dev, nvmeq, small, &prp_dma);
 	if (!prp_list) {
 		iod->nr_allocations = -1;
 		return BLK_STS_RESOURCE;
@@ -630,7 +709,7 @@ static blk_status_t nvme_pci_setup_prps(struct nvme_dev *dev,
 	for (;;) {
 		if (i == NVME_CTRL_PAGE_SIZE >> 3) {
 			__le64 *old_prp_list = prp_list;
-			prp_list = dma_pool_alloc(pool, GFP_ATOMIC, &prp_dma);
+			prp_list = nvme_desc_alloc(dev, nvmeq, small, &prp_dma);
 			if (!prp_list)
 				goto free_prps;
 			iod->list[iod->nr_allocations++].prp_list = prp_list;
@@ -686,11 +765,12 @@ static blk_status_t nvme_pci_setup_sgls(struct nvme_dev *dev,
 		struct request *req, struct nvme_rw_command *cmd)
 {
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
-	struct dma_pool *pool;
+	struct nvme_queue *nvmeq = req->mq_hctx->driver_data;
 	struct nvme_sgl_desc *sg_list;
 	struct scatterlist *sg = iod->sgt.sgl;
 	unsigned int entries = iod->sgt.nents;
 	dma_addr_t sgl_dma;
+	bool small;
 	int i = 0;
 
 	/* setting the transfer type as SGL */
@@ -701,15 +781,10 @@ static blk_status_t nvme_pci_setup_sgls(struct nvme_dev *dev,
 		return BLK_STS_OK;
 	}
 
-	if (entries <= (256 / sizeof(struct nvme_sgl_desc))) {
-		pool = dev->prp_small_pool;
-		iod->nr_allocations = 0;
-	} else {
-		pool = dev->prp_page_pool;
-		iod->nr_allocations = 1;
-	}
+	small = entries <= (256 / sizeof(struct nvme_sgl_desc));
+	iod->nr_allocations = small ? 0 : 1;
 
-	sg_list = dma_pool_alloc(pool, GFP_ATOMIC, &sgl_dma);
+	sg_list = nvme_desc_alloc(dev, nvmeq, small, &sgl_dma);
 	if (!sg_list) {
 		iod->nr_allocations = -1;
 		return BLK_STS_RESOURCE;
@@ -766,13 +841,47 @@ static blk_status_t nvme_setup_sgl_simple(struct nvme_dev *dev,
 	return BLK_STS_OK;
 }
 
+static blk_status_t nvme_map_data_cached(struct nvme_dev *dev,
+		struct request *req, struct nvme_command *cmnd,
+		dma_addr_t dma_addr)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	unsigned int len = blk_rq_payload_bytes(req);
+	blk_status_t ret;
+
+	iod->dma_len = 0;
+	iod->sgt.sgl = mempool_alloc(dev->iod_mempool, GFP_ATOMIC);
+	if (!iod->sgt.sgl)
+		return BLK_STS_RESOURCE;
+	sg_init_table(iod->sgt.sgl, 1);
+	iod->sgt.sgl->length = len;
+	sg_dma_address(iod->sgt.sgl) = dma_addr;
+	sg_dma_len(iod->sgt.sgl) = len;
+	iod->sgt.orig_nents = 1;
+	iod->sgt.nents = 1;
+	iod->dma_cached = true;
+
+	if (nvme_pci_use_sgls(dev, req, 1))
+		ret = nvme_pci_setup_sgls(dev, req, &cmnd->rw);
+	else
+		ret = nvme_pci_setup_prps(dev, req, &cmnd->rw);
+	if (ret != BLK_STS_OK)
+		mempool_free(iod->sgt.sgl, dev->iod_mempool);
+	return ret;
+}
+
 static blk_status_t nvme_map_data(struct nvme_dev *dev, struct request *req,
 		struct nvme_command *cmnd)
 {
 	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
 	blk_status_t ret = BLK_STS_RESOURCE;
+	dma_addr_t dma_addr;
 	int rc;
 
+	/* Registered buffers already mapped for this device skip the IOMMU */
+	if (blk_rq_dma_map_cached(req, dev->dev, &dma_addr))
+		return nvme_map_data_cached(dev, req, cmnd, dma_addr);
+
 	if (blk_rq_nr_phys_segments(req) == 1) {
 		struct nvme_queue *nvmeq = req->mq_hctx->driver_data;
 		struct bio_vec bv = req_bvec(req);
@@ -840,6 +949,7 @@ static blk_status_t nvme_prep_rq(struct nvme_dev *dev, struct request *req)
 	blk_status_t ret;
 
 	iod->aborted = false;
+	iod->dma_cached = false;
 	iod->nr_allocations = -1;
 	iod->sgt.nents = 0;
 
@@ -1399,6 +1509,9 @@ static enum blk_eh_timer_return nvme_timeout(struct request *req)
 
 static void nvme_free_queue(struct nvme_queue *nvmeq)
 {
+	nvme_desc_cache_drain(nvmeq->dev, nvmeq, true);
+	nvme_desc_cache_drain(nvmeq->dev, nvmeq, false);
+
 	dma_free_coherent(nvmeq->dev->dev, CQ_SIZE(nvmeq),
 				(void *)nvmeq->cqes, nvmeq->cq_dma_addr);
 	if (!nvmeq->sq_cmds)
@@ -1536,6 +1649,8 @@ static int nvme_alloc_queue(struct nvme_dev *dev, int qid, int depth)
 	nvmeq->dev = dev;
 	spin_lock_init(&nvmeq->sq_lock);
 	spin_lock_init(&nvmeq->cq_poll_lock);
+	spin_lock_init(&nvmeq->small_descs.lock);
+	spin_lock_init(&nvmeq->page_descs.lock);
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
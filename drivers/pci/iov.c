@@ -7,6 +7,7 @@
  * Copyright (C) 2009 Intel Corporation, Yu Zhao <yu.zhao@intel.com>
  */
 
+#include <linux/iommu.h>
 #include <linux/pci.h>
 #include <linux/slab.h>
 #include <linux/export.h>
@@ -285,7 +286,7 @@ const struct attribute_group sriov_vf_dev_attr_group = {
 	.is_visible = sriov_vf_attrs_are_visible,
 };
 
-int pci_iov_add_virtfn(struct pci_dev *dev, int id)
+static struct pci_dev *pci_iov_scan_virtfn(struct pci_dev *dev, int id)
 {
 	int i;
 	int rc = -ENOMEM;
@@ -338,9 +339,7 @@ int pci_iov_add_virtfn(struct pci_dev *dev, int id)
 	if (rc)
 		goto failed1;
 
-	pci_bus_add_device(virtfn);
-
-	return 0;
+	return virtfn;
 
 failed1:
 	pci_stop_and_remove_bus_device(virtfn);
@@ -349,7 +348,20 @@ int pci_iov_add_virtfn(struct pci_dev *dev, int id)
 	virtfn_remove_bus(dev->bus, bus);
 failed:
 
-	return rc;
+	return ERR_PTR(rc);
+}
+
+int pci_iov_add_virtfn(struct pci_dev *dev, int id)
+{
+	struct pci_dev *virtfn;
+
+	virtfn = pci_iov_scan_virtfn(dev, id);
+	if (IS_ERR(virtfn))
+		return PTR_ERR(virtfn);
+
+	pci_bus_add_device(virtfn);
+
+	return 0;
 }
 
 void pci_iov_remove_virtfn(struct pci_dev *dev, int id)
@@ -575,16 +587,38 @@ int __weak pcibios_sriov_disable(struct pci_dev *pdev)
 
 static int sriov_add_vfs(struct pci_dev *dev, u16 num_vfs)
 {
+	struct pci_dev *virtfn;
 	unsigned int i;
 	int rc;
 
 	if (dev->no_vf_scan)
 		return 0;
 
+	/*
+	 * Let the IOMMU layer set up all the VFs at once, their drivers are
+	 * only bound once it is done.
+	 */
+	iommu_probe_batch_begin(&dev->dev);
 	for (i = 0; i < num_vfs; i++) {
-		rc = pci_iov_add_virtfn(dev, i);
-		if (rc)
+		virtfn = pci_iov_scan_virtfn(dev, i);
+		if (IS_ERR(virtfn)) {
+			rc = PTR_ERR(virtfn);
+			iommu_probe_batch_end(&dev->dev);
 			goto failed;
+		}
+	}
+	rc = iommu_probe_batch_end(&dev->dev);
+	if (rc)
+		goto failed;
+
+	for (i = 0; i < num_vfs; i++) {
+		virtfn = pci_get_domain_bus_and_slot(pci_domain_nr(dev->bus),
+						     pci_iov_virtfn_bus(dev, i),
+						     pci_iov_virtfn_devfn(dev, i));
+		if (!virtfn)
+			continue;
+		pci_bus_add_device(virtfn);
+		pci_dev_put(virtfn);
 	}
 	return 0;
 failed:
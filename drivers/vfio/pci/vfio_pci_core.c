@@ -474,6 +474,10 @@ int vfio_pci_core_enable(struct vfio_pci_core_device *vdev)
 	u16 cmd;
 	u8 msix_pos;
 
+	/* BAR ranges exported by a previous user may still be in use */
+	if (atomic_read(&vdev->nr_dmabufs))
+		return -EBUSY;
+
 	if (!disable_idle_d3) {
 		ret = pm_runtime_resume_and_get(&pdev->dev);
 		if (ret < 0)
@@ -1508,6 +1512,10 @@ int vfio_pci_core_ioctl_feature(struct vfio_device *device, u32 flags,
 		return vfio_pci_core_pm_exit(device, flags, arg, argsz);
 	case VFIO_DEVICE_FEATURE_PCI_VF_TOKEN:
 		return vfio_pci_core_feature_token(device, flags, arg, argsz);
+	case VFIO_DEVICE_FEATURE_DMA_BUF:
+		return vfio_pci_core_feature_dma_buf(
+			container_of(device, struct vfio_pci_core_device, vdev),
+			flags, arg, argsz);
 	default:
 		return -ENOTTY;
 	}
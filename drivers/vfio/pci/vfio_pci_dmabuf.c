@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Export ranges of PCI BARs as dma-bufs so an IOMMU importer can map them for
+ * peer-to-peer DMA from other devices.
+ */
+#include <linux/dma-buf.h>
+#include <linux/pci.h>
+#include <linux/vfio.h>
+
+#include "vfio_pci_priv.h"
+
+MODULE_IMPORT_NS(DMA_BUF);
+
+struct vfio_pci_dma_buf {
+	struct vfio_pci_core_device *vdev;
+	phys_addr_t phys;
+	size_t size;
+};
+
+/*
+ * The buffer is only ever described by its physical range, there is no struct
+ * page behind it that a regular importer could map through the DMA API.
+ */
+static int vfio_pci_dma_buf_attach(struct dma_buf *dmabuf,
+				   struct dma_buf_attachment *attachment)
+{
+	return -EOPNOTSUPP;
+}
+
+static struct sg_table *
+vfio_pci_dma_buf_map(struct dma_buf_attachment *attachment,
+		     enum dma_data_direction dir)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+static void vfio_pci_dma_buf_unmap(struct dma_buf_attachment *attachment,
+				   struct sg_table *sgt,
+				   enum dma_data_direction dir)
+{
+}
+
+static int vfio_pci_dma_buf_get_mmio_range(struct dma_buf *dmabuf,
+					   phys_addr_t *phys, size_t *size)
+{
+	struct vfio_pci_dma_buf *priv = dmabuf->priv;
+
+	*phys = priv->phys;
+	*size = priv->size;
+	return 0;
+}
+
+static void vfio_pci_dma_buf_release(struct dma_buf *dmabuf)
+{
+	struct vfio_pci_dma_buf *priv = dmabuf->priv;
+
+	atomic_dec(&priv->vdev->nr_dmabufs);
+	vfio_device_put_registration(&priv->vdev->vdev);
+	kfree(priv);
+}
+
+static const struct dma_buf_ops vfio_pci_dma_buf_ops = {
+	.attach = vfio_pci_dma_buf_attach,
+	.map_dma_buf = vfio_pci_dma_buf_map,
+	.unmap_dma_buf = vfio_pci_dma_buf_unmap,
+	.get_mmio_range = vfio_pci_dma_buf_get_mmio_range,
+	.release = vfio_pci_dma_buf_release,
+};
+
+int vfio_pci_core_feature_dma_buf(struct vfio_pci_core_device *vdev, u32 flags,
+				  struct vfio_device_feature_dma_buf __user *arg,
+				  size_t argsz)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct vfio_device_feature_dma_buf get_dma_buf;
+	struct pci_dev *pdev = vdev->pdev;
+	struct vfio_pci_dma_buf *priv;
+	struct dma_buf *dmabuf;
+	u64 bar_len, end;
+	int ret;
+
+	ret = vfio_check_feature(flags, argsz, VFIO_DEVICE_FEATURE_GET,
+				 sizeof(get_dma_buf));
+	if (ret != 1)
+		return ret;
+
+	if (copy_from_user(&get_dma_buf, arg, sizeof(get_dma_buf)))
+		return -EFAULT;
+
+	if (get_dma_buf.open_flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	/* Same restrictions as mmap of the BAR */
+	if (get_dma_buf.region_index >= VFIO_PCI_ROM_REGION_INDEX ||
+	    !vdev->bar_mmap_supported[get_dma_buf.region_index])
+		return -EINVAL;
+
+	bar_len = PAGE_ALIGN(pci_resource_len(pdev, get_dma_buf.region_index));
+	if (!get_dma_buf.length ||
+	    !PAGE_ALIGNED(get_dma_buf.offset) ||
+	    !PAGE_ALIGNED(get_dma_buf.length) ||
+	    check_add_overflow(get_dma_buf.offset, get_dma_buf.length, &end) ||
+	    end > bar_len)
+		return -EINVAL;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	priv->vdev = vdev;
+	priv->phys = pci_resource_start(pdev, get_dma_buf.region_index) +
+		     get_dma_buf.offset;
+	priv->size = get_dma_buf.length;
+
+	/* Keep the device bound to vfio-pci while the range is exported */
+	if (!vfio_device_try_get_registration(&vdev->vdev)) {
+		ret = -ENODEV;
+		goto err_free;
+	}
+
+	exp_info.ops = &vfio_pci_dma_buf_ops;
+	exp_info.size = priv->size;
+	exp_info.flags = O_RDWR | get_dma_buf.open_flags;
+	exp_info.priv = priv;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto err_put;
+	}
+	atomic_inc(&vdev->nr_dmabufs);
+
+	/* dma_buf_put() now frees priv */
+	ret = dma_buf_fd(dmabuf, get_dma_buf.open_flags);
+	if (ret < 0)
+		dma_buf_put(dmabuf);
+	return ret;
+
+err_put:
+	vfio_device_put_registration(&vdev->vdev);
+err_free:
+	kfree(priv);
+	return ret;
+}
@@ -27,8 +27,6 @@ struct vfio_device_file {
 	struct iommufd_ctx *iommufd; /* protected by struct vfio_device_set::lock */
 };
 
-void vfio_device_put_registration(struct vfio_device *device);
-bool vfio_device_try_get_registration(struct vfio_device *device);
 int vfio_df_open(struct vfio_device_file *df);
 void vfio_df_close(struct vfio_device_file *df);
 struct vfio_device_file *
@@ -1143,6 +1143,8 @@ static inline int blk_rq_map_sg(struct request_queue *q, struct request *rq,
 
 	return __blk_rq_map_sg(q, rq, sglist, &last_sg);
 }
+bool blk_rq_dma_map_cached(struct request *rq, struct device *dev,
+		dma_addr_t *dma_addr);
 void blk_dump_rq_flags(struct request *, char *);
 
 #ifdef CONFIG_BLK_DEV_ZONED
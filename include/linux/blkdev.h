@@ -1503,6 +1503,9 @@ void sync_bdevs(bool wait);
 void bdev_statx_dioalign(struct inode *inode, struct kstat *stat);
 void printk_all_partitions(void);
 int __init early_lookup_bdev(const char *pathname, dev_t *dev);
+struct blk_dma_cache *blk_dma_cache_create(const struct bio_vec *bvec,
+		unsigned int nr_bvecs);
+void blk_dma_cache_destroy(struct blk_dma_cache *cache);
 #else
 static inline void invalidate_bdev(struct block_device *bdev)
 {
@@ -1528,6 +1531,14 @@ static inline int early_lookup_bdev(const char *pathname, dev_t *dev)
 {
 	return -EINVAL;
 }
+static inline struct blk_dma_cache *
+blk_dma_cache_create(const struct bio_vec *bvec, unsigned int nr_bvecs)
+{
+	return NULL;
+}
+static inline void blk_dma_cache_destroy(struct blk_dma_cache *cache)
+{
+}
 #endif /* CONFIG_BLOCK */
 
 int freeze_bdev(struct block_device *bdev);
@@ -285,6 +285,23 @@ struct dma_buf_ops {
 
 	int (*vmap)(struct dma_buf *dmabuf, struct iosys_map *map);
 	void (*vunmap)(struct dma_buf *dmabuf, struct iosys_map *map);
+
+	/**
+	 * @get_mmio_range:
+	 *
+	 * Return the physically contiguous MMIO range backing the buffer. This
+	 * is used by importers that program an IOMMU directly, like iommufd,
+	 * instead of mapping the buffer for a specific device through an
+	 * attachment. The range must stay valid until the buffer is released.
+	 *
+	 * This callback is optional.
+	 *
+	 * Returns:
+	 *
+	 * 0 on success or a negative error code on failure.
+	 */
+	int (*get_mmio_range)(struct dma_buf *dmabuf, phys_addr_t *phys,
+			      size_t *size);
 };
 
 /**
@@ -631,4 +648,6 @@ int dma_buf_vmap(struct dma_buf *dmabuf, struct iosys_map *map);
 void dma_buf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map);
 int dma_buf_vmap_unlocked(struct dma_buf *dmabuf, struct iosys_map *map);
 void dma_buf_vunmap_unlocked(struct dma_buf *dmabuf, struct iosys_map *map);
+int dma_buf_get_mmio_range(struct dma_buf *dmabuf, phys_addr_t *phys,
+			   size_t *size);
 #endif /* __DMA_BUF_H__ */
@@ -60,6 +60,8 @@ struct iommu_flush_ops {
  * @tlb:           TLB management callbacks for this set of tables.
  * @iommu_dev:     The device representing the DMA configuration for the
  *                 page table walker.
+ * @domain:        The IOMMU domain the page table memory is accounted to,
+ *                 may be NULL.
  */
 struct io_pgtable_cfg {
 	/*
@@ -85,6 +87,11 @@ struct io_pgtable_cfg {
 	 *
 	 * IO_PGTABLE_QUIRK_ARM_OUTER_WBWA: Override the outer-cacheability
 	 *	attributes set in the TCR for a non-coherent page-table walker.
+	 *
+	 * IO_PGTABLE_QUIRK_ARM_BBML2: (ARM LPAE format) The walker tolerates
+	 *	a live table entry being replaced by a block entry without
+	 *	break-before-make, as long as the TLBs are invalidated after.
+	 *	Required by collapse_pages.
 	 */
 	#define IO_PGTABLE_QUIRK_ARM_NS			BIT(0)
 	#define IO_PGTABLE_QUIRK_NO_PERMS		BIT(1)
@@ -92,6 +99,7 @@ struct io_pgtable_cfg {
 	#define IO_PGTABLE_QUIRK_ARM_MTK_TTBR_EXT	BIT(4)
 	#define IO_PGTABLE_QUIRK_ARM_TTBR1		BIT(5)
 	#define IO_PGTABLE_QUIRK_ARM_OUTER_WBWA		BIT(6)
+	#define IO_PGTABLE_QUIRK_ARM_BBML2		BIT(7)
 	unsigned long			quirks;
 	unsigned long			pgsize_bitmap;
 	unsigned int			ias;
@@ -99,6 +107,7 @@ struct io_pgtable_cfg {
 	bool				coherent_walk;
 	const struct iommu_flush_ops	*tlb;
 	struct device			*iommu_dev;
+	struct iommu_domain		*domain;
 
 	/* Low-level data specific to the table format */
 	union {
@@ -151,8 +160,14 @@ struct io_pgtable_cfg {
  * struct io_pgtable_ops - Page table manipulation API for IOMMU drivers.
  *
  * @map_pages:    Map a physically contiguous range of pages of the same size.
+ * @map_ranges:   Map an array of physically contiguous runs of any size.
+ *                Optional.
  * @unmap_pages:  Unmap a range of virtually contiguous pages of the same size.
  * @iova_to_phys: Translate iova to physical address.
+ * @collapse_pages: Replace the tables in a range that map physically
+ *                contiguous memory with uniform attributes by block entries,
+ *                return the number of bytes now mapped by new blocks.
+ *                Optional.
  *
  * These functions map directly onto the iommu_ops member functions with
  * the same names.
@@ -161,11 +176,16 @@ struct io_pgtable_ops {
 	int (*map_pages)(struct io_pgtable_ops *ops, unsigned long iova,
 			 phys_addr_t paddr, size_t pgsize, size_t pgcount,
 			 int prot, gfp_t gfp, size_t *mapped);
+	int (*map_ranges)(struct io_pgtable_ops *ops,
+			  const struct iommu_map_range *ranges,
+			  unsigned int nr, int prot, gfp_t gfp, size_t *mapped);
 	size_t (*unmap_pages)(struct io_pgtable_ops *ops, unsigned long iova,
 			      size_t pgsize, size_t pgcount,
 			      struct iommu_iotlb_gather *gather);
 	phys_addr_t (*iova_to_phys)(struct io_pgtable_ops *ops,
 				    unsigned long iova);
+	size_t (*collapse_pages)(struct io_pgtable_ops *ops, unsigned long iova,
+				 size_t size);
 };
 
 /**
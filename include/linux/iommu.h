@@ -13,6 +13,8 @@
 #include <linux/errno.h>
 #include <linux/err.h>
 #include <linux/of.h>
+#include <linux/jump_label.h>
+#include <linux/timekeeping.h>
 #include <uapi/linux/iommu.h>
 #include <uapi/linux/iommufd.h>
 
@@ -103,6 +105,7 @@ struct iommu_domain {
 	unsigned long pgsize_bitmap;	/* Bitmap of page sizes in use */
 	struct iommu_domain_geometry geometry;
 	struct iommu_dma_cookie *iova_cookie;
+	atomic_long_t pgtable_pages;	/* Page table pages, see iommu-pages.h */
 	enum iommu_page_response_code (*iopf_handler)(struct iommu_fault *fault,
 						      void *data);
 	void *fault_data;
@@ -206,8 +209,75 @@ enum iommu_dev_features {
 #define IOMMU_PASID_INVALID	(-1U)
 typedef unsigned int ioasid_t;
 
+/* Counters of the "iommu" software perf PMU, the perf event config value */
+enum iommu_perf_counter {
+	IOMMU_PERF_MAP,			/* iommu_map() and friends calls */
+	IOMMU_PERF_MAP_BYTES,
+	IOMMU_PERF_MAP_PAGES,		/* leaf entries, per page size */
+	IOMMU_PERF_UNMAP,
+	IOMMU_PERF_UNMAP_BYTES,
+	IOMMU_PERF_IOTLB_SYNC,
+	IOMMU_PERF_FLUSH_IOTLB_ALL,
+	IOMMU_PERF_PGTABLE_PAGES,	/* page table pages allocated */
+	IOMMU_PERF_IRTE_WRITE,		/* interrupt remapping entries written */
+	IOMMU_PERF_IRTE_FLUSH,		/* interrupt entry cache invalidations */
+	IOMMU_PERF_NR_COUNTERS,
+};
+
+#ifdef CONFIG_IOMMU_PERF_EVENTS
+DECLARE_STATIC_KEY_FALSE(iommu_perf_enabled);
+
+void __iommu_perf_count(struct iommu_domain *domain,
+			enum iommu_perf_counter counter, u64 val,
+			size_t pgsize);
+
+static inline bool iommu_perf_active(void)
+{
+	return static_branch_unlikely(&iommu_perf_enabled);
+}
+
+/*
+ * Account @val to @counter of @domain. @domain is NULL for events that cannot
+ * be attributed to a domain, @pgsize is only used by IOMMU_PERF_MAP_PAGES.
+ * This is a patched out branch unless a perf event is active.
+ */
+static inline void iommu_perf_count(struct iommu_domain *domain,
+				    enum iommu_perf_counter counter, u64 val,
+				    size_t pgsize)
+{
+	if (iommu_perf_active())
+		__iommu_perf_count(domain, counter, val, pgsize);
+}
+#else
+static inline bool iommu_perf_active(void)
+{
+	return false;
+}
+
+static inline void iommu_perf_count(struct iommu_domain *domain,
+				    enum iommu_perf_counter counter, u64 val,
+				    size_t pgsize)
+{
+}
+#endif /* CONFIG_IOMMU_PERF_EVENTS */
+
 #ifdef CONFIG_IOMMU_API
 
+/**
+ * struct iommu_map_range - A physically contiguous run to map
+ * @iova: IOVA to map the run at
+ * @paddr: Physical address of the run
+ * @size: Length of the run in bytes
+ *
+ * An array of these describes a scattered mapping for iommu_map_batch() and
+ * &iommu_domain_ops.map_ranges.
+ */
+struct iommu_map_range {
+	unsigned long iova;
+	phys_addr_t paddr;
+	size_t size;
+};
+
 /**
  * struct iommu_iotlb_gather - Range information for a pending IOTLB flush
  *
@@ -232,6 +302,25 @@ struct iommu_iotlb_gather {
 	bool			queued;
 };
 
+#define IOMMU_IOTLB_MULTI_GATHER_DOMAINS	16
+
+/**
+ * struct iommu_iotlb_multi_gather - IOTLB flushes pending on several domains
+ *
+ * @nr: Number of entries used in @domains
+ * @domains: Domains whose invalidations were issued by ->iotlb_sync_nowait()
+ *	     and still need to be waited for
+ *
+ * Lets a caller unmapping the same range from several domains, possibly on the
+ * same IOMMU instance, wait once per instance instead of once per domain. Each
+ * domain's range is flushed with iommu_iotlb_sync_add() and
+ * iommu_iotlb_multi_sync() then waits for all of them.
+ */
+struct iommu_iotlb_multi_gather {
+	unsigned int		nr;
+	struct iommu_domain	*domains[IOMMU_IOTLB_MULTI_GATHER_DOMAINS];
+};
+
 /**
  * struct iommu_user_data - iommu driver specific user space data info
  * @uptr: Pointer to the user buffer for copy_from_user()
@@ -334,6 +423,12 @@ iommu_copy_user_data_from_array(void *dst_data,
  * @release_device: Remove device from iommu driver handling
  * @probe_finalize: Do final setup work after the device is added to an IOMMU
  *                  group and attached to the groups domain
+ * @sync_batched_attach: Wait for the context, device or PASID table cache
+ *                       invalidations that attaching devices flagged with
+ *                       dev_iommu::attach_batched left pending. Called once
+ *                       per IOMMU instance after the default domains of a
+ *                       batch of probed groups are set up, before
+ *                       probe_finalize.
  * @set_platform_dma_ops: Returning control back to the platform DMA ops. This op
  *                        is to support old IOMMU drivers, new drivers should use
  *                        default domains, and the common IOMMU DMA ops.
@@ -375,6 +470,7 @@ struct iommu_ops {
 	struct iommu_device *(*probe_device)(struct device *dev);
 	void (*release_device)(struct device *dev);
 	void (*probe_finalize)(struct device *dev);
+	void (*sync_batched_attach)(struct device *dev);
 	void (*set_platform_dma_ops)(struct device *dev);
 	struct iommu_group *(*device_group)(struct device *dev);
 
@@ -423,12 +519,31 @@ struct iommu_ops {
  * @map: map a physically contiguous memory region to an iommu domain
  * @map_pages: map a physically contiguous set of pages of the same size to
  *             an iommu domain.
+ * @map_ranges: map an array of physically contiguous runs, in order, in one
+ *              call so the driver can keep its page table walk state between
+ *              runs. @mapped is advanced by the bytes mapped, also on failure,
+ *              so the core can unwind. The core has already checked the
+ *              alignment of every run.
  * @unmap: unmap a physically contiguous memory region from an iommu domain
  * @unmap_pages: unmap a number of pages of the same size from an iommu domain
+ * @collapse_pages: replace the page tables in a range that map physically
+ *                  contiguous memory with the same permissions by huge
+ *                  IOPTEs, for instance after the range was unmapped and
+ *                  mapped again in small pages. Returns the number of bytes
+ *                  newly mapped by huge IOPTEs. The caller must not map or
+ *                  unmap within the range concurrently. Tables that can only
+ *                  be freed after an invalidation go in @iotlb_gather.
  * @flush_iotlb_all: Synchronously flush all hardware TLBs for this domain
  * @iotlb_sync_map: Sync mappings created recently using @map to the hardware
  * @iotlb_sync: Flush all queued ranges from the hardware TLBs and empty flush
  *            queue
+ * @iotlb_sync_nowait: Like @iotlb_sync, but only issue the invalidations. Their
+ *                     completion is waited for by @iotlb_sync_wait. Drivers
+ *                     that free pages on the gather freelist must not
+ *                     provide it.
+ * @iotlb_sync_wait: Wait for the invalidations issued by @iotlb_sync_nowait on
+ *                   @nr @domains sharing these domain ops, once per hardware
+ *                   instance they are attached to.
  * @cache_invalidate_user: Flush hardware cache for user space IO page table.
  *                         The @domain must be IOMMU_DOMAIN_NESTED. The @array
  *                         passes in the cache invalidation requests, in form
@@ -457,17 +572,27 @@ struct iommu_domain_ops {
 	int (*map_pages)(struct iommu_domain *domain, unsigned long iova,
 			 phys_addr_t paddr, size_t pgsize, size_t pgcount,
 			 int prot, gfp_t gfp, size_t *mapped);
+	int (*map_ranges)(struct iommu_domain *domain,
+			  const struct iommu_map_range *ranges,
+			  unsigned int nr, int prot, gfp_t gfp,
+			  size_t *mapped);
 	size_t (*unmap)(struct iommu_domain *domain, unsigned long iova,
 			size_t size, struct iommu_iotlb_gather *iotlb_gather);
 	size_t (*unmap_pages)(struct iommu_domain *domain, unsigned long iova,
 			      size_t pgsize, size_t pgcount,
 			      struct iommu_iotlb_gather *iotlb_gather);
+	size_t (*collapse_pages)(struct iommu_domain *domain,
+				 unsigned long iova, size_t size,
+				 struct iommu_iotlb_gather *iotlb_gather);
 
 	void (*flush_iotlb_all)(struct iommu_domain *domain);
 	void (*iotlb_sync_map)(struct iommu_domain *domain, unsigned long iova,
 			       size_t size);
 	void (*iotlb_sync)(struct iommu_domain *domain,
 			   struct iommu_iotlb_gather *iotlb_gather);
+	void (*iotlb_sync_nowait)(struct iommu_domain *domain,
+				  struct iommu_iotlb_gather *iotlb_gather);
+	void (*iotlb_sync_wait)(struct iommu_domain **domains, unsigned int nr);
 	int (*cache_invalidate_user)(struct iommu_domain *domain,
 				     struct iommu_user_data_array *array,
 				     u32 *error_code);
@@ -491,6 +616,7 @@ struct iommu_domain_ops {
  * @ops: iommu-ops for talking to this iommu
  * @dev: struct device for sysfs handling
  * @max_pasids: number of supported PASIDs
+ * @latency: command latency statistics, see iommu_latency_update()
  */
 struct iommu_device {
 	struct list_head list;
@@ -498,6 +624,9 @@ struct iommu_device {
 	struct fwnode_handle *fwnode;
 	struct device *dev;
 	u32 max_pasids;
+#ifdef CONFIG_IOMMU_LATENCY
+	struct iommu_latency *latency;
+#endif
 };
 
 /**
@@ -540,6 +669,9 @@ struct iommu_fault_param {
  * @attach_deferred: the dma domain attachment is deferred
  * @pci_32bit_workaround: Limit DMA allocations to 32-bit IOVAs
  * @require_direct: device requires IOMMU_RESV_DIRECT regions
+ * @attach_batched: the default domain attach is part of a batch, the driver
+ *		    may leave its cache invalidations to sync_batched_attach
+ * @probe_batch: groups of the VFs of this PF waiting for their default domain
  *
  * TODO: migrate other per device data pointers under iommu_dev_data, e.g.
  *	struct iommu_group	*iommu_group;
@@ -555,6 +687,8 @@ struct dev_iommu {
 	u32				attach_deferred:1;
 	u32				pci_32bit_workaround:1;
 	u32				require_direct:1;
+	u32				attach_batched:1;
+	struct list_head		*probe_batch;
 };
 
 int iommu_device_register(struct iommu_device *iommu,
@@ -583,6 +717,12 @@ static inline void iommu_iotlb_gather_init(struct iommu_iotlb_gather *gather)
 	};
 }
 
+static inline void
+iommu_iotlb_multi_gather_init(struct iommu_iotlb_multi_gather *multi)
+{
+	multi->nr = 0;
+}
+
 extern int bus_iommu_probe(const struct bus_type *bus);
 extern bool iommu_present(const struct bus_type *bus);
 extern bool device_iommu_capable(struct device *dev, enum iommu_cap cap);
@@ -604,9 +744,18 @@ extern size_t iommu_unmap(struct iommu_domain *domain, unsigned long iova,
 extern size_t iommu_unmap_fast(struct iommu_domain *domain,
 			       unsigned long iova, size_t size,
 			       struct iommu_iotlb_gather *iotlb_gather);
+void iommu_iotlb_sync_add(struct iommu_iotlb_multi_gather *multi,
+			  struct iommu_domain *domain,
+			  struct iommu_iotlb_gather *iotlb_gather);
+void iommu_iotlb_multi_sync(struct iommu_iotlb_multi_gather *multi);
+int iommu_collapse(struct iommu_domain *domain, unsigned long iova,
+		   size_t size, size_t *collapsed);
 extern ssize_t iommu_map_sg(struct iommu_domain *domain, unsigned long iova,
 			    struct scatterlist *sg, unsigned int nents,
 			    int prot, gfp_t gfp);
+int iommu_map_batch(struct iommu_domain *domain,
+		    const struct iommu_map_range *ranges, unsigned int nr,
+		    int prot, gfp_t gfp);
 extern phys_addr_t iommu_iova_to_phys(struct iommu_domain *domain, dma_addr_t iova);
 extern void iommu_set_fault_handler(struct iommu_domain *domain,
 			iommu_fault_handler_t handler, void *token);
@@ -664,6 +813,7 @@ extern int report_iommu_fault(struct iommu_domain *domain, struct device *dev,
 
 static inline void iommu_flush_iotlb_all(struct iommu_domain *domain)
 {
+	iommu_perf_count(domain, IOMMU_PERF_FLUSH_IOTLB_ALL, 1, 0);
 	if (domain->ops->flush_iotlb_all)
 		domain->ops->flush_iotlb_all(domain);
 }
@@ -671,6 +821,7 @@ static inline void iommu_flush_iotlb_all(struct iommu_domain *domain)
 static inline void iommu_iotlb_sync(struct iommu_domain *domain,
 				  struct iommu_iotlb_gather *iotlb_gather)
 {
+	iommu_perf_count(domain, IOMMU_PERF_IOTLB_SYNC, 1, 0);
 	if (domain->ops->iotlb_sync)
 		domain->ops->iotlb_sync(domain, iotlb_gather);
 
@@ -825,6 +976,8 @@ static inline void dev_iommu_priv_set(struct device *dev, void *priv)
 }
 
 int iommu_probe_device(struct device *dev);
+void iommu_probe_batch_begin(struct device *dev);
+int iommu_probe_batch_end(struct device *dev);
 
 int iommu_dev_enable_feature(struct device *dev, enum iommu_dev_features f);
 int iommu_dev_disable_feature(struct device *dev, enum iommu_dev_features f);
@@ -858,6 +1011,7 @@ struct iommu_fwspec {};
 struct iommu_device {};
 struct iommu_fault_param {};
 struct iommu_iotlb_gather {};
+struct iommu_iotlb_multi_gather {};
 
 static inline bool iommu_present(const struct bus_type *bus)
 {
@@ -913,6 +1067,23 @@ static inline size_t iommu_unmap_fast(struct iommu_domain *domain,
 	return 0;
 }
 
+static inline void iommu_iotlb_sync_add(struct iommu_iotlb_multi_gather *multi,
+					struct iommu_domain *domain,
+					struct iommu_iotlb_gather *iotlb_gather)
+{
+}
+
+static inline void iommu_iotlb_multi_sync(struct iommu_iotlb_multi_gather *multi)
+{
+}
+
+static inline int iommu_collapse(struct iommu_domain *domain,
+				 unsigned long iova, size_t size,
+				 size_t *collapsed)
+{
+	return -ENODEV;
+}
+
 static inline ssize_t iommu_map_sg(struct iommu_domain *domain,
 				   unsigned long iova, struct scatterlist *sg,
 				   unsigned int nents, int prot, gfp_t gfp)
@@ -920,6 +1091,13 @@ static inline ssize_t iommu_map_sg(struct iommu_domain *domain,
 	return -ENODEV;
 }
 
+static inline int iommu_map_batch(struct iommu_domain *domain,
+				  const struct iommu_map_range *ranges,
+				  unsigned int nr, int prot, gfp_t gfp)
+{
+	return -ENODEV;
+}
+
 static inline void iommu_flush_iotlb_all(struct iommu_domain *domain)
 {
 }
@@ -1138,6 +1316,15 @@ const struct iommu_ops *iommu_ops_from_fwnode(struct fwnode_handle *fwnode)
 	return NULL;
 }
 
+static inline void iommu_probe_batch_begin(struct device *dev)
+{
+}
+
+static inline int iommu_probe_batch_end(struct device *dev)
+{
+	return 0;
+}
+
 static inline int
 iommu_dev_enable_feature(struct device *dev, enum iommu_dev_features feat)
 {
@@ -1244,6 +1431,85 @@ void iommu_debugfs_setup(void);
 static inline void iommu_debugfs_setup(void) {}
 #endif
 
+/* Kinds of hardware commands whose completion latency can be tracked */
+enum iommu_latency_type {
+	IOMMU_LATENCY_INV_IOTLB = 0,	/* IOTLB invalidation */
+	IOMMU_LATENCY_INV_DEVTLB,	/* ATS invalidation */
+	IOMMU_LATENCY_INV_IEC,		/* interrupt remapping cache invalidation */
+	IOMMU_LATENCY_PRQ,		/* page request handling */
+	IOMMU_LATENCY_CMD_QUEUE,	/* getting commands into the queue */
+	IOMMU_LATENCY_CMD_SYNC,		/* waiting for queued commands */
+	IOMMU_LATENCY_NUM
+};
+
+#ifdef CONFIG_IOMMU_LATENCY
+int iommu_latency_enable(struct iommu_device *iommu,
+			 enum iommu_latency_type type);
+void iommu_latency_disable(struct iommu_device *iommu,
+			   enum iommu_latency_type type);
+bool iommu_latency_enabled(struct iommu_device *iommu,
+			   enum iommu_latency_type type);
+void iommu_latency_update(struct iommu_device *iommu,
+			  enum iommu_latency_type type, u64 latency);
+int iommu_latency_snapshot(struct iommu_device *iommu, char *str, size_t size);
+#else
+static inline int iommu_latency_enable(struct iommu_device *iommu,
+				       enum iommu_latency_type type)
+{
+	return -EINVAL;
+}
+
+static inline void iommu_latency_disable(struct iommu_device *iommu,
+					 enum iommu_latency_type type)
+{
+}
+
+static inline bool iommu_latency_enabled(struct iommu_device *iommu,
+					 enum iommu_latency_type type)
+{
+	return false;
+}
+
+static inline void iommu_latency_update(struct iommu_device *iommu,
+					enum iommu_latency_type type,
+					u64 latency)
+{
+}
+
+static inline int iommu_latency_snapshot(struct iommu_device *iommu,
+					 char *str, size_t size)
+{
+	return 0;
+}
+#endif /* CONFIG_IOMMU_LATENCY */
+
+/**
+ * iommu_latency_start - Start timing a command
+ * @iommu: IOMMU issuing the command
+ * @type: kind of command
+ *
+ * Return a timestamp to pass to iommu_latency_end(), or 0 if @type is not
+ * being tracked on @iommu.
+ */
+static inline u64 iommu_latency_start(struct iommu_device *iommu,
+				      enum iommu_latency_type type)
+{
+	return iommu_latency_enabled(iommu, type) ? ktime_get_ns() : 0;
+}
+
+/**
+ * iommu_latency_end - Account a command timed with iommu_latency_start()
+ * @iommu: IOMMU issuing the command
+ * @type: kind of command
+ * @start: return value of iommu_latency_start()
+ */
+static inline void iommu_latency_end(struct iommu_device *iommu,
+				     enum iommu_latency_type type, u64 start)
+{
+	if (start)
+		iommu_latency_update(iommu, type, ktime_get_ns() - start);
+}
+
 #ifdef CONFIG_IOMMU_DMA
 #include <linux/msi.h>
 
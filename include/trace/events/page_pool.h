@@ -89,6 +89,32 @@ TRACE_EVENT(page_pool_state_hold,
 		  __entry->pool, __entry->page, __entry->pfn, __entry->hold)
 );
 
+TRACE_EVENT(page_pool_dma_bulk_map,
+
+	TP_PROTO(const struct page_pool *pool, unsigned int npages,
+		 unsigned int nsegs, u64 maps_saved),
+
+	TP_ARGS(pool, npages, nsegs, maps_saved),
+
+	TP_STRUCT__entry(
+		__field(const struct page_pool *, pool)
+		__field(unsigned int,		  npages)
+		__field(unsigned int,		  nsegs)
+		__field(u64,			  maps_saved)
+	),
+
+	TP_fast_assign(
+		__entry->pool		= pool;
+		__entry->npages		= npages;
+		__entry->nsegs		= nsegs;
+		__entry->maps_saved	= maps_saved;
+	),
+
+	TP_printk("page_pool=%p npages=%u nsegs=%u maps_saved=%llu",
+		  __entry->pool, __entry->npages, __entry->nsegs,
+		  __entry->maps_saved)
+);
+
 TRACE_EVENT(page_pool_update_nid,
 
 	TP_PROTO(const struct page_pool *pool, int new_nid),
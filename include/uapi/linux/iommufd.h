@@ -50,6 +50,9 @@ enum {
 	IOMMUFD_CMD_HWPT_INVALIDATE,
 	IOMMUFD_CMD_SET_DEV_DATA,
 	IOMMUFD_CMD_UNSET_DEV_DATA,
+	IOMMUFD_CMD_IOAS_MAP_FILE,
+	IOMMUFD_CMD_HWPT_COLLAPSE,
+	IOMMUFD_CMD_IOAS_CHANGE_PROCESS,
 };
 
 /**
@@ -212,6 +215,39 @@ struct iommu_ioas_map {
 };
 #define IOMMU_IOAS_MAP _IO(IOMMUFD_TYPE, IOMMUFD_CMD_IOAS_MAP)
 
+/**
+ * struct iommu_ioas_map_file - ioctl(IOMMU_IOAS_MAP_FILE)
+ * @size: sizeof(struct iommu_ioas_map_file)
+ * @flags: same as for iommu_ioas_map
+ * @ioas_id: same as for iommu_ioas_map
+ * @fd: the memfd or dma-buf to map
+ * @start: byte offset from start of file to map from
+ * @length: same as for iommu_ioas_map
+ * @iova: same as for iommu_ioas_map
+ *
+ * Set an IOVA mapping from a memfd file. The file must be backed by shmem or
+ * hugetlbfs. The pages are pinned directly from the file's page cache, so the
+ * mapping does not depend on the file being mapped into any address space and
+ * is unaffected by later changes to the VMM's address space. All other
+ * arguments and semantics match those of IOMMU_IOAS_MAP.
+ *
+ * fd may instead be a dma-buf exporting an MMIO range, such as one created by
+ * VFIO_DEVICE_FEATURE_DMA_BUF for a PCI BAR. This lets devices attached to the
+ * IOAS do peer-to-peer DMA to that BAR. If the kernel picks the IOVA it is
+ * aligned like the physical address so large IOPTEs can be used. Such a
+ * mapping cannot be used by in-kernel emulated devices.
+ */
+struct iommu_ioas_map_file {
+	__u32 size;
+	__u32 flags;
+	__u32 ioas_id;
+	__s32 fd;
+	__aligned_u64 start;
+	__aligned_u64 length;
+	__aligned_u64 iova;
+};
+#define IOMMU_IOAS_MAP_FILE _IO(IOMMUFD_TYPE, IOMMUFD_CMD_IOAS_MAP_FILE)
+
 /**
  * struct iommu_ioas_copy - ioctl(IOMMU_IOAS_COPY)
  * @size: sizeof(struct iommu_ioas_copy)
@@ -264,8 +300,9 @@ struct iommu_ioas_unmap {
 #define IOMMU_IOAS_UNMAP _IO(IOMMUFD_TYPE, IOMMUFD_CMD_IOAS_UNMAP)
 
 /**
- * enum iommufd_option - ioctl(IOMMU_OPTION_RLIMIT_MODE) and
- *                       ioctl(IOMMU_OPTION_HUGE_PAGES)
+ * enum iommufd_option - ioctl(IOMMU_OPTION_RLIMIT_MODE),
+ *                       ioctl(IOMMU_OPTION_HUGE_PAGES) and
+ *                       ioctl(IOMMU_OPTION_ASYNC_RELEASE)
  * @IOMMU_OPTION_RLIMIT_MODE:
  *    Change how RLIMIT_MEMLOCK accounting works. The caller must have privilege
  *    to invoke this. Value 0 (default) is user based accouting, 1 uses process
@@ -275,10 +312,18 @@ struct iommu_ioas_unmap {
  *    iommu mappings. Value 0 disables combining, everything is mapped to
  *    PAGE_SIZE. This can be useful for benchmarking.  This is a per-IOAS
  *    option, the object_id must be the IOAS ID.
+ * @IOMMU_OPTION_ASYNC_RELEASE:
+ *    Value 1 makes closing the iommufd return without waiting for its objects
+ *    to be destroyed. The domains are unmapped and the pages unpinned by
+ *    background workers, independent IOAS's in parallel, and the pinned and
+ *    locked memory accounting drops as the pages are unpinned. Value 0
+ *    (default) destroys everything before close() returns. Global option,
+ *    object_id must be 0
  */
 enum iommufd_option {
 	IOMMU_OPTION_RLIMIT_MODE = 0,
 	IOMMU_OPTION_HUGE_PAGES = 1,
+	IOMMU_OPTION_ASYNC_RELEASE = 2,
 };
 
 /**
@@ -667,6 +712,62 @@ struct iommu_hwpt_invalidate {
 };
 #define IOMMU_HWPT_INVALIDATE _IO(IOMMUFD_TYPE, IOMMUFD_CMD_HWPT_INVALIDATE)
 
+/**
+ * struct iommu_hwpt_collapse - ioctl(IOMMU_HWPT_COLLAPSE)
+ * @size: sizeof(struct iommu_hwpt_collapse)
+ * @hwpt_id: HWPT ID of a kernel-managed hardware page table
+ * @flags: Must be 0
+ * @__reserved: Must be 0
+ * @iova: Start of the IOVA range to collapse
+ * @length: Length of the IOVA range to collapse
+ * @out_collapsed: Number of bytes now mapped by new huge IOPTEs
+ *
+ * Huge IOPTEs that were split by a partial unmap stay split when the range is
+ * mapped again, which slowly reduces the IOTLB reach of long-lived page tables.
+ * Replace the page tables within the range that map physically contiguous,
+ * suitably aligned memory with uniform permissions by huge IOPTEs and flush
+ * the IOTLB. DMA keeps being translated during the operation.
+ *
+ * Huge IOPTEs are only formed within a single IOAS mapping, and not at all if
+ * large pages are disabled on the IOAS. The range must be aligned to the IOAS
+ * IOVA alignment. Ranges being mapped or unmapped concurrently are skipped.
+ * Hardware that cannot replace live page table entries reports 0 bytes.
+ */
+struct iommu_hwpt_collapse {
+	__u32 size;
+	__u32 hwpt_id;
+	__u32 flags;
+	__u32 __reserved;
+	__aligned_u64 iova;
+	__aligned_u64 length;
+	__aligned_u64 out_collapsed;
+};
+#define IOMMU_HWPT_COLLAPSE _IO(IOMMUFD_TYPE, IOMMUFD_CMD_HWPT_COLLAPSE)
+
+/**
+ * struct iommu_ioas_change_process - ioctl(IOMMU_IOAS_CHANGE_PROCESS)
+ * @size: sizeof(struct iommu_ioas_change_process)
+ * @ioas_id: IOAS ID whose mappings move to the calling process
+ *
+ * Make the calling process the owner of every mapping in the IOAS, for
+ * instance after the process that created them handed the iommufd over and
+ * exited. The pinned pages are charged to the calling process and later pins
+ * are made from its address space.
+ *
+ * Mappings of user VA must be mapped by the calling process at the same VA to
+ * the same pages, otherwise the ioctl fails with EINVAL, or EFAULT if the VA is
+ * not mapped. This is checked page by page; nothing is pinned again and the
+ * IOPTEs are not touched, so DMA is not disturbed. Mappings of a file move
+ * without a check. If the ioctl fails part way the mappings already moved stay
+ * with the calling process, and it can be repeated once the cause is fixed.
+ * Mapping or unmapping in the IOAS waits for the ioctl to complete.
+ */
+struct iommu_ioas_change_process {
+	__u32 size;
+	__u32 ioas_id;
+};
+#define IOMMU_IOAS_CHANGE_PROCESS _IO(IOMMUFD_TYPE, IOMMUFD_CMD_IOAS_CHANGE_PROCESS)
+
 /**
  * struct iommu_dev_data_arm_smmuv3 - ARM SMMUv3 specific device data
  * @sid: The Stream ID that is assigned in the user space
@@ -1489,6 +1489,32 @@ struct vfio_device_feature_mig_data_size {
 
 #define VFIO_DEVICE_FEATURE_MIG_DATA_SIZE 9
 
+/*
+ * Upon VFIO_DEVICE_FEATURE_GET create a dma-buf fd for a range of a PCI BAR.
+ *
+ * The dma-buf describes the MMIO range itself and is meant to be handed to an
+ * IOMMU importer, such as IOMMU_IOAS_MAP_FILE, so that other devices can
+ * reach the BAR through the IOMMU for peer-to-peer DMA. It cannot be mmap'd
+ * or attached to other drivers.
+ *
+ * region_index must be a memory BAR, offset and length must be page aligned
+ * and lie within it. open_flags are the file flags of the new fd, only
+ * O_CLOEXEC is accepted. The fd is returned as the ioctl's return value.
+ *
+ * While any dma-buf created this way exists the device cannot be unbound
+ * from vfio-pci or opened again after it is closed. If the device's memory
+ * decoding is disabled, for instance during a reset, peer accesses to the
+ * range fail the same way CPU accesses would.
+ */
+struct vfio_device_feature_dma_buf {
+	__u32 region_index;
+	__u32 open_flags;
+	__aligned_u64 offset;
+	__aligned_u64 length;
+};
+
+#define VFIO_DEVICE_FEATURE_DMA_BUF 10
+
 /* -------- API for Type1 VFIO IOMMU -------- */
 
 /**
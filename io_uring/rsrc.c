@@ -7,6 +7,7 @@
 #include <linux/slab.h>
 #include <linux/nospec.h>
 #include <linux/hugetlb.h>
+#include <linux/blkdev.h>
 #include <linux/compat.h>
 #include <linux/io_uring.h>
 
@@ -139,6 +140,9 @@ static void io_buffer_unmap(struct io_ring_ctx *ctx, struct io_mapped_ubuf **slo
 	unsigned int i;
 
 	if (imu != &dummy_ubuf) {
+		/* Drop any device mappings before the pages go away */
+		if (imu->dma_cache)
+			blk_dma_cache_destroy(imu->dma_cache);
 		for (i = 0; i < imu->nr_bvecs; i++)
 			unpin_user_page(imu->bvec[i].bv_page);
 		if (imu->acct_pages)
@@ -1143,16 +1147,18 @@ static int io_sqe_buffer_register(struct io_ring_ctx *ctx, struct iovec *iov,
 
 	if (folio) {
 		bvec_set_page(&imu->bvec[0], pages[0], size, off);
-		goto done;
-	}
-	for (i = 0; i < nr_pages; i++) {
-		size_t vec_len;
+	} else {
+		for (i = 0; i < nr_pages; i++) {
+			size_t vec_len;
 
-		vec_len = min_t(size_t, size, PAGE_SIZE - off);
-		bvec_set_page(&imu->bvec[i], pages[i], vec_len, off);
-		off = 0;
-		size -= vec_len;
+			vec_len = min_t(size_t, size, PAGE_SIZE - off);
+			bvec_set_page(&imu->bvec[i], pages[i], vec_len, off);
+			off = 0;
+			size -= vec_len;
+		}
 	}
+	/* Optional, without it the buffer is DMA mapped for every I/O */
+	imu->dma_cache = blk_dma_cache_create(imu->bvec, imu->nr_bvecs);
 done:
 	if (ret)
 		kvfree(imu);
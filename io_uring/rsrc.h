@@ -54,6 +54,7 @@ struct io_mapped_ubuf {
 	u64		ubuf_end;
 	unsigned int	nr_bvecs;
 	unsigned long	acct_pages;
+	struct blk_dma_cache *dma_cache;
 	struct bio_vec	bvec[] __counted_by(nr_bvecs);
 };
 
@@ -20,6 +20,8 @@
 #include <linux/poison.h>
 #include <linux/ethtool.h>
 #include <linux/netdevice.h>
+#include <linux/scatterlist.h>
+#include <linux/xarray.h>
 
 #include <trace/events/page_pool.h>
 
@@ -28,6 +30,40 @@
 
 #define BIAS_MAX	LONG_MAX
 
+/* A refill batch that was DMA mapped as one IOVA range.
+ *
+ * The range can only be unmapped as a whole, so pages leaving the pool keep
+ * their pool reference until every page of the chunk has been returned. Only
+ * then is the range unmapped and the pages handed back to the page allocator,
+ * which guarantees a page is never freed while the device can still reach it.
+ * A single page that keeps being used pins its whole chunk, so the pages of
+ * all live chunks are capped, see page_pool_dma_map_bulk().
+ */
+struct page_pool_dma_chunk {
+	struct sg_table sgt;
+	refcount_t inflight;
+};
+
+/* Core state kept next to the driver visible struct page_pool */
+struct page_pool_priv {
+	struct page_pool pool;
+
+	/* Map refill batches as a single range, see page_pool_dma_map_bulk() */
+	bool dma_bulk;
+	/* pfn -> struct page_pool_dma_chunk for bulk mapped pages */
+	struct xarray dma_chunks;
+	/* Pages of the live chunks, in use or already returned, and their cap */
+	atomic_t dma_bulk_pages;
+	unsigned int dma_bulk_limit;
+	/* dma_map_page() calls saved by bulk mapping, for the tracepoint */
+	u64 dma_maps_saved;
+};
+
+static struct page_pool_priv *pp_priv(struct page_pool *pool)
+{
+	return container_of(pool, struct page_pool_priv, pool);
+}
+
 #ifdef CONFIG_PAGE_POOL_STATS
 /* alloc_stat_inc is intended to be used in softirq context */
 #define alloc_stat_inc(pool, __stat)	(pool->alloc_stats.__stat++)
@@ -229,9 +265,21 @@ static int page_pool_init(struct page_pool *pool,
 	/* Driver calling page_pool_create() also call page_pool_destroy() */
 	refcount_set(&pool->user_cnt, 1);
 
-	if (pool->p.flags & PP_FLAG_DMA_MAP)
+	if (pool->p.flags & PP_FLAG_DMA_MAP) {
 		get_device(pool->p.dev);
 
+		/* A non-zero merge boundary means the device sits behind an
+		 * IOMMU that can place a scatterlist into one IOVA range. That
+		 * is where per-page mapping costs an IOVA allocation and a page
+		 * table update each time, so map whole refill batches instead.
+		 */
+		xa_init_flags(&pp_priv(pool)->dma_chunks, XA_FLAGS_LOCK_BH);
+		pp_priv(pool)->dma_bulk = !pool->p.order &&
+					  dma_get_merge_boundary(pool->p.dev);
+		pp_priv(pool)->dma_bulk_limit = max_t(unsigned int, ring_qsize,
+						      PP_ALLOC_CACHE_REFILL);
+	}
+
 	return 0;
 }
 
@@ -241,17 +289,19 @@ static int page_pool_init(struct page_pool *pool,
  */
 struct page_pool *page_pool_create(const struct page_pool_params *params)
 {
+	struct page_pool_priv *priv;
 	struct page_pool *pool;
 	int err;
 
-	pool = kzalloc_node(sizeof(*pool), GFP_KERNEL, params->nid);
-	if (!pool)
+	priv = kzalloc_node(sizeof(*priv), GFP_KERNEL, params->nid);
+	if (!priv)
 		return ERR_PTR(-ENOMEM);
+	pool = &priv->pool;
 
 	err = page_pool_init(pool, params);
 	if (err < 0) {
 		pr_warn("%s() gave up with errno %d\n", __func__, err);
-		kfree(pool);
+		kfree(priv);
 		return ERR_PTR(err);
 	}
 
@@ -367,6 +417,135 @@ static bool page_pool_dma_map(struct page_pool *pool, struct page *page)
 	return true;
 }
 
+static void page_pool_dma_chunk_unmap(struct page_pool *pool,
+				      struct page_pool_dma_chunk *chunk)
+{
+	dma_unmap_sgtable(pool->p.dev, &chunk->sgt, pool->p.dma_dir,
+			  DMA_ATTR_SKIP_CPU_SYNC | DMA_ATTR_WEAK_ORDERING);
+}
+
+static void page_pool_dma_chunk_forget(struct page_pool *pool,
+				       struct page_pool_dma_chunk *chunk,
+				       unsigned int nents)
+{
+	struct xarray *xa = &pp_priv(pool)->dma_chunks;
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sgtable_sg(&chunk->sgt, sg, i) {
+		if (i == nents)
+			break;
+		xa_erase_bh(xa, page_to_pfn(sg_page(sg)));
+	}
+}
+
+/* Map a whole refill batch with one dma_map_sgtable() call. On an IOMMU this
+ * is a single IOVA allocation, one page table walk and one IOTLB sync instead
+ * of one of each per page. Returns false if the caller should fall back to
+ * mapping the pages one by one.
+ */
+static bool page_pool_dma_map_bulk(struct page_pool *pool, struct page **pages,
+				   unsigned int nr_pages, gfp_t gfp)
+{
+	struct page_pool_priv *priv = pp_priv(pool);
+	struct page_pool_dma_chunk *chunk;
+	struct scatterlist *sg;
+	unsigned int i, n = 0;
+	int err;
+
+	if (!priv->dma_bulk || nr_pages < 2)
+		return false;
+
+	/* Returned pages stay allocated until their whole chunk is returned.
+	 * Past the size of the ring, map pages one by one so that they can
+	 * be released on their own and a pool cannot strand memory without
+	 * bound behind a few pages that keep recycling.
+	 */
+	if (atomic_add_return(nr_pages, &priv->dma_bulk_pages) >
+	    priv->dma_bulk_limit)
+		goto err_limit;
+
+	chunk = kmalloc(sizeof(*chunk), gfp);
+	if (!chunk)
+		goto err_limit;
+
+	if (sg_alloc_table(&chunk->sgt, nr_pages, gfp))
+		goto err_free;
+
+	for_each_sgtable_sg(&chunk->sgt, sg, i)
+		sg_set_page(sg, pages[i], PAGE_SIZE, 0);
+
+	err = dma_map_sgtable(pool->p.dev, &chunk->sgt, pool->p.dma_dir,
+			      DMA_ATTR_SKIP_CPU_SYNC | DMA_ATTR_WEAK_ORDERING);
+	if (err)
+		goto err_table;
+
+	/* The IOMMU keeps the pages in order, hand out the IOVA page by page */
+	for_each_sgtable_dma_sg(&chunk->sgt, sg, i) {
+		dma_addr_t dma = sg_dma_address(sg);
+		unsigned int len = sg_dma_len(sg);
+
+		for (; len >= PAGE_SIZE && n < nr_pages;
+		     len -= PAGE_SIZE, dma += PAGE_SIZE)
+			page_pool_set_dma_addr(pages[n++], dma);
+	}
+	if (WARN_ON_ONCE(n != nr_pages))
+		goto err_unmap;
+
+	for (n = 0; n < nr_pages; n++) {
+		err = xa_err(xa_store_bh(&priv->dma_chunks,
+				      page_to_pfn(pages[n]), chunk, gfp));
+		if (err)
+			goto err_forget;
+	}
+	refcount_set(&chunk->inflight, nr_pages);
+
+	if (pool->p.flags & PP_FLAG_DMA_SYNC_DEV)
+		dma_sync_sgtable_for_device(pool->p.dev, &chunk->sgt,
+					    pool->p.dma_dir);
+
+	priv->dma_maps_saved += nr_pages - 1;
+	trace_page_pool_dma_bulk_map(pool, nr_pages, chunk->sgt.nents,
+				     priv->dma_maps_saved);
+	return true;
+
+err_forget:
+	page_pool_dma_chunk_forget(pool, chunk, n);
+err_unmap:
+	page_pool_dma_chunk_unmap(pool, chunk);
+	for (n = 0; n < nr_pages; n++)
+		page_pool_set_dma_addr(pages[n], 0);
+err_table:
+	sg_free_table(&chunk->sgt);
+err_free:
+	kfree(chunk);
+err_limit:
+	atomic_sub(nr_pages, &priv->dma_bulk_pages);
+	return false;
+}
+
+/* Drop a page's hold on its bulk mapping. The last page out unmaps the range
+ * and releases every page of the batch.
+ */
+static void page_pool_dma_chunk_put(struct page_pool *pool,
+				    struct page_pool_dma_chunk *chunk)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+
+	if (!refcount_dec_and_test(&chunk->inflight))
+		return;
+
+	/* Forget the pfns before the pages can be reused by a new chunk */
+	page_pool_dma_chunk_forget(pool, chunk, chunk->sgt.orig_nents);
+	page_pool_dma_chunk_unmap(pool, chunk);
+	for_each_sgtable_sg(&chunk->sgt, sg, i)
+		put_page(sg_page(sg));
+	atomic_sub(chunk->sgt.orig_nents, &pp_priv(pool)->dma_bulk_pages);
+	sg_free_table(&chunk->sgt);
+	kfree(chunk);
+}
+
 static void page_pool_set_pp_info(struct page_pool *pool,
 				  struct page *page)
 {
@@ -415,6 +594,7 @@ static struct page *__page_pool_alloc_pages_slow(struct page_pool *pool,
 	const int bulk = PP_ALLOC_CACHE_REFILL;
 	unsigned int pp_flags = pool->p.flags;
 	unsigned int pp_order = pool->p.order;
+	bool bulk_mapped = false;
 	struct page *page;
 	int i, nr_pages;
 
@@ -434,12 +614,16 @@ static struct page *__page_pool_alloc_pages_slow(struct page_pool *pool,
 	if (unlikely(!nr_pages))
 		return NULL;
 
+	if (pp_flags & PP_FLAG_DMA_MAP)
+		bulk_mapped = page_pool_dma_map_bulk(pool, pool->alloc.cache,
+						     nr_pages, gfp);
+
 	/* Pages have been filled into alloc.cache array, but count is zero and
 	 * page element have not been (possibly) DMA mapped.
 	 */
 	for (i = 0; i < nr_pages; i++) {
 		page = pool->alloc.cache[i];
-		if ((pp_flags & PP_FLAG_DMA_MAP) &&
+		if ((pp_flags & PP_FLAG_DMA_MAP) && !bulk_mapped &&
 		    unlikely(!page_pool_dma_map(pool, page))) {
 			put_page(page);
 			continue;
@@ -509,6 +693,7 @@ static s32 page_pool_inflight(struct page_pool *pool)
  */
 static void page_pool_return_page(struct page_pool *pool, struct page *page)
 {
+	struct page_pool_dma_chunk *chunk;
 	dma_addr_t dma;
 	int count;
 
@@ -518,6 +703,21 @@ static void page_pool_return_page(struct page_pool *pool, struct page *page)
 		 */
 		goto skip_dma_unmap;
 
+	chunk = pp_priv(pool)->dma_bulk ?
+		xa_load(&pp_priv(pool)->dma_chunks, page_to_pfn(page)) : NULL;
+	if (chunk) {
+		/* The chunk owns the page reference from here on. Put it before
+		 * accounting the release, the chunk still needs the pool.
+		 */
+		page_pool_set_dma_addr(page, 0);
+		page_pool_clear_pp_info(page);
+		page_pool_dma_chunk_put(pool, chunk);
+
+		count = atomic_inc_return_relaxed(&pool->pages_state_release_cnt);
+		trace_page_pool_state_release(pool, page, count);
+		return;
+	}
+
 	dma = page_pool_get_dma_addr(page);
 
 	/* When page is unmapped, it cannot be returned to our pool */
@@ -811,7 +1011,11 @@ static void page_pool_free(struct page_pool *pool)
 #ifdef CONFIG_PAGE_POOL_STATS
 	free_percpu(pool->recycle_stats);
 #endif
-	kfree(pool);
+	if (pool->p.flags & PP_FLAG_DMA_MAP) {
+		WARN_ON(!xa_empty(&pp_priv(pool)->dma_chunks));
+		xa_destroy(&pp_priv(pool)->dma_chunks);
+	}
+	kfree(pp_priv(pool));
 }
 
 static void page_pool_empty_alloc_cache_once(struct page_pool *pool)
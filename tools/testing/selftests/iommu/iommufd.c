@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/capability.h>
 
 #define __EXPORTED_HEADERS__
 #include <linux/vfio.h>
@@ -48,6 +51,10 @@ static __attribute__((constructor)) void setup_sizes(void)
 	vrc = mmap(buffer, BUFFER_SIZE, PROT_READ | PROT_WRITE,
 		   MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
 	assert(vrc == buffer);
+
+	mfd_buffer = memfd_mmap(BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				&mfd);
+	assert(mfd_buffer != MAP_FAILED);
 }
 
 FIXTURE(iommufd)
@@ -116,6 +123,7 @@ TEST_F(iommufd, cmd_length)
 	TEST_LENGTH(iommu_destroy, IOMMU_DESTROY, id);
 	TEST_LENGTH(iommu_hw_info, IOMMU_GET_HW_INFO, __reserved);
 	TEST_LENGTH(iommu_hwpt_alloc, IOMMU_HWPT_ALLOC, __reserved);
+	TEST_LENGTH(iommu_hwpt_collapse, IOMMU_HWPT_COLLAPSE, out_collapsed);
 	TEST_LENGTH(iommu_hwpt_invalidate, IOMMU_HWPT_INVALIDATE, out_driver_error_code);
 	TEST_LENGTH(iommu_ioas_alloc, IOMMU_IOAS_ALLOC, out_ioas_id);
 	TEST_LENGTH(iommu_ioas_iova_ranges, IOMMU_IOAS_IOVA_RANGES,
@@ -187,6 +195,45 @@ TEST_F(iommufd, global_options)
 	EXPECT_ERRNO(ENOENT, ioctl(self->fd, IOMMU_OPTION, &cmd));
 }
 
+TEST_F(iommufd, async_release)
+{
+	struct iommu_option cmd = {
+		.size = sizeof(cmd),
+		.option_id = IOMMU_OPTION_ASYNC_RELEASE,
+		.op = IOMMU_OPTION_OP_GET,
+		.val64 = 1,
+	};
+	uint32_t ioas_id[2];
+	unsigned int i;
+	__u64 iova;
+
+	ASSERT_EQ(0, ioctl(self->fd, IOMMU_OPTION, &cmd));
+	ASSERT_EQ(0, cmd.val64);
+
+	cmd.op = IOMMU_OPTION_OP_SET;
+	cmd.val64 = 2;
+	EXPECT_ERRNO(EINVAL, ioctl(self->fd, IOMMU_OPTION, &cmd));
+	cmd.val64 = 1;
+	ASSERT_EQ(0, ioctl(self->fd, IOMMU_OPTION, &cmd));
+
+	cmd.op = IOMMU_OPTION_OP_GET;
+	ASSERT_EQ(0, ioctl(self->fd, IOMMU_OPTION, &cmd));
+	ASSERT_EQ(1, cmd.val64);
+
+	/* Each IOAS pins the buffer, they are torn down in parallel */
+	for (i = 0; i != ARRAY_SIZE(ioas_id); i++) {
+		test_ioctl_ioas_alloc(&ioas_id[i]);
+		test_cmd_mock_domain(ioas_id[i], 0, NULL, NULL, NULL);
+		ASSERT_EQ(0, _test_ioctl_ioas_map(self->fd, ioas_id[i], buffer,
+						  BUFFER_SIZE, &iova,
+						  IOMMU_IOAS_MAP_WRITEABLE |
+							  IOMMU_IOAS_MAP_READABLE));
+	}
+	check_refs(buffer, BUFFER_SIZE, ARRAY_SIZE(ioas_id));
+
+	/* teardown_iommufd() checks that the close unpinned everything */
+}
+
 FIXTURE(iommufd_ioas)
 {
 	int fd;
@@ -555,6 +602,122 @@ TEST_F(iommufd_ioas, area)
 	test_ioctl_ioas_unmap(0, UINT64_MAX);
 }
 
+TEST_F(iommufd_ioas, map_file)
+{
+	__u64 iova;
+	int i;
+
+	/* Only memfds can be mapped */
+	test_err_ioctl_ioas_map_file(EBADF, -1, 0, BUFFER_SIZE, &iova);
+	test_err_ioctl_ioas_map_file(EINVAL, self->fd, 0, BUFFER_SIZE, &iova);
+	test_err_ioctl_ioas_map_file(EINVAL, mfd, 0, 0, &iova);
+
+	/* With a domain the range is pinned right away and must be in the file */
+	if (self->stdev_id)
+		test_err_ioctl_ioas_map_file(EINVAL, mfd, PAGE_SIZE,
+					     BUFFER_SIZE, &iova);
+
+	test_ioctl_ioas_map_file(mfd, 0, BUFFER_SIZE, &iova);
+	test_ioctl_ioas_unmap(iova, BUFFER_SIZE);
+
+	/* Page sized pieces from different file offsets */
+	for (i = 0; i != 10; i++) {
+		iova = self->base_iova + i * PAGE_SIZE;
+		ASSERT_EQ(0, _test_ioctl_ioas_map_file(
+				     self->fd, self->ioas_id, mfd,
+				     i * PAGE_SIZE, PAGE_SIZE, &iova,
+				     IOMMU_IOAS_MAP_FIXED_IOVA |
+					     IOMMU_IOAS_MAP_WRITEABLE |
+					     IOMMU_IOAS_MAP_READABLE));
+	}
+	test_ioctl_ioas_unmap(0, UINT64_MAX);
+}
+
+TEST_F(iommufd_ioas, map_file_rlimit_mm)
+{
+	struct iommu_option cmd = {
+		.size = sizeof(cmd),
+		.option_id = IOMMU_OPTION_RLIMIT_MODE,
+		.op = IOMMU_OPTION_OP_SET,
+		.val64 = 1,
+	};
+	pid_t child;
+	int status;
+
+	ASSERT_EQ(0, ioctl(self->fd, IOMMU_OPTION, &cmd));
+
+	/* Without CAP_IPC_LOCK the file pages are charged to the mm */
+	child = fork();
+	if (!child) {
+		struct __user_cap_header_struct hdr = {
+			.version = _LINUX_CAPABILITY_VERSION_3,
+		};
+		struct __user_cap_data_struct data[2];
+		struct rlimit rlim = {
+			.rlim_cur = RLIM_INFINITY,
+			.rlim_max = RLIM_INFINITY,
+		};
+		__u64 iova;
+
+		if (setrlimit(RLIMIT_MEMLOCK, &rlim) ||
+		    syscall(SYS_capget, &hdr, data))
+			exit(1);
+		data[CAP_TO_INDEX(CAP_IPC_LOCK)].effective &=
+			~CAP_TO_MASK(CAP_IPC_LOCK);
+		if (syscall(SYS_capset, &hdr, data))
+			exit(1);
+
+		if (_test_ioctl_ioas_map_file(self->fd, self->ioas_id, mfd, 0,
+					      BUFFER_SIZE, &iova,
+					      IOMMU_IOAS_MAP_WRITEABLE |
+						      IOMMU_IOAS_MAP_READABLE))
+			exit(2);
+		if (_test_ioctl_ioas_unmap(self->fd, self->ioas_id, iova,
+					   BUFFER_SIZE, NULL))
+			exit(3);
+		exit(0);
+	}
+	ASSERT_NE(-1, child);
+	ASSERT_EQ(child, waitpid(child, &status, 0));
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+}
+
+TEST_F(iommufd_ioas, map_dmabuf)
+{
+	struct iommu_test_cmd access_cmd = {
+		.size = sizeof(access_cmd),
+		.op = IOMMU_TEST_OP_ACCESS_PAGES,
+		.access_pages = { .length = PAGE_SIZE,
+				  .uptr = (uintptr_t)buffer },
+	};
+	size_t length = 4 * 1024 * 1024;
+	__u64 iova;
+	int dfd;
+
+	test_cmd_dmabuf_get(length, &dfd);
+
+	/* The range must be inside the dma-buf */
+	test_err_ioctl_ioas_map_file(EINVAL, dfd, PAGE_SIZE, length, &iova);
+
+	/* The IOVA keeps the alignment of the MMIO so large IOPTEs can be used */
+	test_ioctl_ioas_map_file(dfd, 0, length, &iova);
+	ASSERT_EQ(0, iova % length);
+
+	/* MMIO has no struct page an access could use */
+	test_cmd_create_access(self->ioas_id, &access_cmd.id,
+			       MOCK_FLAGS_ACCESS_CREATE_NEEDS_PIN_PAGES);
+	access_cmd.access_pages.iova = iova;
+	EXPECT_ERRNO(EINVAL,
+		     ioctl(self->fd, _IOMMU_TEST_CMD(IOMMU_TEST_OP_ACCESS_PAGES),
+			   &access_cmd));
+	test_cmd_destroy_access(access_cmd.id);
+
+	/* The mapping holds its own reference on the dma-buf */
+	ASSERT_EQ(0, close(dfd));
+	test_ioctl_ioas_unmap(iova, length);
+}
+
 TEST_F(iommufd_ioas, unmap_fully_contained_areas)
 {
 	uint64_t unmap_len;
@@ -671,6 +834,44 @@ TEST_F(iommufd_ioas, area_auto_iova)
 		test_ioctl_ioas_unmap(iovas[i], PAGE_SIZE * (i + 1));
 }
 
+TEST_F(iommufd_ioas, area_auto_iova_many)
+{
+	const unsigned int nr = 8192;
+	__u64 *iovas;
+	__u64 iova;
+	unsigned int i;
+
+	iovas = calloc(nr, sizeof(*iovas));
+	ASSERT_NE(NULL, iovas);
+
+	/* The lowest free IOVA is always picked */
+	for (i = 0; i != nr; i++) {
+		test_ioctl_ioas_map(buffer, PAGE_SIZE, &iovas[i]);
+		if (i)
+			ASSERT_LT(iovas[i - 1], iovas[i]);
+	}
+
+	/* Leave single page holes between every area, keep the last one */
+	for (i = 1; i < nr - 1; i += 2)
+		test_ioctl_ioas_unmap(iovas[i], PAGE_SIZE);
+
+	/* None of the holes fit two pages */
+	test_ioctl_ioas_map(buffer, PAGE_SIZE * 2, &iova);
+	EXPECT_EQ(0, iova % (PAGE_SIZE * 2));
+	EXPECT_LT(iovas[nr - 1], iova);
+	test_ioctl_ioas_unmap(iova, PAGE_SIZE * 2);
+
+	/* Single pages go back into the holes, lowest first */
+	for (i = 1; i < nr - 1; i += 2) {
+		test_ioctl_ioas_map(buffer, PAGE_SIZE, &iova);
+		ASSERT_EQ(iovas[i], iova);
+	}
+
+	for (i = 0; i != nr; i++)
+		test_ioctl_ioas_unmap(iovas[i], PAGE_SIZE);
+	free(iovas);
+}
+
 TEST_F(iommufd_ioas, area_allowed)
 {
 	struct iommu_test_cmd test_cmd = {
@@ -947,7 +1148,7 @@ TEST_F(iommufd_ioas, access_pin_unmap)
 
 static void check_access_rw(struct __test_metadata *_metadata, int fd,
 			    unsigned int access_id, uint64_t iova,
-			    unsigned int def_flags)
+			    void *buffer, unsigned int def_flags)
 {
 	uint16_t tmp[32];
 	struct iommu_test_cmd access_cmd = {
@@ -1014,13 +1215,25 @@ TEST_F(iommufd_ioas, access_rw)
 
 	test_cmd_create_access(self->ioas_id, &access_id, 0);
 	test_ioctl_ioas_map(buffer, BUFFER_SIZE, &iova);
-	check_access_rw(_metadata, self->fd, access_id, iova, 0);
-	check_access_rw(_metadata, self->fd, access_id, iova,
+	check_access_rw(_metadata, self->fd, access_id, iova, buffer, 0);
+	check_access_rw(_metadata, self->fd, access_id, iova, buffer,
 			MOCK_ACCESS_RW_SLOW_PATH);
 	test_ioctl_ioas_unmap(iova, BUFFER_SIZE);
 	test_cmd_destroy_access(access_id);
 }
 
+TEST_F(iommufd_ioas, access_rw_file)
+{
+	__u32 access_id;
+	__u64 iova;
+
+	test_cmd_create_access(self->ioas_id, &access_id, 0);
+	test_ioctl_ioas_map_file(mfd, 0, BUFFER_SIZE, &iova);
+	check_access_rw(_metadata, self->fd, access_id, iova, mfd_buffer, 0);
+	test_ioctl_ioas_unmap(iova, BUFFER_SIZE);
+	test_cmd_destroy_access(access_id);
+}
+
 TEST_F(iommufd_ioas, access_rw_unaligned)
 {
 	__u32 access_id;
@@ -1031,7 +1244,7 @@ TEST_F(iommufd_ioas, access_rw_unaligned)
 	/* Unaligned pages */
 	iova = self->base_iova + MOCK_PAGE_SIZE;
 	test_ioctl_ioas_map_fixed(buffer, BUFFER_SIZE, iova);
-	check_access_rw(_metadata, self->fd, access_id, iova, 0);
+	check_access_rw(_metadata, self->fd, access_id, iova, buffer, 0);
 	test_ioctl_ioas_unmap(iova, BUFFER_SIZE);
 	test_cmd_destroy_access(access_id);
 }
@@ -1060,7 +1273,7 @@ TEST_F(iommufd_ioas, fork_gone)
 		 */
 		test_cmd_mock_domain(self->ioas_id, 0, NULL, NULL, NULL);
 		check_access_rw(_metadata, self->fd, access_id,
-				MOCK_APERTURE_START, 0);
+				MOCK_APERTURE_START, buffer, 0);
 
 	} else {
 		/*
@@ -1108,7 +1321,8 @@ TEST_F(iommufd_ioas, fork_present)
 
 	/* Read pages from the remote process */
 	test_cmd_mock_domain(self->ioas_id, 0, NULL, NULL, NULL);
-	check_access_rw(_metadata, self->fd, access_id, MOCK_APERTURE_START, 0);
+	check_access_rw(_metadata, self->fd, access_id, MOCK_APERTURE_START,
+			buffer, 0);
 
 	ASSERT_EQ(0, close(pipefds[1]));
 	ASSERT_EQ(child, waitpid(child, NULL, 0));
@@ -1116,6 +1330,102 @@ TEST_F(iommufd_ioas, fork_present)
 	test_cmd_destroy_access(access_id);
 }
 
+TEST_F(iommufd_ioas, fork_change_process)
+{
+	__u32 access_id;
+	pid_t child;
+	int status;
+
+	test_cmd_create_access(self->ioas_id, &access_id, 0);
+
+	/* Create a mapping with a different mm */
+	child = fork();
+	if (!child) {
+		test_ioctl_ioas_map_fixed(buffer, BUFFER_SIZE,
+					  MOCK_APERTURE_START);
+		exit(0);
+	}
+	ASSERT_NE(-1, child);
+	ASSERT_EQ(child, waitpid(child, NULL, 0));
+
+	/* The shared buffer maps the same pages here */
+	test_ioctl_ioas_change_process(self->ioas_id);
+	test_ioctl_ioas_change_process(self->ioas_id);
+
+	/* Unlike fork_gone pages can be pinned from this mm now */
+	test_cmd_mock_domain(self->ioas_id, 0, NULL, NULL, NULL);
+	check_access_rw(_metadata, self->fd, access_id, MOCK_APERTURE_START,
+			buffer, 0);
+
+	/* A process mapping other pages at the same VA cannot take over */
+	child = fork();
+	if (!child) {
+		if (mmap(buffer, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) !=
+		    buffer)
+			exit(1);
+		if (!_test_ioctl_ioas_change_process(self->fd, self->ioas_id) ||
+		    errno != EINVAL)
+			exit(1);
+		exit(0);
+	}
+	ASSERT_NE(-1, child);
+	ASSERT_EQ(child, waitpid(child, &status, 0));
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	test_cmd_destroy_access(access_id);
+}
+
+TEST_F(iommufd_ioas, change_process_access_rw)
+{
+	uint8_t tmp[64];
+	struct iommu_test_cmd access_cmd = {
+		.size = sizeof(access_cmd),
+		.op = IOMMU_TEST_OP_ACCESS_RW,
+		.access_rw = { .length = sizeof(tmp),
+			       .uptr = (uintptr_t)tmp },
+	};
+	__u32 access_id;
+	__u64 iova;
+	pid_t child;
+	int status;
+	int i;
+
+	test_cmd_create_access(self->ioas_id, &access_id, 0);
+	access_cmd.id = access_id;
+	test_ioctl_ioas_map(buffer, BUFFER_SIZE, &iova);
+	access_cmd.access_rw.iova = iova + PAGE_SIZE - sizeof(tmp) / 2;
+
+	/* The child keeps taking the mapping while the parent reads through it */
+	child = fork();
+	if (!child) {
+		for (i = 0; i != 1000; i++)
+			if (_test_ioctl_ioas_change_process(self->fd,
+							    self->ioas_id))
+				exit(1);
+		exit(0);
+	}
+	ASSERT_NE(-1, child);
+
+	while (!waitpid(child, &status, WNOHANG)) {
+		test_ioctl_ioas_change_process(self->ioas_id);
+		/* Fails if the child took the mapping and is gone already */
+		ioctl(self->fd, _IOMMU_TEST_CMD(IOMMU_TEST_OP_ACCESS_RW),
+		      &access_cmd);
+	}
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	test_ioctl_ioas_change_process(self->ioas_id);
+	ASSERT_EQ(0, ioctl(self->fd, _IOMMU_TEST_CMD(IOMMU_TEST_OP_ACCESS_RW),
+			   &access_cmd));
+	ASSERT_EQ(0, memcmp(buffer + PAGE_SIZE - sizeof(tmp) / 2, tmp,
+			    sizeof(tmp)));
+
+	test_cmd_destroy_access(access_id);
+}
+
 TEST_F(iommufd_ioas, ioas_option_huge_pages)
 {
 	struct iommu_option cmd = {
@@ -1615,6 +1925,37 @@ TEST_F(iommufd_mock_domain, alloc_hwpt)
 	}
 }
 
+TEST_F(iommufd_mock_domain, collapse)
+{
+	__u64 collapsed;
+	__u64 iova;
+	int i;
+
+	test_ioctl_ioas_map(buffer, BUFFER_SIZE, &iova);
+
+	for (i = 0; i != variant->mock_domains; i++) {
+		/* The mock page size never allows a huge IOPTE */
+		collapsed = 1;
+		test_cmd_hwpt_collapse(self->hwpt_ids[i], iova, BUFFER_SIZE,
+				       &collapsed);
+		ASSERT_EQ(0, collapsed);
+
+		/* Unmapped IOVA around the area is skipped */
+		collapsed = 1;
+		test_cmd_hwpt_collapse(self->hwpt_ids[i], MOCK_APERTURE_START,
+				       MOCK_APERTURE_LAST - MOCK_APERTURE_START + 1,
+				       &collapsed);
+		ASSERT_EQ(0, collapsed);
+
+		test_err_hwpt_collapse(EINVAL, self->hwpt_ids[i], iova, 0);
+		test_err_hwpt_collapse(EINVAL, self->hwpt_ids[i], iova + 1,
+				       PAGE_SIZE);
+		test_err_hwpt_collapse(EOVERFLOW, self->hwpt_ids[i], iova,
+				       UINT64_MAX);
+	}
+	test_err_hwpt_collapse(ENOENT, self->ioas_id, iova, PAGE_SIZE);
+}
+
 TEST_F(iommufd_mock_domain, set_dev_data)
 {
 	struct iommu_test_device_data dev_data = {
@@ -9,6 +9,7 @@
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #include "../kselftest_harness.h"
 #include "../../../../drivers/iommu/iommufd/iommufd_test.h"
@@ -19,8 +20,24 @@
 static void *buffer;
 static unsigned long BUFFER_SIZE;
 
+static void *mfd_buffer;
+static int mfd;
+
 static unsigned long PAGE_SIZE;
 
+static inline void *memfd_mmap(size_t length, int prot, int flags, int *mfd_p)
+{
+	int mfd_flags = (flags & MAP_HUGETLB) ? MFD_HUGETLB : 0;
+	int mfd = memfd_create("buffer", mfd_flags);
+
+	if (mfd <= 0)
+		return MAP_FAILED;
+	if (ftruncate(mfd, length))
+		return MAP_FAILED;
+	*mfd_p = mfd;
+	return mmap(0, length, prot, flags, mfd, 0);
+}
+
 #define sizeof_field(TYPE, MEMBER) sizeof((((TYPE *)0)->MEMBER))
 #define offsetofend(TYPE, MEMBER) \
 	(offsetof(TYPE, MEMBER) + sizeof_field(TYPE, MEMBER))
@@ -208,6 +225,29 @@ static int _test_cmd_hwpt_invalidate(int fd, __u32 hwpt_id, void *reqs,
 						       driver_error));    \
 	})
 
+static int _test_cmd_hwpt_collapse(int fd, __u32 hwpt_id, __u64 iova,
+				   __u64 length, __u64 *collapsed)
+{
+	struct iommu_hwpt_collapse cmd = {
+		.size = sizeof(cmd),
+		.hwpt_id = hwpt_id,
+		.iova = iova,
+		.length = length,
+	};
+	int rc = ioctl(fd, IOMMU_HWPT_COLLAPSE, &cmd);
+
+	if (collapsed)
+		*collapsed = cmd.out_collapsed;
+	return rc;
+}
+
+#define test_cmd_hwpt_collapse(hwpt_id, iova, length, collapsed)              \
+	ASSERT_EQ(0, _test_cmd_hwpt_collapse(self->fd, hwpt_id, iova, length, \
+					     collapsed))
+#define test_err_hwpt_collapse(_errno, hwpt_id, iova, length)                 \
+	EXPECT_ERRNO(_errno, _test_cmd_hwpt_collapse(self->fd, hwpt_id, iova, \
+						     length, NULL))
+
 static int _test_cmd_access_replace_ioas(int fd, __u32 access_id,
 					 unsigned int ioas_id)
 {
@@ -363,6 +403,60 @@ static int _test_ioctl_ioas_map(int fd, unsigned int ioas_id, void *buffer,
 					     IOMMU_IOAS_MAP_READABLE));       \
 	})
 
+static int _test_ioctl_ioas_map_file(int fd, unsigned int ioas_id, int mfd,
+				     size_t start, size_t length, __u64 *iova,
+				     unsigned int flags)
+{
+	struct iommu_ioas_map_file cmd = {
+		.size = sizeof(cmd),
+		.flags = flags,
+		.ioas_id = ioas_id,
+		.fd = mfd,
+		.start = start,
+		.length = length,
+	};
+	int ret;
+
+	if (flags & IOMMU_IOAS_MAP_FIXED_IOVA)
+		cmd.iova = *iova;
+
+	ret = ioctl(fd, IOMMU_IOAS_MAP_FILE, &cmd);
+	*iova = cmd.iova;
+	return ret;
+}
+
+#define test_ioctl_ioas_map_file(mfd, start, length, iova_p)                 \
+	ASSERT_EQ(0,                                                         \
+		  _test_ioctl_ioas_map_file(self->fd, self->ioas_id, mfd,    \
+					    start, length, iova_p,           \
+					    IOMMU_IOAS_MAP_WRITEABLE |       \
+						    IOMMU_IOAS_MAP_READABLE))
+
+#define test_err_ioctl_ioas_map_file(_errno, mfd, start, length, iova_p)     \
+	EXPECT_ERRNO(_errno,                                                 \
+		     _test_ioctl_ioas_map_file(self->fd, self->ioas_id, mfd, \
+					       start, length, iova_p,        \
+					       IOMMU_IOAS_MAP_WRITEABLE |    \
+						       IOMMU_IOAS_MAP_READABLE))
+
+static int _test_cmd_dmabuf_get(int fd, size_t length, int *out_fd)
+{
+	struct iommu_test_cmd cmd = {
+		.size = sizeof(cmd),
+		.op = IOMMU_TEST_OP_DMABUF_GET,
+		.dmabuf_get = { .length = length, .open_flags = O_CLOEXEC },
+	};
+	int ret;
+
+	ret = ioctl(fd, IOMMU_TEST_CMD, &cmd);
+	if (ret)
+		return ret;
+	*out_fd = cmd.dmabuf_get.out_fd;
+	return 0;
+}
+#define test_cmd_dmabuf_get(length, out_fd) \
+	ASSERT_EQ(0, _test_cmd_dmabuf_get(self->fd, length, out_fd))
+
 static int _test_ioctl_ioas_unmap(int fd, unsigned int ioas_id, uint64_t iova,
 				  size_t length, uint64_t *out_len)
 {
@@ -391,6 +485,18 @@ static int _test_ioctl_ioas_unmap(int fd, unsigned int ioas_id, uint64_t iova,
 	EXPECT_ERRNO(_errno, _test_ioctl_ioas_unmap(self->fd, self->ioas_id, \
 						    iova, length, NULL))
 
+static int _test_ioctl_ioas_change_process(int fd, unsigned int ioas_id)
+{
+	struct iommu_ioas_change_process cmd = {
+		.size = sizeof(cmd),
+		.ioas_id = ioas_id,
+	};
+
+	return ioctl(fd, IOMMU_IOAS_CHANGE_PROCESS, &cmd);
+}
+#define test_ioctl_ioas_change_process(ioas_id) \
+	ASSERT_EQ(0, _test_ioctl_ioas_change_process(self->fd, ioas_id))
+
 static int _test_ioctl_set_temp_memory_limit(int fd, unsigned int limit)
 {
 	struct iommu_test_cmd memlimit_cmd = {